@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#undef BLOCK_SIZE   // <linux/fs.h>, pulled in above, has one of its own
+#include "aio.h"
+#include "stats.h"
+
+namespace {
+
+// the ring indices are shared with the kernel
+unsigned load_acquire(unsigned *p)
+{
+    return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+}
+
+void store_release(unsigned *p, unsigned v)
+{
+    std::atomic_ref<unsigned>(*p).store(v, std::memory_order_release);
+}
+
+} // namespace
+
+AioQueue::AioQueue(Disk &disk, unsigned depth)
+  : disk(disk), max_depth(std::max(1u, depth))
+{
+    if (!setup_ring())
+        teardown_ring();
+}
+
+AioQueue::~AioQueue()
+{
+    drain();
+    {
+        std::lock_guard<std::mutex> hold(pool_lock);
+        stopping = true;
+    }
+    work_cv.notify_all();
+    for (auto &t : workers)
+        t.join();
+    teardown_ring();
+}
+
+bool
+AioQueue::setup_ring()
+{
+    if (disk.backend != DISK_FD || disk.fd < 0)
+        return false;
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, max_depth, &p);
+    if (fd < 0)
+        return false;
+    ring_fd = fd;
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    void *m = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQ_RING);
+    if (m == MAP_FAILED)
+        return false;
+    sq_ring = m;
+    if (single) {
+        cq_ring = sq_ring;
+    } else {
+        m = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 fd, IORING_OFF_CQ_RING);
+        if (m == MAP_FAILED)
+            return false;
+        cq_ring = m;
+    }
+    sqe_size = p.sq_entries * sizeof(io_uring_sqe);
+    m = mmap(nullptr, sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             fd, IORING_OFF_SQES);
+    if (m == MAP_FAILED)
+        return false;
+    sqe_mem = m;
+
+    auto *sq = static_cast<uint8_t*>(sq_ring);
+    auto *cq = static_cast<uint8_t*>(cq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes = cq + p.cq_off.cqes;
+
+    slots.resize(max_depth);
+    for (unsigned i = max_depth; i-- > 0; )
+        free_slots.push_back(i);
+    return true;
+}
+
+void
+AioQueue::teardown_ring()
+{
+    if (sqe_mem)
+        munmap(sqe_mem, sqe_size);
+    if (cq_ring && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring)
+        munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+    sqe_mem = sq_ring = cq_ring = nullptr;
+    ring_fd = -1;
+}
+
+int
+AioQueue::run(const Request &r)
+{
+    if (r.write) {
+        BlockWrite io{r.block_no, r.buf};
+        return disk.writev(&io, 1);
+    }
+    BlockRead io{r.block_no, r.buf};
+    return disk.readv(&io, 1);
+}
+
+int
+AioQueue::read(unsigned block_no, uint8_t *buf, uint64_t tag)
+{
+    return queue({false, block_no, buf, tag});
+}
+
+int
+AioQueue::write(unsigned block_no, const uint8_t *buf, uint64_t tag)
+{
+    return queue({true, block_no, const_cast<uint8_t*>(buf), tag});
+}
+
+int
+AioQueue::queue(const Request &r)
+{
+    if (in_flight() >= max_depth || r.block_no >= disk.get_no_blocks())
+        return -1;
+    {
+        auto hold = disk.guard();
+        if (disk.cache.capacity() > 0) {
+            // a cached copy may be newer than the file: reads are served
+            // from it, and writes replace it now, so that no write-back of
+            // an older copy can land after ours
+            if (r.write) {
+                disk.ra_written(r.block_no);
+                disk.cache.overwrite(r.block_no, r.buf);
+            } else if (disk.cache.read(r.block_no, r.buf)) {
+                ready.push_back({r.tag, 0});
+                return 0;
+            }
+        }
+    }
+    // the mapping is plain memory, and O_DIRECT cannot use the buffer
+    // as it is; run those right away
+    bool unaligned = disk.direct && reinterpret_cast<uintptr_t>(r.buf) % CACHE_ALIGN;
+    if (disk.map || unaligned) {
+        ready.push_back({r.tag, run(r)});
+        return 0;
+    }
+    // the pool's transfers go through the Disk, which counts them
+    ++engine;
+    if (uring())
+        return queue_ring(r);
+    queue_pool(r);
+    return 0;
+}
+
+int
+AioQueue::queue_ring(const Request &r)
+{
+    unsigned slot = free_slots.back();
+    free_slots.pop_back();
+    slots[slot] = r;
+    unsigned tail = *sq_tail;   // only this thread moves the tail
+    unsigned idx = tail & *sq_mask;
+    auto *sqe = static_cast<io_uring_sqe*>(sqe_mem) + idx;
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = disk.fd;
+    sqe->off = (uint64_t)r.block_no * BLOCK_SIZE;
+    sqe->addr = reinterpret_cast<uint64_t>(r.buf);
+    sqe->len = BLOCK_SIZE;
+    sqe->user_data = slot;
+    sq_array[idx] = idx;
+    store_release(sq_tail, tail + 1);
+    ++unsubmitted;
+    TRACE(r.write ? "write" : "read", r.block_no, 1);
+    return 0;
+}
+
+size_t
+AioQueue::reap_ring(AioDone *out, size_t max, bool wait)
+{
+    size_t n = 0;
+    for (;;) {
+        unsigned head = *cq_head;
+        bool empty = head == load_acquire(cq_tail);
+        bool block = wait && n == 0 && empty;
+        if (unsubmitted || block) {
+            unsigned flags = block ? IORING_ENTER_GETEVENTS : 0;
+            int rc = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, block ? 1 : 0,
+                             flags, nullptr, 0);
+            if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                std::cout << "AioQueue - ERROR: io_uring_enter failed: " << std::strerror(errno) << "\n";
+                return n;
+            }
+            if (rc > 0)
+                unsubmitted -= std::min<unsigned>(rc, unsubmitted);
+        }
+        unsigned tail = load_acquire(cq_tail);
+        while (head != tail && n < max) {
+            auto &cqe = static_cast<io_uring_cqe*>(cqes)[head & *cq_mask];
+            unsigned slot = cqe.user_data;
+            Request r = slots[slot];
+            free_slots.push_back(slot);
+            // short transfers and errors such as an unsupported opcode are
+            // finished with the synchronous call, which counts the block
+            int result = 0;
+            if (cqe.res == BLOCK_SIZE)
+                stat_add(r.write ? STAT_BLOCKS_WRITTEN : STAT_BLOCKS_READ);
+            else
+                result = run(r);
+            out[n++] = {r.tag, result};
+            ++head;
+        }
+        store_release(cq_head, head);
+        if (n > 0 || !wait || free_slots.size() == max_depth)
+            return n;
+    }
+}
+
+void
+AioQueue::queue_pool(const Request &r)
+{
+    std::lock_guard<std::mutex> hold(pool_lock);
+    if (workers.empty()) {
+        unsigned n = std::min<unsigned>(AIO_THREADS, max_depth);
+        for (unsigned i = 0; i < n; ++i)
+            workers.emplace_back([this] { worker(); });
+    }
+    todo.push_back(r);
+    work_cv.notify_one();
+}
+
+void
+AioQueue::worker()
+{
+    std::unique_lock<std::mutex> hold(pool_lock);
+    for (;;) {
+        work_cv.wait(hold, [this] { return stopping || !todo.empty(); });
+        if (todo.empty())
+            return;
+        Request r = todo.front();
+        todo.pop_front();
+        hold.unlock();
+        int result = run(r);
+        hold.lock();
+        finished.push_back({r.tag, result});
+        done_cv.notify_one();
+    }
+}
+
+size_t
+AioQueue::reap_pool(AioDone *out, size_t max, bool wait)
+{
+    std::unique_lock<std::mutex> hold(pool_lock);
+    if (wait)
+        done_cv.wait(hold, [this] { return !finished.empty(); });
+    size_t n = std::min(max, finished.size());
+    std::copy(finished.begin(), finished.begin() + n, out);
+    finished.erase(finished.begin(), finished.begin() + n);
+    return n;
+}
+
+size_t
+AioQueue::reap(AioDone *out, size_t max, bool wait)
+{
+    size_t n = 0;
+    while (n < max && !ready.empty()) {
+        out[n++] = ready.back();
+        ready.pop_back();
+    }
+    // the ring is entered even when out is full, so queued requests are
+    // always submitted
+    if (engine > 0 && (n < max || unsubmitted)) {
+        bool block = wait && n == 0;
+        size_t got = uring() ? reap_ring(out + n, max - n, block)
+                             : reap_pool(out + n, max - n, block);
+        engine -= got;
+        n += got;
+    }
+    return n;
+}
+
+void
+AioQueue::drain()
+{
+    AioDone done[16];
+    while (in_flight() > 0 && reap(done, 16, true) > 0)
+        ;
+}
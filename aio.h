@@ -0,0 +1,94 @@
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "disk.h"
+
+#ifndef __AIO_H__
+#define __AIO_H__
+
+#define AIO_DEPTH 32       // default number of requests in flight
+#define AIO_THREADS 4      // workers of the thread-pool fallback
+
+// a finished request: the tag it was queued with, 0 or -1
+struct AioDone {
+    uint64_t tag;
+    int result;
+};
+
+// Asynchronous block transfers on a Disk. read() and write() queue a
+// request and return at once; requests complete in any order and reap()
+// hands back their tags. On a DISK_FD disk the requests go to an io_uring;
+// other backends, or kernels without io_uring, get a small thread pool
+// that runs them through the Disk's synchronous calls. Blocks the block
+// cache holds complete immediately, and writes bypass the cache the way
+// Disk::writev() does. A queue is meant for one thread; buffers must stay
+// valid until their request has been reaped.
+class AioQueue {
+private:
+    struct Request {
+        bool write;
+        unsigned block_no;
+        uint8_t *buf;
+        uint64_t tag;
+    };
+
+    Disk &disk;
+    unsigned max_depth;
+    unsigned engine = 0;                // handed to the ring or the pool
+    std::vector<AioDone> ready;         // finished without reaching either
+
+    // io_uring, driven through the raw system calls
+    int ring_fd = -1;
+    void *sq_ring = nullptr, *cq_ring = nullptr;
+    size_t sq_ring_size = 0, cq_ring_size = 0;
+    void *sqe_mem = nullptr;
+    size_t sqe_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *cqes;
+    unsigned unsubmitted = 0;           // queued in the ring, not yet entered
+    std::vector<Request> slots;         // indexed by the ring's user_data
+    std::vector<unsigned> free_slots;
+
+    // thread-pool fallback, started on first use
+    std::vector<std::thread> workers;
+    std::mutex pool_lock;
+    std::condition_variable work_cv, done_cv;
+    std::deque<Request> todo;
+    std::vector<AioDone> finished;
+    bool stopping = false;
+
+    bool setup_ring();
+    void teardown_ring();
+    int queue_ring(const Request &r);
+    size_t reap_ring(AioDone *out, size_t max, bool wait);
+    void queue_pool(const Request &r);
+    size_t reap_pool(AioDone *out, size_t max, bool wait);
+    void worker();
+    // the synchronous path, also used to finish short io_uring transfers
+    int run(const Request &r);
+    int queue(const Request &r);
+
+public:
+    AioQueue(Disk &disk, unsigned depth = AIO_DEPTH);
+    // waits for every request still in flight
+    ~AioQueue();
+
+    bool uring() const { return ring_fd >= 0; }
+    unsigned depth() const { return max_depth; }
+    unsigned in_flight() const { return engine + ready.size(); }
+    // queue a transfer of one block; -1 if depth() requests are in flight
+    // or the block number is invalid
+    int read(unsigned block_no, uint8_t *buf, uint64_t tag);
+    int write(unsigned block_no, const uint8_t *buf, uint64_t tag);
+    // submits everything queued and collects up to max completions; with
+    // wait it blocks until there is at least one, unless nothing is queued
+    size_t reap(AioDone *out, size_t max, bool wait);
+    // reaps and discards everything in flight
+    void drain();
+};
+
+#endif // __AIO_H__
@@ -0,0 +1,166 @@
+// batch.cpp: shell commands from a script or a socket, without prompts
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "batch.h"
+#include "commands.h"
+
+namespace {
+
+// std::cin and std::cout over a socket
+class FdBuf : public std::streambuf {
+    int fd;
+    char in[SINK_BUF];
+    char out[SINK_BUF];
+public:
+    explicit FdBuf(int fd) : fd(fd) {
+        setg(in, in, in);
+        setp(out, out + sizeof(out));
+    }
+    ~FdBuf() override { sync(); }
+protected:
+    int underflow() override {
+        ssize_t n;
+        do n = ::read(fd, in, sizeof(in));
+        while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return traits_type::eof();
+        setg(in, in, in + n);
+        return traits_type::to_int_type(in[0]);
+    }
+    int overflow(int c) override {
+        if (sync() != 0)
+            return traits_type::eof();
+        if (c != traits_type::eof()) {
+            *pptr() = c;
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+    int sync() override {
+        OutputSink sink(fd);
+        int rc = sink.write(pbase(), pptr() - pbase());
+        setp(out, out + sizeof(out));
+        return rc == 0 && sink.flush() == 0 ? 0 : -1;
+    }
+};
+
+} // namespace
+
+int
+run_batch(FS &fs, std::istream &in, const BatchOptions &opts, bool *quit)
+{
+    // create reads its data from std::cin
+    std::streambuf *old_in = std::cin.rdbuf(in.rdbuf());
+    CmdContext ctx{fs, false};
+    std::string line;
+    std::string_view words[CMD_WORDS];
+    size_t pending = 0;              // changes since the last sync
+    int failed = 0;
+    while (!ctx.quit && std::getline(std::cin, line)) {
+        size_t n = split_words(line, words, CMD_WORDS);
+        if (n == 0)
+            continue;
+        const Command *c = find_command(words[0]);
+        bool changes = c && c->changes;
+        if (pending > 0 && !changes) {
+            fs.sync();
+            pending = 0;
+        }
+        if (opts.echo)
+            std::cout << "filesystem> " << line << "\n";
+        int rc;
+        run_command(ctx, words, n, &rc);
+        if (rc != 0) ++failed;
+        if (changes && ++pending >= opts.group) {
+            fs.sync();
+            pending = 0;
+        }
+    }
+    if (pending > 0)
+        fs.sync();
+    std::cout.flush();
+    std::cin.rdbuf(old_in);
+    if (quit) *quit = ctx.quit;
+    return failed;
+}
+
+int
+serve_batch(FS &fs, const char *path, const BatchOptions &opts)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (std::strlen(path) >= sizeof(addr.sun_path)) {
+        std::cout << "Error: socket path too long: " << path << "\n";
+        return -1;
+    }
+    std::strcpy(addr.sun_path, path);
+    int ls = socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(path);
+    if (ls < 0 || bind(ls, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(ls, 4) != 0) {
+        std::cout << "Error: cannot listen on " << path << ": " << std::strerror(errno) << "\n";
+        if (ls >= 0) ::close(ls);
+        return -1;
+    }
+    bool stop = false;
+    while (!stop) {
+        int conn = accept(ls, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        FdBuf buf(conn);
+        std::istream in(&buf);
+        std::streambuf *old_out = std::cout.rdbuf(&buf);
+        run_batch(fs, in, opts, &stop);
+        std::cout.rdbuf(old_out);
+        buf.pubsync();
+        ::close(conn);
+    }
+    ::close(ls);
+    ::unlink(path);
+    return 0;
+}
+
+int
+batch_main(int argc, char **argv)
+{
+    const char *usage = " [-g group] [-e] (-b script | -s socket)\n";
+    BatchOptions opts;
+    const char *script = nullptr, *socket_path = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:s:g:e")) != -1) {
+        switch (opt) {
+        case 'b': script = optarg; break;
+        case 's': socket_path = optarg; break;
+        case 'g': opts.group = std::max(1L, std::atol(optarg)); break;
+        case 'e': opts.echo = true; break;
+        default:
+            std::cout << "Usage: " << argv[0] << usage;
+            return 2;
+        }
+    }
+    if (!script == !socket_path || optind != argc) {
+        std::cout << "Usage: " << argv[0] << usage;
+        return 2;
+    }
+    FS fs;
+    if (socket_path)
+        return serve_batch(fs, socket_path, opts) == 0 ? 0 : 1;
+    if (std::strcmp(script, "-") == 0)
+        return run_batch(fs, std::cin, opts) == 0 ? 0 : 1;
+    std::ifstream in(script);
+    if (!in) {
+        std::cout << "Error: cannot open " << script << "\n";
+        return 1;
+    }
+    return run_batch(fs, in, opts) == 0 ? 0 : 1;
+}
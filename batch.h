@@ -0,0 +1,33 @@
+#include <cstddef>
+#include <iosfwd>
+#include "fs.h"
+
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#define BATCH_GROUP 1024   // commands that change the disk per sync
+
+struct BatchOptions {
+    size_t group = BATCH_GROUP;   // 1 syncs after every command, like the shell
+    bool echo = false;            // print each command before running it
+};
+
+// Runs shell commands read from in, without prompts; the data lines of a
+// create follow it in the input as they do in the shell. The interactive
+// shell syncs after every command. Here a run of consecutive commands that
+// change the file system shares one sync (every opts.group of them, and
+// before the next command that only reads), and their metadata joins the
+// journal's running group in the meantime. Stops at quit or at the end of
+// in, and returns the number of commands that failed; *quit tells which.
+int run_batch(FS &fs, std::istream &in, const BatchOptions &opts, bool *quit = nullptr);
+
+// Listens on the unix socket path and runs each connection as a batch,
+// one at a time, with the output going back over the connection. A batch
+// that ends in quit stops the server.
+int serve_batch(FS &fs, const char *path, const BatchOptions &opts);
+
+// main() with arguments: filesystem [-g group] [-e] (-b script | -s socket);
+// script - reads the commands from stdin
+int batch_main(int argc, char **argv);
+
+#endif // __BATCH_H__
@@ -0,0 +1,239 @@
+// bench.cpp: timings of the FS hot paths
+//
+//   ./bench [-n files] [-s bytes] [-d depth] [-b blocks] [-j out.json]
+//
+// Formats diskfile.bin (blocks long), runs each case below against FS
+// directly and prints ops/s and latency percentiles per case; the same
+// numbers, with a log2 histogram of the latencies, go to out.json
+// (bench.json by default) for comparing builds. Whatever FS prints while
+// an operation is timed is thrown away.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fs.h"
+
+struct Result {
+    std::string name;
+    std::vector<uint64_t> ns{};  // latency of each operation
+    uint64_t bytes = 0;          // moved by all operations, if that means anything
+    double secs = 0;             // wall time of the whole case
+    int failed = 0;
+};
+
+class NullBuf : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char *, std::streamsize n) override { return n; }
+};
+
+static NullBuf null_buf;
+static std::vector<Result> results;
+
+// op(i) for i in [0, n), each one timed with FS output muted
+template <class Op>
+static Result &measure(const std::string &name, size_t n, Op op, uint64_t bytes_per_op = 0) {
+    results.push_back({name});
+    Result &r = results.back();
+    r.ns.reserve(n);
+    std::streambuf *out = std::cout.rdbuf(&null_buf);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        if (op(i) != 0) ++r.failed;
+        auto t1 = std::chrono::steady_clock::now();
+        r.ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+    }
+    r.secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout.rdbuf(out);
+    r.bytes = bytes_per_op * n;
+    return r;
+}
+
+// untimed setup with FS output muted
+template <class Fn>
+static void quiet(Fn fn) {
+    std::streambuf *out = std::cout.rdbuf(&null_buf);
+    fn();
+    std::cout.rdbuf(out);
+}
+
+// create() reads the file's lines from std::cin up to an empty line
+static int create_file(FS &fs, const std::string &path, const std::string &data) {
+    std::istringstream in(data + "\n");
+    std::streambuf *old = std::cin.rdbuf(in.rdbuf());
+    int rc = fs.create(path);
+    std::cin.rdbuf(old);
+    return rc;
+}
+
+// size bytes of text in lines of up to 64 characters, none of them empty
+static std::string text(size_t size) {
+    std::string s(size, 'x');
+    for (size_t i = 63; i < size; i += 64) s[i] = '\n';
+    if (size > 0) s[size - 1] = '\n';
+    return s;
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[i];
+}
+
+static void report(const char *json_path, const char *argv_line) {
+    std::printf("%-14s %8s %12s %10s %10s %10s %10s\n",
+                "case", "ops", "ops/s", "p50 us", "p99 us", "p999 us", "MB/s");
+    std::ofstream js(json_path);
+    js << "{\n  \"block_size\": " << BLOCK_SIZE << ",\n  \"args\": \"" << argv_line
+       << "\",\n  \"cases\": [";
+    bool first = true;
+    for (Result &r : results) {
+        std::vector<uint64_t> s = r.ns;
+        std::sort(s.begin(), s.end());
+        double ops = r.secs > 0 ? s.size() / r.secs : 0;
+        double mbs = r.secs > 0 ? r.bytes / r.secs / 1e6 : 0;
+        std::printf("%-14s %8zu %12.0f %10.1f %10.1f %10.1f",
+                    r.name.c_str(), s.size(), ops, percentile(s, 0.50) / 1e3,
+                    percentile(s, 0.99) / 1e3, percentile(s, 0.999) / 1e3);
+        if (r.bytes) std::printf(" %10.1f", mbs);
+        if (r.failed) std::printf("  (%d failed)", r.failed);
+        std::printf("\n");
+
+        // bucket k counts latencies in [2^k, 2^(k+1)) ns
+        std::vector<uint64_t> hist;
+        for (uint64_t v : s) {
+            unsigned k = v ? 63 - __builtin_clzll(v) : 0;
+            if (hist.size() <= k) hist.resize(k + 1);
+            ++hist[k];
+        }
+        js << (first ? "" : ",") << "\n    {\"name\": \"" << r.name << "\", \"ops\": " << s.size()
+           << ", \"failed\": " << r.failed << ", \"secs\": " << r.secs
+           << ", \"ops_per_sec\": " << ops << ", \"bytes\": " << r.bytes
+           << ", \"p50_ns\": " << percentile(s, 0.50) << ", \"p99_ns\": " << percentile(s, 0.99)
+           << ", \"p999_ns\": " << percentile(s, 0.999) << ", \"max_ns\": " << (s.empty() ? 0 : s.back())
+           << ", \"log2_hist_ns\": [";
+        for (size_t k = 0; k < hist.size(); ++k) js << (k ? ", " : "") << hist[k];
+        js << "]}";
+        first = false;
+    }
+    js << "\n  ]\n}\n";
+    std::printf("results written to %s\n", json_path);
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t nfiles = 2000, fsize = 4096, depth = 16;
+    unsigned blocks = 65536;
+    const char *json = "bench.json";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:d:b:j:")) != -1) {
+        switch (opt) {
+        case 'n': nfiles = std::strtoul(optarg, nullptr, 10); break;
+        case 's': fsize = std::strtoul(optarg, nullptr, 10); break;
+        case 'd': depth = std::strtoul(optarg, nullptr, 10); break;
+        case 'b': blocks = std::strtoul(optarg, nullptr, 10); break;
+        case 'j': json = optarg; break;
+        default:
+            std::fprintf(stderr, "usage: %s [-n files] [-s bytes] [-d depth] [-b blocks] [-j out.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    std::string args;
+    for (int i = 1; i < argc; ++i) args += std::string(i > 1 ? " " : "") + argv[i];
+
+    FS fs;
+    if (fs.format(blocks) != 0) return 1;
+    int null_fd = ::open("/dev/null", O_WRONLY);
+    const std::string data = text(fsize);
+
+    // create N files of size S in one directory, then list it
+    quiet([&] { fs.mkdir("/many"); });
+    measure("create", nfiles, [&](size_t i) {
+        return create_file(fs, "/many/f" + std::to_string(i), data);
+    }, fsize);
+    measure("ls", 50, [&](size_t) {
+        if (fs.cd("/many") != 0) return -1;
+        int rc = fs.ls();
+        return fs.cd("/") != 0 ? -1 : rc;
+    });
+    measure("ls_fd", 50, [&](size_t) {
+        OutputSink out(null_fd);
+        if (fs.cd("/many") != 0) return -1;
+        int rc = fs.ls(out);
+        return fs.cd("/") != 0 ? -1 : rc;
+    });
+
+    // path lookups through depth nested directories
+    std::string deep;
+    quiet([&] {
+        for (size_t d = 0; d < depth; ++d) {
+            deep += "/d" + std::to_string(d);
+            fs.mkdir(deep);
+        }
+    });
+    measure("resolve", 20000, [&](size_t) {
+        return fs.cd(deep) != 0 || fs.cd("/") != 0 ? -1 : 0;
+    });
+
+    // sequential reads of large files
+    const size_t big = std::min<size_t>(16 << 20, (size_t)blocks * BLOCK_SIZE / 8);
+    quiet([&] { create_file(fs, "/big", text(big)); });
+    measure("cat", 20, [&](size_t) { return fs.cat("/big"); }, big);
+    measure("cat_fd", 20, [&](size_t) {
+        OutputSink out(null_fd);
+        return fs.cat("/big", out);
+    }, big);
+    int fd = fs.open("/big", OPEN_READ);
+    std::vector<uint8_t> buf(BLOCK_SIZE);
+    std::mt19937 rng(1);
+    measure("pread_random", 20000, [&](size_t) {
+        uint64_t off = rng() % (big - BLOCK_SIZE);
+        return fs.pread(fd, buf.data(), buf.size(), off) == (ssize_t)buf.size() ? 0 : -1;
+    }, BLOCK_SIZE);
+    fs.close(fd);
+
+    // copies of copies, and a log that keeps growing
+    const size_t mid = std::min<size_t>(1 << 20, big);
+    quiet([&] { create_file(fs, "/c0", text(mid)); });
+    measure("cp", 50, [&](size_t i) {
+        return fs.cp("/c" + std::to_string(i), "/c" + std::to_string(i + 1));
+    }, mid);
+    quiet([&] { create_file(fs, "/log", data); create_file(fs, "/line", text(100)); });
+    measure("append", 2000, [&](size_t) { return fs.append("/line", "/log"); }, 100);
+
+    // remove every other file and refill the holes, so the free space is
+    // scattered, then create and remove in random order on top of that
+    measure("rm", nfiles / 2, [&](size_t i) {
+        return fs.rm("/many/f" + std::to_string(2 * i));
+    });
+    measure("create_frag", nfiles / 2, [&](size_t i) {
+        return create_file(fs, "/many/g" + std::to_string(i), text(fsize * 3));
+    }, fsize * 3);
+    std::vector<std::string> live;
+    for (size_t i = 0; i < nfiles / 2; ++i) live.push_back("/many/f" + std::to_string(2 * i + 1));
+    size_t next = 0;
+    measure("churn", nfiles, [&](size_t) {
+        if (!live.empty() && rng() % 2) {
+            size_t k = rng() % live.size();
+            std::swap(live[k], live.back());
+            int rc = fs.rm(live.back());
+            live.pop_back();
+            return rc;
+        }
+        live.push_back("/many/h" + std::to_string(next++));
+        return create_file(fs, live.back(), text(1 + rng() % (4 * fsize)));
+    });
+
+    report(json, args.c_str());
+    return 0;
+}
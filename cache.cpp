@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include "cache.h"
+#include "stats.h"
+
+BlockCache::BlockCache(unsigned capacity, unsigned block_size, WritebackFn writeback)
+  : block_size(block_size),
+    frames(capacity, Frame{0, false, false, false}),
+    writeback(std::move(writeback))
+{
+    size_t bytes = (size_t)capacity * block_size;
+    if (bytes > 0) {
+        bytes = (bytes + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+        data.reset(static_cast<uint8_t *>(std::aligned_alloc(CACHE_ALIGN, bytes)));
+        if (!data)
+            throw std::bad_alloc();
+    }
+    index.reserve(capacity);
+}
+
+// CLOCK: sweep the hand, clearing reference bits, until an unreferenced
+// frame turns up. Empty frames are taken immediately. The pinned frame is
+// skipped unless it is the only one.
+int
+BlockCache::evict()
+{
+    for (;;) {
+        unsigned f = hand;
+        hand = (hand + 1) % frames.size();
+        Frame &fr = frames[f];
+        if (!fr.valid)
+            return f;
+        if ((int)f == pinned && frames.size() > 1)
+            continue;
+        if (fr.referenced) {
+            fr.referenced = false;
+            continue;
+        }
+        if (fr.dirty) {
+            if (writeback(fr.block_no, frame_data(f)) != 0)
+                return -1;
+            ++counters.writebacks;
+        }
+        index.erase(fr.block_no);
+        fr.valid = false;
+        ++counters.evictions;
+        return f;
+    }
+}
+
+const uint8_t *
+BlockCache::find(unsigned block_no)
+{
+    auto it = index.find(block_no);
+    if (it == index.end()) {
+        ++counters.misses;
+        stat_add(STAT_CACHE_MISSES);
+        return nullptr;
+    }
+    ++counters.hits;
+    stat_add(STAT_CACHE_HITS);
+    frames[it->second].referenced = true;
+    return frame_data(it->second);
+}
+
+void
+BlockCache::pin(unsigned block_no)
+{
+    auto it = index.find(block_no);
+    pinned = it == index.end() ? -1 : (int)it->second;
+}
+
+bool
+BlockCache::read(unsigned block_no, uint8_t *blk)
+{
+    const uint8_t *p = find(block_no);
+    if (!p)
+        return false;
+    std::memcpy(blk, p, block_size);
+    return true;
+}
+
+int
+BlockCache::fill(unsigned block_no, const uint8_t *blk, bool dirty)
+{
+    if (frames.empty())
+        return -1;
+    int f;
+    auto it = index.find(block_no);
+    if (it != index.end()) {
+        f = it->second;
+    } else {
+        f = evict();
+        if (f < 0)
+            return -1;
+        frames[f] = Frame{block_no, true, false, false};
+        index[block_no] = f;
+    }
+    Frame &fr = frames[f];
+    fr.referenced = true;
+    fr.dirty = fr.dirty || dirty;
+    std::memcpy(frame_data(f), blk, block_size);
+    return 0;
+}
+
+void
+BlockCache::overwrite(unsigned block_no, const uint8_t *blk)
+{
+    auto it = index.find(block_no);
+    if (it == index.end())
+        return;
+    frames[it->second].dirty = false;
+    std::memcpy(frame_data(it->second), blk, block_size);
+}
+
+int
+BlockCache::flush()
+{
+    std::vector<unsigned> dirty;
+    for (unsigned f = 0; f < frames.size(); ++f)
+        if (frames[f].valid && frames[f].dirty)
+            dirty.push_back(f);
+    // write back in block order so the file is touched sequentially
+    std::sort(dirty.begin(), dirty.end(), [this](unsigned a, unsigned b) {
+        return frames[a].block_no < frames[b].block_no;
+    });
+    for (unsigned f : dirty) {
+        if (writeback(frames[f].block_no, frame_data(f)) != 0)
+            return -1;
+        frames[f].dirty = false;
+        ++counters.writebacks;
+    }
+    return 0;
+}
+
+void
+BlockCache::clear()
+{
+    std::fill(frames.begin(), frames.end(), Frame{0, false, false, false});
+    index.clear();
+    hand = 0;
+    pinned = -1;
+}
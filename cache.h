@@ -0,0 +1,77 @@
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#define CACHE_ALIGN 4096   // frame alignment, enough for O_DIRECT transfers
+
+// Bounded write-back block cache using the CLOCK replacement policy.
+// Dirty blocks are only written back when they are evicted or when flush()
+// is called; the owner supplies the function that performs the write-back.
+class BlockCache {
+public:
+    using WritebackFn = std::function<int(unsigned block_no, const uint8_t *blk)>;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t writebacks = 0;
+    };
+
+private:
+    struct Frame {
+        unsigned block_no;
+        bool valid;
+        bool dirty;
+        bool referenced;
+    };
+
+    unsigned block_size;
+    std::vector<Frame> frames;
+    // capacity * block_size bytes, CACHE_ALIGN aligned so frames can be
+    // handed to O_DIRECT I/O without a bounce buffer
+    std::unique_ptr<uint8_t[], void (*)(void *)> data{nullptr, std::free};
+    std::unordered_map<unsigned, unsigned> index; // block_no -> frame
+    unsigned hand = 0;                          // CLOCK hand
+    int pinned = -1;                            // frame evict() passes over
+    WritebackFn writeback;
+    Stats counters;
+
+    uint8_t *frame_data(unsigned f) { return &data[(size_t)f * block_size]; }
+    // picks a frame to reuse, writing back its block if dirty; -1 on failure
+    int evict();
+
+public:
+    BlockCache(unsigned capacity, unsigned block_size, WritebackFn writeback);
+
+    unsigned capacity() const { return frames.size(); }
+    // returns the cached copy of block_no or nullptr; counts a hit or a miss.
+    // The pointer is valid until the next fill().
+    const uint8_t *find(unsigned block_no);
+    // keeps the frame holding block_no (if cached) from being evicted until
+    // the next pin() or unpin(); at most one frame is pinned at a time
+    void pin(unsigned block_no);
+    void unpin() { pinned = -1; }
+    // true if block_no is cached; not counted as a hit or a miss
+    bool contains(unsigned block_no) const { return index.count(block_no) != 0; }
+    // copies block_no into blk if cached; counts a hit or a miss
+    bool read(unsigned block_no, uint8_t *blk);
+    // stores a copy of blk as block_no, marking it dirty if requested
+    int fill(unsigned block_no, const uint8_t *blk, bool dirty);
+    // replaces the cached copy of block_no (if any) with blk, which the
+    // caller has already written to the disk, so the copy is clean
+    void overwrite(unsigned block_no, const uint8_t *blk);
+    // writes every dirty block back, in block order; returns 0 on success
+    int flush();
+    // forgets every block, dirty or not; flush() first to keep them
+    void clear();
+    const Stats &stats() const { return counters; }
+};
+
+#endif // __CACHE_H__
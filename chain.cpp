@@ -0,0 +1,59 @@
+#include <algorithm>
+#include "chain.h"
+
+int32_t
+ChainIndex::find(uint32_t first, size_t idx)
+{
+    int32_t blk = first;
+    // short walks are not worth an entry
+    if (idx < CHAIN_STRIDE) {
+        for (size_t i = 0; i < idx && blk != FAT_EOF; ++i)
+            blk = fat[blk];
+        return blk;
+    }
+    std::lock_guard<std::mutex> hold(lock);
+    auto it = chains.find(first);
+    if (it == chains.end()) {
+        if (chains.size() >= CHAIN_MAX) {
+            chains.clear();
+            owner.clear();
+        }
+        it = chains.emplace(first, std::vector<int32_t>{(int32_t)first}).first;
+        owner[first] = {first, 0};
+    }
+    std::vector<int32_t> &marks = it->second;
+    size_t k = std::min(idx / CHAIN_STRIDE, marks.size() - 1);
+    blk = marks[k];
+    for (size_t i = k * CHAIN_STRIDE; i < idx && blk != FAT_EOF; ) {
+        blk = fat[blk];
+        if (++i % CHAIN_STRIDE == 0 && blk != FAT_EOF && i / CHAIN_STRIDE == marks.size()) {
+            owner[blk] = {first, (uint32_t)marks.size()};
+            marks.push_back(blk);
+        }
+    }
+    return blk;
+}
+
+void
+ChainIndex::forget(uint32_t blk)
+{
+    std::lock_guard<std::mutex> hold(lock);
+    auto o = owner.find(blk);
+    if (o == owner.end())
+        return;
+    auto [first, k] = o->second;
+    std::vector<int32_t> &marks = chains[first];
+    for (size_t j = k; j < marks.size(); ++j)
+        owner.erase(marks[j]);
+    marks.resize(k);
+    if (k == 0)
+        chains.erase(first);
+}
+
+void
+ChainIndex::clear()
+{
+    std::lock_guard<std::mutex> hold(lock);
+    chains.clear();
+    owner.clear();
+}
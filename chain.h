@@ -0,0 +1,42 @@
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "fat.h"
+
+#ifndef __CHAIN_H__
+#define __CHAIN_H__
+
+#ifndef CHAIN_STRIDE
+#define CHAIN_STRIDE 64    // the index keeps every CHAIN_STRIDE-th block of a chain
+#endif
+#define CHAIN_MAX 4096     // chains indexed at once
+
+// Skip index over FAT chains, keyed by their first block. Walking a chain
+// past its first CHAIN_STRIDE blocks records the block at every multiple of
+// CHAIN_STRIDE, so later the block at any index is at most CHAIN_STRIDE - 1
+// links away from a recorded one, and blocks added at the end are found by
+// walking on from the last. The links of a walked chain only change when
+// blocks of it are freed, and whoever frees a block calls forget() for it.
+class ChainIndex {
+    Fat &fat;
+    std::unordered_map<uint32_t, std::vector<int32_t>> chains; // block k * CHAIN_STRIDE at k
+    std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t>> owner; // block -> (chain, k)
+    mutable std::mutex lock;
+
+public:
+    explicit ChainIndex(Fat &fat) : fat(fat) { }
+
+    // block idx of the chain starting at first; FAT_EOF past its end
+    int32_t find(uint32_t first, size_t idx);
+    // blk is being freed: drop what is recorded from it on
+    void forget(uint32_t blk);
+    void clear();
+    size_t size() const {
+        std::lock_guard<std::mutex> hold(lock);
+        return chains.size();
+    }
+};
+
+#endif // __CHAIN_H__
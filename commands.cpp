@@ -0,0 +1,218 @@
+// commands.cpp: the shell commands, looked up by name
+#include <charconv>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include "commands.h"
+
+namespace {
+
+int
+cmd_format(CmdContext &ctx, const std::string_view *a, size_t n)
+{
+    // optional size of the disk in blocks
+    unsigned nblocks = 0;
+    if (n == 1) {
+        auto r = std::from_chars(a[0].data(), a[0].data() + a[0].size(), nblocks);
+        if (r.ec != std::errc() || r.ptr != a[0].data() + a[0].size() || nblocks == 0)
+            return CMD_USAGE;
+    }
+    return ctx.fs.format(nblocks);
+}
+
+int
+cmd_create(CmdContext &ctx, const std::string_view *a, size_t)
+{
+    if (ctx.prompts)
+        std::cout << "Enter data. Empty line to end.\n";
+    return ctx.fs.create(a[0]);
+}
+
+int
+cmd_cp(CmdContext &ctx, const std::string_view *a, size_t n)
+{
+    bool recursive = false, reflink = false;
+    for (size_t i = 0; i + 2 < n; ++i) {
+        if (a[i] == "-r")
+            recursive = true;
+        else if (a[i] == "--reflink")
+            reflink = true;
+        else
+            return CMD_USAGE;
+    }
+    if (recursive)
+        return ctx.fs.cp_tree(a[n - 2], a[n - 1], reflink);
+    return ctx.fs.cp(a[n - 2], a[n - 1], reflink);
+}
+
+// a file of the given size, made if it is missing; growing it writes no data
+int
+cmd_truncate(CmdContext &ctx, const std::string_view *a, size_t)
+{
+    uint64_t size = 0;
+    auto r = std::from_chars(a[1].data(), a[1].data() + a[1].size(), size);
+    if (r.ec != std::errc() || r.ptr != a[1].data() + a[1].size())
+        return CMD_USAGE;
+    int fd = ctx.fs.open(a[0], OPEN_WRITE | OPEN_CREATE);
+    if (fd < 0)
+        return -1;
+    int rc = ctx.fs.truncate(fd, size);
+    ctx.fs.close(fd);
+    return rc;
+}
+
+int
+cmd_compress(CmdContext &ctx, const std::string_view *a, size_t n)
+{
+    if (n == 2 && a[0] != "-d")
+        return CMD_USAGE;
+    return ctx.fs.compress(a[n - 1], n == 1);
+}
+
+int
+cmd_rm(CmdContext &ctx, const std::string_view *a, size_t n)
+{
+    if (n == 1)
+        return ctx.fs.rm(a[0]);
+    if (a[0] != "-r")
+        return CMD_USAGE;
+    return ctx.fs.rm_tree(a[1]);
+}
+
+int
+cmd_find(CmdContext &ctx, const std::string_view *a, size_t n)
+{
+    return ctx.fs.find(n > 0 ? a[0] : ".", n > 1 ? a[1] : "");
+}
+
+int
+cmd_stats(CmdContext &ctx, const std::string_view *a, size_t n)
+{
+    if (n == 1) {
+        if (a[0] != "reset")
+            return CMD_USAGE;
+        stats_reset();
+        return 0;
+    }
+    stats_print(std::cout, stats_snapshot());
+    DentryCache::Stats d = ctx.fs.dcache_stats();
+    std::cout << "dcache          " << d.hits << " hits, " << d.misses << " misses, "
+              << d.invalidations << " invalidations\n";
+    DirNamesCache::Stats dn = ctx.fs.dnames_stats();
+    std::cout << "dir names       " << dn.hits << " hits, " << dn.misses << " misses\n";
+    return 0;
+}
+
+int cmd_help(CmdContext &, const std::string_view *, size_t);
+
+const Command commands[] = {
+    {"format", 0, 1, true,  "format [blocks]", cmd_format},
+    {"create", 1, 1, true,  "create <file>", cmd_create},
+    {"cat",    1, 1, false, "cat <file>",
+     [](CmdContext &c, const std::string_view *a, size_t) { return c.fs.cat(a[0]); }},
+    {"ls",     0, 0, false, "ls",
+     [](CmdContext &c, const std::string_view *, size_t) { return c.fs.ls(); }},
+    {"cp",     2, 4, true,  "cp [-r] [--reflink] <oldfile> <newfile>", cmd_cp},
+    {"mv",     2, 2, true,  "mv <sourcepath> <destpath>",
+     [](CmdContext &c, const std::string_view *a, size_t) { return c.fs.mv(a[0], a[1]); }},
+    {"rm",     1, 2, true,  "rm [-r] <file>", cmd_rm},
+    {"append", 2, 2, true,  "append <filepath1> <filepath2>",
+     [](CmdContext &c, const std::string_view *a, size_t) { return c.fs.append(a[0], a[1]); }},
+    {"truncate", 2, 2, true, "truncate <file> <bytes>", cmd_truncate},
+    {"compress", 1, 2, true, "compress [-d] <file>", cmd_compress},
+    {"mkdir",  1, 1, true,  "mkdir <dirpath>",
+     [](CmdContext &c, const std::string_view *a, size_t) { return c.fs.mkdir(a[0]); }},
+    {"cd",     1, 1, false, "cd <dirpath>",
+     [](CmdContext &c, const std::string_view *a, size_t) { return c.fs.cd(a[0]); }},
+    {"pwd",    0, 0, false, "pwd",
+     [](CmdContext &c, const std::string_view *, size_t) { return c.fs.pwd(); }},
+    {"chmod",  2, 2, true,  "chmod <accessrights> <filepath>",
+     [](CmdContext &c, const std::string_view *a, size_t) { return c.fs.chmod(a[0], a[1]); }},
+    {"import", 2, 2, true,  "import <hostdir> <dirpath>",
+     [](CmdContext &c, const std::string_view *a, size_t) { return c.fs.import_tree(a[0], a[1]); }},
+    {"export", 2, 2, false, "export <dirpath> <hostdir>",
+     [](CmdContext &c, const std::string_view *a, size_t) { return c.fs.export_tree(a[0], a[1]); }},
+    {"du",     0, 1, false, "du [dirpath]",
+     [](CmdContext &c, const std::string_view *a, size_t n) { return c.fs.du(n > 0 ? a[0] : "."); }},
+    {"find",   0, 2, false, "find [dirpath] [pattern]", cmd_find},
+    {"stats",  0, 1, false, "stats [reset]", cmd_stats},
+    {"help",   0, CMD_WORDS - 1, false, "help", cmd_help},
+    {"quit",   0, CMD_WORDS - 1, false, "quit",
+     [](CmdContext &c, const std::string_view *, size_t) { c.quit = true; return 0; }},
+};
+
+int
+cmd_help(CmdContext &, const std::string_view *, size_t)
+{
+    std::string list;
+    for (const Command &c : commands)
+        list += std::string(list.empty() ? "" : ", ") + c.name;
+    std::cout << "Available commands:\n" << list << "\n";
+    return 0;
+}
+
+} // namespace
+
+const Command *
+find_command(std::string_view name)
+{
+    static const std::unordered_map<std::string_view, const Command *> table = [] {
+        std::unordered_map<std::string_view, const Command *> t;
+        for (const Command &c : commands)
+            t.emplace(c.name, &c);
+        return t;
+    }();
+    auto it = table.find(name);
+    return it == table.end() ? nullptr : it->second;
+}
+
+size_t
+split_words(std::string_view line, std::string_view *words, size_t max)
+{
+    size_t n = 0;
+    size_t pos = 0;
+    while (pos < line.size()) {
+        if (line[pos] == ' ') {
+            ++pos;
+            continue;
+        }
+        size_t end = line.find(' ', pos);
+        if (end == std::string_view::npos)
+            end = line.size();
+        if (n < max)
+            words[n] = line.substr(pos, end - pos);
+        ++n;
+        pos = end;
+    }
+    return n;
+}
+
+const Command *
+run_command(CmdContext &ctx, const std::string_view *words, size_t n, int *result)
+{
+    int dummy;
+    int &rc = result ? *result : dummy;
+    rc = 0;
+    if (n == 0)
+        return nullptr;
+    const Command *c = find_command(words[0]);
+    if (!c) {
+        cmd_help(ctx, nullptr, 0);
+        rc = -1;
+        return nullptr;
+    }
+    rc = CMD_USAGE;
+    if (n - 1 >= c->min_args && n - 1 <= c->max_args)
+        rc = c->run(ctx, words + 1, n - 1);
+    if (rc == CMD_USAGE) {
+        std::cout << "Usage: " << c->usage << "\n";
+    } else if (rc != 0) {
+        // options such as -r and --reflink are left out
+        std::cout << "Error: " << c->name;
+        for (size_t i = 1; i < n; ++i)
+            if (words[i].size() < 2 || words[i][0] != '-')
+                std::cout << " " << words[i];
+        std::cout << " failed, error code " << rc << std::endl;
+    }
+    return c;
+}
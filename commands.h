@@ -0,0 +1,40 @@
+#include <cstddef>
+#include <string_view>
+#include "fs.h"
+
+#ifndef __COMMANDS_H__
+#define __COMMANDS_H__
+
+#define CMD_WORDS 8        // words of a command line that are kept
+#define CMD_USAGE (-100)   // returned by a handler for wrong arguments
+
+// what a command runs against
+struct CmdContext {
+    FS &fs;
+    bool prompts;          // interactive: create asks for its data
+    bool quit = false;     // set by quit
+};
+
+// One shell command. Commands are looked up by name in a hash table, and
+// the argument count is checked against the entry before run() is called.
+struct Command {
+    const char *name;
+    unsigned min_args, max_args;   // not counting the name
+    bool changes;                  // may change the file system
+    const char *usage;
+    int (*run)(CmdContext &ctx, const std::string_view *args, size_t n);
+};
+
+// the command called name, or nullptr
+const Command *find_command(std::string_view name);
+// split line at blanks; the first max words go to words, and the number
+// of words in the line is returned
+size_t split_words(std::string_view line, std::string_view *words, size_t max);
+// run the command in words[0, n) as the shell does, printing its usage or
+// error message; unknown commands print the list of commands. Returns the
+// command that ran, or nullptr, and its result in *rc (CMD_USAGE for
+// wrong arguments, non-zero when the command is unknown).
+const Command *run_command(CmdContext &ctx, const std::string_view *words, size_t n,
+                           int *rc = nullptr);
+
+#endif // __COMMANDS_H__
@@ -0,0 +1,158 @@
+// compress.cpp: files kept in compressed groups (see ZGROUP_BLOCKS)
+#include "fs.h"
+#include "lz.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+// A group is written as soon as it is packed, in an extent of its own
+// linked onto the chain, so packing a file needs memory for one group and
+// not for the file. Reading the bytes at some offset skips the groups in
+// front of them by their headers, one block read each, and decodes from
+// there; cat and export decode every group in order.
+
+int FS::pack_group(const uint8_t *data, size_t n, int32_t &first, int32_t &last,
+                   uint32_t &blocks, std::vector<uint8_t> &buf) {
+    zgroup_header h = {ZGROUP_MAGIC, (uint32_t)n, 0, 0};
+    uint8_t *payload = buf.data() + sizeof(h);
+    h.packed = lz_compress(data, n, payload);
+    if (h.packed == 0) {
+        h.packed = n;
+        std::memcpy(payload, data, n);
+    }
+    std::memcpy(buf.data(), &h, sizeof(h));
+    size_t used = sizeof(h) + h.packed;
+    size_t nb = blocks_for(used);
+    std::memset(buf.data() + used, 0, nb * BLOCK_SIZE - used);
+    int ext = alloc_chain(nb);
+    if (ext < 0) return -1;
+    if (last == FAT_EOF) first = ext;
+    else fat[last] = ext;
+    BlockWrite ios[ZGROUP_BLOCKS + 1];
+    int32_t blk = ext;
+    for (size_t i = 0; i < nb; ++i) {
+        ios[i] = {(unsigned)blk, buf.data() + i * BLOCK_SIZE};
+        last = blk;
+        blk = fat[blk];
+    }
+    blocks += nb;
+    return disk.writev(ios, nb);
+}
+
+int FS::group_header(int32_t blk, uint8_t *buf, zgroup_header &h) {
+    if (blk == FAT_EOF || read_block(blk, buf) != 0) return -1;
+    std::memcpy(&h, buf, sizeof(h));
+    if (h.magic != ZGROUP_MAGIC || h.raw > ZGROUP_BYTES || h.packed > h.raw) {
+        std::cout << "Error: damaged compressed block " << blk << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t FS::unpack_group(int32_t &blk, uint8_t *out, std::vector<uint8_t> &buf) {
+    zgroup_header h;
+    if (group_header(blk, buf.data(), h) != 0) return -1;
+    size_t nb = blocks_for(sizeof(h) + h.packed);
+    blk = fat[blk];
+    if (nb > 1 && read_chain(blk, nb - 1, buf.data() + BLOCK_SIZE) != (int)nb - 1) return -1;
+    const uint8_t *payload = buf.data() + sizeof(h);
+    if (h.packed == h.raw) {
+        std::memcpy(out, payload, h.raw);
+    } else if (lz_decompress(payload, h.packed, out, h.raw) != 0) {
+        std::cout << "Error: damaged compressed data" << std::endl;
+        return -1;
+    }
+    return h.raw;
+}
+
+int FS::unpack_range(int32_t first, uint64_t size, uint64_t off, uint64_t n,
+                     const std::function<int(const uint8_t *, size_t)> &emit) {
+    if (n == 0) return 0;
+    std::vector<uint8_t> buf((ZGROUP_BLOCKS + 1) * BLOCK_SIZE);
+    std::vector<uint8_t> out(ZGROUP_BYTES);
+    int32_t blk = first;
+    for (uint64_t g = off / ZGROUP_BYTES; g > 0; --g) {
+        zgroup_header h;
+        if (group_header(blk, buf.data(), h) != 0) return -1;
+        for (size_t nb = blocks_for(sizeof(h) + h.packed); nb > 0 && blk != FAT_EOF; --nb)
+            blk = fat[blk];
+    }
+    uint64_t pos = off - off % ZGROUP_BYTES;
+    uint64_t end = std::min(size, off + n);
+    while (pos < end) {
+        ssize_t got = unpack_group(blk, out.data(), buf);
+        if (got <= 0 || (size_t)got != std::min<uint64_t>(ZGROUP_BYTES, size - pos)) return -1;
+        std::memset(out.data() + got, 0, blocks_for(got) * BLOCK_SIZE - got);
+        size_t from = std::max(pos, off) - pos;
+        size_t to = std::min<uint64_t>(got, end - pos);
+        if (emit(out.data() + from, to - from) != 0) return -1;
+        pos += got;
+    }
+    return 0;
+}
+
+int FS::unpack_entry(dir_entry &e) {
+    int first = alloc_chain(std::max<size_t>(1, blocks_for(e.size)));
+    if (first < 0) return -1;
+    int32_t dst = first;
+    int rc = unpack_range(e.first_blk, e.size, 0, e.size, [&](const uint8_t *p, size_t n) {
+        BlockWrite ios[ZGROUP_BLOCKS];
+        size_t nb = blocks_for(n);
+        for (size_t i = 0; i < nb; ++i) {
+            ios[i] = {(unsigned)dst, p + i * BLOCK_SIZE};
+            dst = fat[dst];
+        }
+        return disk.writev(ios, nb);
+    });
+    if (rc != 0) {
+        free_chain(first);
+        return -1;
+    }
+    if (release_ref(e.first_blk)) free_chain(e.first_blk);
+    e.first_blk = first;
+    e.flags &= ~ENTRY_COMPRESSED;
+    e.zblocks = 0;
+    return 0;
+}
+
+int FS::compress(std::string_view filepath, bool on) {
+    OpTimer timer(OP_COMPRESS);
+    DirGuard g(*this);
+    MetaOp op(*this);
+    uint32_t dir; std::string_view name;
+    dir_entry e; DirLoc loc;
+    if (resolve_path(filepath, dir, name) != 0 || name.empty() ||
+        dir_find(dir, name, loc, &e) != 0) {
+        std::cout << "Error: File not found: " << filepath << std::endl;
+        return -1;
+    }
+    if (e.type != TYPE_FILE) {
+        std::cout << "Error: " << filepath << " is a directory" << std::endl;
+        return -1;
+    }
+    if (!(e.access_rights & READ)) {
+        std::cout << "Error: Permission denied (no read access) on " << filepath << std::endl;
+        return -1;
+    }
+    if (is_compressed(e) == on || is_inline(e) || e.size == 0) return 0;
+    g.lock(dir);
+    if (!on) return unpack_entry(e) == 0 ? dir_update(dir, loc, e) : -1;
+
+    std::vector<uint8_t> data(ZGROUP_BYTES);
+    std::vector<uint8_t> buf((ZGROUP_BLOCKS + 1) * BLOCK_SIZE);
+    int32_t first = FAT_EOF, last = FAT_EOF, src = e.first_blk;
+    uint32_t blocks = 0;
+    for (size_t pos = 0; pos < e.size; pos += ZGROUP_BYTES) {
+        size_t n = std::min<size_t>(ZGROUP_BYTES, e.size - pos);
+        if (read_chain(src, blocks_for(n), data.data()) != (int)blocks_for(n) ||
+            pack_group(data.data(), n, first, last, blocks, buf) != 0) {
+            free_chain(first);
+            return -1;
+        }
+    }
+    if (release_ref(e.first_blk)) free_chain(e.first_blk);
+    e.first_blk = first;
+    e.flags |= ENTRY_COMPRESSED;
+    e.zblocks = blocks;
+    return dir_update(dir, loc, e);
+}
@@ -0,0 +1,114 @@
+#include <cstring>
+#include "dcache.h"
+
+DentryCache::DentryCache()
+  : table(DCACHE_SETS * DCACHE_WAYS, Dentry{})
+{
+}
+
+// FNV-1a over the directory block and the name
+uint32_t
+DentryCache::hash(uint32_t dir, std::string_view name)
+{
+    uint32_t h = 2166136261u;
+    for (int shift = 0; shift < 32; shift += 8)
+        h = (h ^ (dir >> shift & 0xff)) * 16777619u;
+    for (char c : name)
+        h = (h ^ (uint8_t)c) * 16777619u;
+    return h;
+}
+
+DentryCache::Dentry *
+DentryCache::find(uint32_t dir, std::string_view name, uint32_t h)
+{
+    Dentry *set = &table[(h % DCACHE_SETS) * DCACHE_WAYS];
+    for (unsigned w = 0; w < DCACHE_WAYS; ++w) {
+        Dentry &d = set[w];
+        if (d.valid && d.hash == h && d.dir == dir &&
+            name.size() < DCACHE_NAME_LEN && d.name[name.size()] == '\0' &&
+            std::memcmp(d.name, name.data(), name.size()) == 0)
+            return &d;
+    }
+    return nullptr;
+}
+
+bool
+DentryCache::lookup(uint32_t dir, std::string_view name, Dentry &out)
+{
+    uint32_t h = hash(dir, name);
+    std::lock_guard<std::mutex> hold(locks[h % DCACHE_SETS]);
+    Dentry *d = find(dir, name, h);
+    if (!d) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    hits.fetch_add(1, std::memory_order_relaxed);
+    d->stamp = ++tick;
+    out = *d;
+    return true;
+}
+
+void
+DentryCache::insert(uint32_t dir, std::string_view name, uint32_t blk, uint16_t slot,
+                    uint32_t first_blk, uint8_t type)
+{
+    if (name.empty() || name.size() >= DCACHE_NAME_LEN)
+        return;
+    uint32_t h = hash(dir, name);
+    std::lock_guard<std::mutex> hold(locks[h % DCACHE_SETS]);
+    Dentry *d = find(dir, name, h);
+    if (!d) {
+        Dentry *set = &table[(h % DCACHE_SETS) * DCACHE_WAYS];
+        d = &set[0];
+        for (unsigned w = 0; w < DCACHE_WAYS && d->valid; ++w)
+            if (!set[w].valid || set[w].stamp < d->stamp)
+                d = &set[w];
+        std::memcpy(d->name, name.data(), name.size());
+        d->name[name.size()] = '\0';
+        d->dir = dir;
+        d->hash = h;
+        d->valid = true;
+    }
+    d->blk = blk;
+    d->slot = slot;
+    d->first_blk = first_blk;
+    d->type = type;
+    d->stamp = ++tick;
+}
+
+void
+DentryCache::invalidate(uint32_t dir, std::string_view name)
+{
+    uint32_t h = hash(dir, name);
+    std::lock_guard<std::mutex> hold(locks[h % DCACHE_SETS]);
+    Dentry *d = find(dir, name, h);
+    if (d) {
+        d->valid = false;
+        invalidations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void
+DentryCache::invalidate_dir(uint32_t dir)
+{
+    for (unsigned s = 0; s < DCACHE_SETS; ++s) {
+        std::lock_guard<std::mutex> hold(locks[s]);
+        for (unsigned w = 0; w < DCACHE_WAYS; ++w) {
+            Dentry &d = table[s * DCACHE_WAYS + w];
+            if (d.valid && d.dir == dir) {
+                d.valid = false;
+                invalidations.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+void
+DentryCache::clear()
+{
+    for (unsigned s = 0; s < DCACHE_SETS; ++s) {
+        std::lock_guard<std::mutex> hold(locks[s]);
+        for (unsigned w = 0; w < DCACHE_WAYS; ++w)
+            table[s * DCACHE_WAYS + w].valid = false;
+    }
+}
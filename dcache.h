@@ -0,0 +1,66 @@
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+#ifndef DCACHE_SETS
+#define DCACHE_SETS 256    // dentry cache capacity is DCACHE_SETS * DCACHE_WAYS
+#endif
+#define DCACHE_WAYS 4
+#define DCACHE_NAME_LEN 56 // same as dir_entry::file_name
+
+// Bounded cache of directory entries keyed by (directory block, name).
+// Names are stored inline and the table is set associative, so neither
+// lookups nor inserts allocate. Entries must be invalidated by whoever
+// removes or renames the directory entry they describe. Every set has its
+// own lock, so threads looking up different names rarely meet.
+class DentryCache {
+public:
+    struct Dentry {
+        uint32_t dir;             // first block of the directory holding the entry
+        uint32_t blk;             // block of that directory the entry is in
+        uint16_t slot;            // index of the entry in blk
+        uint32_t first_blk;
+        uint8_t  type;
+        bool     valid;
+        uint32_t hash;
+        uint32_t stamp;           // last use, for LRU within the set
+        char     name[DCACHE_NAME_LEN];
+    };
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t invalidations = 0;
+    };
+
+private:
+    std::vector<Dentry> table;    // DCACHE_SETS sets of DCACHE_WAYS ways
+    std::mutex locks[DCACHE_SETS];
+    std::atomic<uint32_t> tick{0};
+    std::atomic<uint64_t> hits{0}, misses{0}, invalidations{0};
+
+    static uint32_t hash(uint32_t dir, std::string_view name);
+    Dentry *find(uint32_t dir, std::string_view name, uint32_t h);
+
+public:
+    DentryCache();
+
+    // copies the cached entry to out; false if (dir, name) is not cached
+    bool lookup(uint32_t dir, std::string_view name, Dentry &out);
+    // caches (dir, name), replacing the least recently used way if needed;
+    // names that do not fit are not cached
+    void insert(uint32_t dir, std::string_view name, uint32_t blk, uint16_t slot,
+                uint32_t first_blk, uint8_t type);
+    void invalidate(uint32_t dir, std::string_view name);
+    // drops every entry of directory dir (the directory is going away)
+    void invalidate_dir(uint32_t dir);
+    void clear();
+    Stats stats() const { return {hits.load(), misses.load(), invalidations.load()}; }
+};
+
+#endif // __DCACHE_H__
@@ -0,0 +1,359 @@
+// dir.cpp: directory layer of FS (single-block and indexed directories)
+#include "fs.h"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace {
+
+// FNV-1a over the name; decides which leaf of an indexed directory holds it
+uint32_t name_hash(std::string_view name)
+{
+    uint32_t h = 2166136261u;
+    for (char c : name)
+        h = (h ^ (uint8_t)c) * 16777619u;
+    return h;
+}
+
+// fill the slots after an inline file's entry rec with its size bytes
+void put_inline(dir_entry *rec, const uint8_t *data, size_t size)
+{
+    for (unsigned k = 1; (k - 1) * INLINE_CHUNK < size; ++k) {
+        auto *p = reinterpret_cast<uint8_t*>(&rec[k]);
+        size_t off = (k - 1) * INLINE_CHUNK;
+        std::memset(p, 0, sizeof(dir_entry));
+        p[0] = '/';
+        p[1] = k;
+        std::memcpy(p + 2, data + off, std::min(INLINE_CHUNK, size - off));
+    }
+}
+
+// the first run of n free slots of ents, DIR_SLOTS if there is none
+unsigned free_run(const dir_entry *ents, unsigned n)
+{
+    for (unsigned i = 0, run = 0; i < DIR_SLOTS; ++i) {
+        run = ents[i].file_name[0] ? 0 : run + 1;
+        if (run == n) return i + 1 - n;
+    }
+    return DIR_SLOTS;
+}
+
+// the same, but when the free slots are enough and only scattered, the
+// used ones are first moved to the front in order, inline data still
+// behind its entry, so the free ones form one run. Entries that move keep
+// stale dentry cache hints, which dir_find() notices and drops.
+unsigned make_room(dir_entry *ents, unsigned n)
+{
+    unsigned i = free_run(ents, n);
+    if (i < DIR_SLOTS)
+        return i;
+    unsigned used = 0;
+    for (unsigned k = 0; k < DIR_SLOTS; ++k)
+        used += ents[k].file_name[0] != 0;
+    if (DIR_SLOTS - used < n)
+        return DIR_SLOTS;
+    used = 0;
+    for (unsigned k = 0; k < DIR_SLOTS; ++k) {
+        if (!ents[k].file_name[0]) continue;
+        if (k != used) ents[used] = ents[k];
+        ++used;
+    }
+    std::memset(&ents[used], 0, (DIR_SLOTS - used) * sizeof(dir_entry));
+    return used;
+}
+
+} // namespace
+
+// A block staged by the calling thread's transaction is decoded afresh
+// every time; the cache holds what every other thread sees.
+DirSlots FS::dir_slots(uint32_t blk, const dir_entry *&ents, const uint32_t *h) {
+    bool staged = txn.owner.load(std::memory_order_relaxed) == std::this_thread::get_id() &&
+                  txn.dirs.count(blk);
+    DirSlots slots;
+    if (!staged && (h ? dnames.match(blk, *h, slots) : dnames.used(blk, slots))) {
+        ents = reinterpret_cast<const dir_entry*>(dir_block(blk));
+        return slots;
+    }
+    uint32_t gen = dnames.generation(blk);
+    ents = reinterpret_cast<const dir_entry*>(dir_block(blk));
+    if (!ents) return slots;
+    DirNames names;
+    for (unsigned i = 0; i < DNAMES_PAD; ++i) {
+        names.hash[i] = 0;
+        if (i >= DIR_SLOTS || !ents[i].file_name[0] || ents[i].file_name[0] == '/') continue;
+        names.hash[i] = name_hash(entry_name(ents[i]));
+        names.used.set(i);
+    }
+    if (!staged) dnames.insert(blk, gen, names);
+    return h ? names.match(*h) : names.used;
+}
+
+uint32_t FS::dir_index(uint32_t dir) {
+    const uint8_t *buf = dir_block(dir);
+    if (!buf) return 0;
+    auto &last = reinterpret_cast<const dir_entry*>(buf)[DIR_SLOTS - 1];
+    return entry_name(last) == HTREE_NAME ? last.first_blk : 0;
+}
+
+// binary search for the last node whose hash is <= h
+int FS::htree_leaf(uint32_t index, uint32_t h, unsigned *node) {
+    auto *idx = reinterpret_cast<const htree_index*>(dir_block(index));
+    if (!idx || idx->magic != HTREE_MAGIC || idx->count == 0 || idx->count > HTREE_NODES)
+        return -1;
+    auto *it = std::upper_bound(idx->nodes, idx->nodes + idx->count, h,
+                                [](uint32_t v, const htree_node &n) { return v < n.hash; });
+    unsigned i = it - idx->nodes - 1; // nodes[0].hash is 0, so i >= 0
+    if (node) *node = i;
+    return idx->nodes[i].blk;
+}
+
+// a cached location is only a hint and is checked against the block; after
+// that a single-block directory is scanned and an indexed one reads one leaf
+int FS::dir_find(uint32_t dir, std::string_view name, DirLoc &loc, dir_entry *out) {
+    if (name.empty() || name.size() > MAX_NAME_LEN) return -1;
+    DentryCache::Dentry d;
+    if (dcache.lookup(dir, name, d)) {
+        const uint8_t *buf = dir_block(d.blk);
+        if (buf && d.slot < DIR_SLOTS) {
+            auto &e = reinterpret_cast<const dir_entry*>(buf)[d.slot];
+            if (name == entry_name(e)) {
+                loc = {d.blk, d.slot};
+                if (out) *out = e;
+                return 0;
+            }
+        }
+        dcache.invalidate(dir, name);
+    }
+
+    uint32_t blk = dir;
+    uint32_t h = name_hash(name);
+    uint32_t index = dir_index(dir);
+    if (index && !is_dot(name)) {
+        int leaf = htree_leaf(index, h);
+        if (leaf < 0) return -1;
+        blk = leaf;
+    }
+    // only slots whose name hash matches are compared
+    const dir_entry *ents;
+    DirSlots slots = dir_slots(blk, ents, &h);
+    if (!ents) return -1;
+    for (unsigned i = slots.next(0); i < DIR_SLOTS; i = slots.next(i + 1)) {
+        if (name == entry_name(ents[i])) {
+            loc = {blk, (uint16_t)i};
+            if (out) *out = ents[i];
+            dcache.insert(dir, name, blk, i, ents[i].first_blk, ents[i].type);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int FS::dir_add(uint32_t dir, const dir_entry &e, DirLoc *loc, const uint8_t *data) {
+    std::string_view name = entry_name(e);
+    unsigned need = entry_slots(e);
+    if (need > 1 && !data) return -1;
+    uint8_t buf[BLOCK_SIZE];
+    auto *ents = reinterpret_cast<dir_entry*>(buf);
+    // names are not checked here, callers look them up first; the dentry
+    // cache is filled by lookups only
+    auto put = [&](uint32_t blk, unsigned i) {
+        ents[i] = e;
+        if (need > 1) put_inline(&ents[i], data, e.size);
+        if (stage_dir(blk, buf) != 0) return -1;
+        if (loc) *loc = {blk, (uint16_t)i};
+        return 0;
+    };
+
+    uint32_t index = dir_index(dir);
+    if (!index) {
+        if (load_dir(dir, buf) != 0) return -1;
+        unsigned i = make_room(ents, need);
+        if (i < DIR_SLOTS) return put(dir, i);
+        if (htree_convert(dir) != 0) return -1;
+        index = dir_index(dir);
+    }
+
+    // a full leaf is split and the insert retried; a split can leave the
+    // target half full when many names fall on one side of the median
+    uint32_t h = name_hash(name);
+    for (int tries = 0; tries < 8; ++tries) {
+        unsigned node;
+        int leaf = htree_leaf(index, h, &node);
+        if (leaf < 0 || load_dir(leaf, buf) != 0) return -1;
+        unsigned i = make_room(ents, need);
+        if (i < DIR_SLOTS) return put(leaf, i);
+        if (htree_split(index, node) != 0) return -1;
+    }
+    return -1;
+}
+
+int FS::dir_update(uint32_t dir, const DirLoc &loc, const dir_entry &e) {
+    uint8_t buf[BLOCK_SIZE];
+    if (load_dir(loc.blk, buf) != 0) return -1;
+    auto *ents = reinterpret_cast<dir_entry*>(buf);
+    unsigned had = ents[loc.slot].file_name[0] ? entry_slots(ents[loc.slot]) : 1;
+    had = std::min<unsigned>(had, DIR_SLOTS - loc.slot);
+    unsigned keep = e.file_name[0] ? entry_slots(e) : 1;
+    if (keep > had) return -1;
+    if (entry_name(ents[loc.slot]) != entry_name(e))
+        dcache.invalidate(dir, entry_name(ents[loc.slot]));
+    ents[loc.slot] = e;
+    std::memset(&ents[loc.slot + keep], 0, (had - keep) * sizeof(dir_entry));
+    return stage_dir(loc.blk, buf);
+}
+
+int FS::dir_inline(const DirLoc &loc, const dir_entry &e, uint8_t *out) {
+    unsigned n = entry_slots(e);
+    if (loc.slot + n > DIR_SLOTS) return -1;
+    const uint8_t *buf = dir_block(loc.blk);
+    if (!buf) return -1;
+    auto *rec = reinterpret_cast<const dir_entry*>(buf) + loc.slot;
+    for (unsigned k = 1; k < n; ++k) {
+        auto *p = reinterpret_cast<const uint8_t*>(&rec[k]);
+        size_t off = (k - 1) * INLINE_CHUNK;
+        if (p[0] != '/' || p[1] != k) return -1;
+        std::memcpy(out + off, p + 2, std::min<size_t>(INLINE_CHUNK, e.size - off));
+    }
+    return 0;
+}
+
+int FS::dir_remove(uint32_t dir, const DirLoc &loc) {
+    dir_entry empty = {};
+    return dir_update(dir, loc, empty);
+}
+
+DirIter FS::dir_begin(uint32_t dir) {
+    DirIter it;
+    it.dir = dir;
+    it.index = dir_index(dir);
+    return it;
+}
+
+int FS::dir_next(DirIter &it, dir_entry &e, DirLoc *loc) {
+    for (;;) {
+        uint32_t blk = it.dir;
+        if (it.node >= 0) {
+            auto *idx = reinterpret_cast<const htree_index*>(dir_block(it.index));
+            if (!idx || idx->magic != HTREE_MAGIC) return -1;
+            if ((unsigned)it.node >= idx->count) return 0;
+            blk = idx->nodes[it.node].blk;
+        }
+        const dir_entry *ents;
+        if (!it.decoded) {
+            it.used = dir_slots(blk, ents);
+            it.decoded = true;
+        } else {
+            ents = reinterpret_cast<const dir_entry*>(dir_block(blk));
+        }
+        if (!ents) return -1;
+        // the caller may have cleared entries since the block was decoded
+        for (unsigned i; (i = it.used.next(it.slot)) < DIR_SLOTS;) {
+            it.slot = i + 1;
+            if (!ents[i].file_name[0] || ents[i].file_name[0] == '/') continue;
+            e = ents[i];
+            if (loc) *loc = {blk, (uint16_t)i};
+            return 1;
+        }
+        if (!it.index) return 0;
+        ++it.node;
+        it.slot = 0;
+        it.decoded = false;
+    }
+}
+
+bool FS::dir_empty(uint32_t dir) {
+    DirIter it = dir_begin(dir);
+    dir_entry e;
+    while (dir_next(it, e) > 0)
+        if (!is_dot(entry_name(e))) return false;
+    return true;
+}
+
+int FS::dir_grow(uint32_t after) {
+    int b = alloc_block();
+    if (b < 0) return -1;
+    fat[b] = fat[after];
+    fat[after] = b;
+    return b;
+}
+
+// the first block of dir is full: move its entries to a single leaf that
+// the new index maps every hash to, leaving "." and ".." behind
+int FS::htree_convert(uint32_t dir) {
+    if (freemap.free_count() < 2) return -1;
+    uint8_t head[BLOCK_SIZE], ibuf[BLOCK_SIZE] = {0}, lbuf[BLOCK_SIZE] = {0};
+    if (load_dir(dir, head) != 0) return -1;
+    int index = dir_grow(dir);
+    int leaf = dir_grow(index);
+
+    auto *hents = reinterpret_cast<dir_entry*>(head);
+    auto *lents = reinterpret_cast<dir_entry*>(lbuf);
+    unsigned n = 0;
+    for (unsigned i = 0; i < DIR_SLOTS; ++i) {
+        if (!hents[i].file_name[0] || is_dot(entry_name(hents[i]))) continue;
+        lents[n++] = hents[i];
+        std::memset(&hents[i], 0, sizeof(dir_entry));
+    }
+    dir_entry marker = {};
+    set_entry_name(marker, HTREE_NAME);
+    marker.type = TYPE_DIR;
+    marker.first_blk = index;
+    hents[DIR_SLOTS - 1] = marker;
+
+    auto *idx = reinterpret_cast<htree_index*>(ibuf);
+    idx->magic = HTREE_MAGIC;
+    idx->count = 1;
+    idx->nodes[0] = {0, (uint32_t)leaf};
+    if (stage_dir(dir, head) != 0 || stage_dir(index, ibuf) != 0 || stage_dir(leaf, lbuf) != 0)
+        return -1;
+    return 0;
+}
+
+// split a full leaf at its median hash into itself and a new leaf; names
+// with equal hashes always stay on the same side. Both halves are packed
+// from the start of their block, inline data behind its entry, so the free
+// slots are in one run. Entries that move keep stale dentry cache hints,
+// which dir_find() notices and drops.
+int FS::htree_split(uint32_t index, unsigned node) {
+    uint8_t ibuf[BLOCK_SIZE], old[BLOCK_SIZE], lbuf[BLOCK_SIZE] = {0}, nbuf[BLOCK_SIZE] = {0};
+    if (load_dir(index, ibuf) != 0) return -1;
+    auto *idx = reinterpret_cast<htree_index*>(ibuf);
+    if (idx->count >= HTREE_NODES) return -1; // the index itself is full
+    uint32_t leaf = idx->nodes[node].blk;
+    if (load_dir(leaf, old) != 0) return -1;
+    auto *ents = reinterpret_cast<const dir_entry*>(old);
+
+    std::pair<uint32_t, unsigned> order[DIR_SLOTS];
+    unsigned n = 0;
+    for (unsigned i = 0; i < DIR_SLOTS; ++i)
+        if (ents[i].file_name[0] && ents[i].file_name[0] != '/')
+            order[n++] = {name_hash(entry_name(ents[i])), i};
+    if (n < 2) return -1;
+    std::sort(order, order + n);
+    unsigned cut = n / 2;
+    while (cut < n && order[cut].first == order[cut - 1].first) ++cut;
+    if (cut == n) {
+        cut = n / 2;
+        while (cut > 0 && order[cut].first == order[cut - 1].first) --cut;
+    }
+    if (cut == 0) return -1; // every name has the same hash
+
+    int nb = dir_grow(index);
+    if (nb < 0) return -1;
+    auto *lents = reinterpret_cast<dir_entry*>(lbuf), *nents = reinterpret_cast<dir_entry*>(nbuf);
+    unsigned lused = 0, nused = 0;
+    for (unsigned k = 0; k < n; ++k) {
+        const dir_entry &e = ents[order[k].second];
+        unsigned slots = std::min<unsigned>(entry_slots(e), DIR_SLOTS - order[k].second);
+        unsigned &used = k < cut ? lused : nused;
+        std::memcpy(&(k < cut ? lents : nents)[used], &e, slots * sizeof(dir_entry));
+        used += slots;
+    }
+    std::memmove(&idx->nodes[node + 2], &idx->nodes[node + 1],
+                 (idx->count - node - 1) * sizeof(htree_node));
+    idx->nodes[node + 1] = {order[cut].first, (uint32_t)nb};
+    ++idx->count;
+    if (stage_dir(index, ibuf) != 0 || stage_dir(leaf, lbuf) != 0 || stage_dir(nb, nbuf) != 0)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include "dirnames.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+unsigned
+DirSlots::next(unsigned i) const
+{
+    for (unsigned k = i / 64; k < DNAMES_WORDS; ++k) {
+        uint64_t m = w[k];
+        if (k == i / 64)
+            m &= ~0ull << (i % 64);
+        if (m)
+            return k * 64 + __builtin_ctzll(m);
+    }
+    return DNAMES_SLOTS;
+}
+
+DirSlots
+DirNames::match(uint32_t h) const
+{
+    DirSlots out;
+#ifdef __SSE2__
+    const __m128i key = _mm_set1_epi32(h);
+    for (unsigned i = 0; i < DNAMES_PAD; i += 4) {
+        __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(hash + i));
+        uint64_t m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key)));
+        out.w[i / 64] |= m << (i % 64);
+    }
+#else
+    for (unsigned i = 0; i < DNAMES_SLOTS; ++i)
+        if (hash[i] == h)
+            out.set(i);
+#endif
+    for (unsigned k = 0; k < DNAMES_WORDS; ++k)
+        out.w[k] &= used.w[k];
+    return out;
+}
+
+DirNamesCache::DirNamesCache()
+  : table(DNAMES_SETS * DNAMES_WAYS, Entry{})
+{
+}
+
+DirNamesCache::Entry *
+DirNamesCache::find(uint32_t blk)
+{
+    Entry *set = &table[(blk % DNAMES_SETS) * DNAMES_WAYS];
+    for (unsigned w = 0; w < DNAMES_WAYS; ++w)
+        if (set[w].valid && set[w].blk == blk)
+            return &set[w];
+    return nullptr;
+}
+
+bool
+DirNamesCache::used(uint32_t blk, DirSlots &out)
+{
+    std::lock_guard<std::mutex> hold(locks[blk % DNAMES_SETS]);
+    Entry *e = find(blk);
+    if (!e) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    hits.fetch_add(1, std::memory_order_relaxed);
+    e->stamp = ++tick;
+    out = e->names.used;
+    return true;
+}
+
+bool
+DirNamesCache::match(uint32_t blk, uint32_t h, DirSlots &out)
+{
+    std::lock_guard<std::mutex> hold(locks[blk % DNAMES_SETS]);
+    Entry *e = find(blk);
+    if (!e) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    hits.fetch_add(1, std::memory_order_relaxed);
+    e->stamp = ++tick;
+    out = e->names.match(h);
+    return true;
+}
+
+uint32_t
+DirNamesCache::generation(uint32_t blk)
+{
+    std::lock_guard<std::mutex> hold(locks[blk % DNAMES_SETS]);
+    return gens[blk % DNAMES_SETS];
+}
+
+void
+DirNamesCache::insert(uint32_t blk, uint32_t gen, const DirNames &names)
+{
+    std::lock_guard<std::mutex> hold(locks[blk % DNAMES_SETS]);
+    if (gens[blk % DNAMES_SETS] != gen)
+        return;
+    Entry *e = find(blk);
+    if (!e) {
+        Entry *set = &table[(blk % DNAMES_SETS) * DNAMES_WAYS];
+        e = &set[0];
+        for (unsigned w = 0; w < DNAMES_WAYS && e->valid; ++w)
+            if (!set[w].valid || set[w].stamp < e->stamp)
+                e = &set[w];
+        e->blk = blk;
+        e->valid = true;
+    }
+    e->names = names;
+    e->stamp = ++tick;
+}
+
+void
+DirNamesCache::invalidate(uint32_t blk)
+{
+    std::lock_guard<std::mutex> hold(locks[blk % DNAMES_SETS]);
+    ++gens[blk % DNAMES_SETS];
+    if (Entry *e = find(blk))
+        e->valid = false;
+}
+
+void
+DirNamesCache::clear()
+{
+    for (unsigned s = 0; s < DNAMES_SETS; ++s) {
+        std::lock_guard<std::mutex> hold(locks[s]);
+        ++gens[s];
+        for (unsigned w = 0; w < DNAMES_WAYS; ++w)
+            table[s * DNAMES_WAYS + w].valid = false;
+    }
+}
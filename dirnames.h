@@ -0,0 +1,81 @@
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "disk.h"
+
+#ifndef __DIRNAMES_H__
+#define __DIRNAMES_H__
+
+#ifndef DNAMES_SETS
+#define DNAMES_SETS 256    // decoded blocks kept are DNAMES_SETS * DNAMES_WAYS
+#endif
+#define DNAMES_WAYS 4
+
+constexpr unsigned DNAMES_SLOTS = BLOCK_SIZE / 72;   // DIR_SLOTS, checked in fs.h
+constexpr unsigned DNAMES_WORDS = (DNAMES_SLOTS + 63) / 64;
+constexpr unsigned DNAMES_PAD = (DNAMES_SLOTS + 3) & ~3u; // whole SIMD vectors
+
+// a set of slots of one directory block
+struct DirSlots {
+    uint64_t w[DNAMES_WORDS] = {};
+
+    void set(unsigned i) { w[i / 64] |= 1ull << (i % 64); }
+    // first slot at or after i, DNAMES_SLOTS if there is none
+    unsigned next(unsigned i) const;
+};
+
+// The names of a directory block in decoded form: the hash of every name
+// packed together, away from the 72-byte entries, so one can be ruled out
+// without touching its entry. Empty slots and the hidden index entry are
+// not in use.
+struct DirNames {
+    alignas(16) uint32_t hash[DNAMES_PAD];
+    DirSlots used;
+
+    // slots in use whose name hashes to h (compared four at a time)
+    DirSlots match(uint32_t h) const;
+};
+
+// Bounded cache of decoded directory blocks keyed by block number, set
+// associative like the dentry cache. It holds what other threads see of a
+// block; the writer must invalidate a block once it changes, and a block
+// decoded from an older copy is not cached (see generation()).
+class DirNamesCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+
+private:
+    struct Entry {
+        uint32_t blk;
+        bool valid;
+        uint32_t stamp;
+        DirNames names;
+    };
+    std::vector<Entry> table;       // DNAMES_SETS sets of DNAMES_WAYS ways
+    std::mutex locks[DNAMES_SETS];
+    uint32_t gens[DNAMES_SETS] = {}; // bumped by every invalidation of the set
+    std::atomic<uint32_t> tick{0};
+    std::atomic<uint64_t> hits{0}, misses{0};
+
+    Entry *find(uint32_t blk);
+
+public:
+    DirNamesCache();
+
+    // slots of blk in use, or in use with name hash h; false if not cached
+    bool used(uint32_t blk, DirSlots &out);
+    bool match(uint32_t blk, uint32_t h, DirSlots &out);
+    // taken before reading blk to decode it; insert() drops the result if
+    // blk was invalidated in between
+    uint32_t generation(uint32_t blk);
+    void insert(uint32_t blk, uint32_t gen, const DirNames &names);
+    void invalidate(uint32_t blk);
+    void clear();
+    Stats stats() const { return {hits.load(), misses.load()}; }
+};
+
+#endif // __DIRNAMES_H__
@@ -1,19 +1,55 @@
 #include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "disk.h"
+#include "stats.h"
 
-Disk::Disk()
+Disk::Disk(const DiskOptions &opts)
+  : backend(opts.backend),
+    concurrent(opts.concurrent),
+    cache(opts.backend == DISK_MMAP ? 0 : opts.cache_blocks, BLOCK_SIZE,
+          [this](unsigned block_no, const uint8_t *blk) { return write_block(block_no, blk); })
 {
     // first check if the disk file exists, otherwise create it.
     if (!disk_file_exists(DISKNAME)) {
         std::cout << "No disk file found...\n";
         std::cout << "Creating disk file: " << DISKNAME << std::endl;
         std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
+        f.seekp((std::streamoff)std::max(opts.blocks, 1u) * BLOCK_SIZE - 1);
         f.write("", 1);
     }
+    struct stat st;
+    if (stat(DISKNAME, &st) != 0 || st.st_size < BLOCK_SIZE) {
+        std::cerr << "ERROR: Can't size diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    no_blocks = std::min<uint64_t>(st.st_size / BLOCK_SIZE, UINT_MAX);
+    disk_size = (uint64_t)no_blocks * BLOCK_SIZE;
+    if (backend == DISK_MMAP) {
+        if (map_file() != 0) {
+            std::cerr << "ERROR: Can't map diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+            exit(-1);
+        }
+        return;
+    }
+    if (backend == DISK_FD) {
+        if (open_fd(opts.direct) != 0) {
+            std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+            exit(-1);
+        }
+        return;
+    }
     // the disk is simulated as a binary file
     diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
+    sync_fd = open(DISKNAME, O_RDONLY);
+    if (!diskfile.is_open() || sync_fd < 0) {
         std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
         exit(-1);
     }
@@ -21,7 +57,23 @@ Disk::Disk()
 
 Disk::~Disk()
 {
-    diskfile.close();
+    if (ra_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> hold(lock);
+            ra_stop = true;
+        }
+        ra_cv.notify_one();
+        ra_thread.join();
+    }
+    sync();
+    if (map)
+        munmap(map, disk_size);
+    if (fd >= 0)
+        close(fd);
+    else
+        diskfile.close();
+    if (sync_fd >= 0)
+        close(sync_fd);
 }
 
 bool
@@ -30,9 +82,218 @@ Disk::disk_file_exists (const std::string& name) {
     return f.good();
 }
 
+int
+Disk::map_file()
+{
+    if (fd < 0)
+        fd = open(DISKNAME, O_RDWR);
+    if (fd < 0)
+        return -1;
+    void *p = mmap(nullptr, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+    map = static_cast<uint8_t*>(p);
+    return 0;
+}
+
+// file systems without O_DIRECT support (tmpfs) refuse the flag at open,
+// in which case the page cache is used after all
+int
+Disk::open_fd(bool want_direct)
+{
+#ifdef O_DIRECT
+    if (want_direct) {
+        fd = open(DISKNAME, O_RDWR | O_DIRECT);
+        if (fd >= 0) {
+            direct = true;
+            return 0;
+        }
+        std::cerr << "WARNING: O_DIRECT not supported for " << DISKNAME << ", using buffered I/O\n";
+    }
+#endif
+    fd = open(DISKNAME, O_RDWR);
+    return fd < 0 ? -1 : 0;
+}
+
+int
+Disk::pio(bool write, uint8_t *buf, size_t len, off_t off)
+{
+    if (direct && reinterpret_cast<uintptr_t>(buf) % CACHE_ALIGN) {
+        alignas(CACHE_ALIGN) static thread_local uint8_t bounce[DIRECT_BOUNCE * BLOCK_SIZE];
+        for (size_t done = 0; done < len; ) {
+            size_t n = std::min(len - done, sizeof(bounce));
+            if (write)
+                std::memcpy(bounce, buf + done, n);
+            if (pio(write, bounce, n, off + done) != 0)
+                return -1;
+            if (!write)
+                std::memcpy(buf + done, bounce, n);
+            done += n;
+        }
+        return 0;
+    }
+    while (len > 0) {
+        ssize_t n = write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+int
+Disk::pio_vec(bool write, iovec *iov, unsigned count, off_t off)
+{
+    bool aligned = true;
+    for (unsigned i = 0; direct && i < count; ++i)
+        aligned = aligned && reinterpret_cast<uintptr_t>(iov[i].iov_base) % CACHE_ALIGN == 0;
+    if (!aligned) {
+        for (unsigned i = 0; i < count; off += iov[i].iov_len, ++i)
+            if (pio(write, static_cast<uint8_t*>(iov[i].iov_base), iov[i].iov_len, off) != 0)
+                return -1;
+        return 0;
+    }
+    while (count > 0) {
+        int k = std::min<unsigned>(count, IOV_MAX);
+        ssize_t n = write ? pwritev(fd, iov, k, off) : preadv(fd, iov, k, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        off += n;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        // a short transfer ended inside this buffer: finish it on its own
+        if (count > 0 && n > 0) {
+            size_t rest = iov->iov_len - n;
+            if (pio(write, static_cast<uint8_t*>(iov->iov_base) + n, rest, off) != 0)
+                return -1;
+            off += rest;
+            ++iov;
+            --count;
+        }
+    }
+    return 0;
+}
+
+int
+Disk::write_block(unsigned block_no, const uint8_t *blk)
+{
+    stat_add(STAT_BLOCKS_WRITTEN);
+    TRACE("write", block_no, 1);
+    if (map) {
+        std::memcpy(map + (size_t)block_no * BLOCK_SIZE, blk, BLOCK_SIZE);
+        return 0;
+    }
+    if (backend == DISK_FD)
+        return pio(true, const_cast<uint8_t*>(blk), BLOCK_SIZE, (off_t)block_no * BLOCK_SIZE);
+    diskfile.seekp((std::streamoff)block_no * BLOCK_SIZE, std::ios_base::beg);
+    diskfile.write((const char*)blk, BLOCK_SIZE);
+    if (!diskfile.good()) {
+        diskfile.clear();
+        return -1;
+    }
+    return 0;
+}
+
+int
+Disk::read_blocks(unsigned first, unsigned count, uint8_t *buf)
+{
+    stat_add(STAT_BLOCKS_READ, count);
+    TRACE("read", first, count);
+    if (map) {
+        std::memcpy(buf, map + (size_t)first * BLOCK_SIZE, (size_t)count * BLOCK_SIZE);
+        return 0;
+    }
+    if (backend == DISK_FD)
+        return pio(false, buf, (size_t)count * BLOCK_SIZE, (off_t)first * BLOCK_SIZE);
+    diskfile.seekg((std::streamoff)first * BLOCK_SIZE, std::ios_base::beg);
+    diskfile.read((char*)buf, (std::streamsize)count * BLOCK_SIZE);
+    if (!diskfile.good()) {
+        diskfile.clear();
+        return -1;
+    }
+    return 0;
+}
+
+int
+Disk::read_run(const BlockRead *ios, unsigned count)
+{
+    stat_add(STAT_BLOCKS_READ, count);
+    TRACE("read", ios[0].block_no, count);
+    if (map) {
+        for (unsigned i = 0; i < count; ++i)
+            std::memcpy(ios[i].buf, map + (size_t)ios[i].block_no * BLOCK_SIZE, BLOCK_SIZE);
+        return 0;
+    }
+    if (backend == DISK_FD) {
+        iovec inline_iov[IO_INLINE];
+        std::vector<iovec> heap_iov;
+        iovec *iov = inline_iov;
+        if (count > IO_INLINE) {
+            heap_iov.resize(count);
+            iov = heap_iov.data();
+        }
+        for (unsigned i = 0; i < count; ++i)
+            iov[i] = {ios[i].buf, BLOCK_SIZE};
+        return pio_vec(false, iov, count, (off_t)ios[0].block_no * BLOCK_SIZE);
+    }
+    // the blocks are consecutive, so one seek positions the whole run
+    diskfile.seekg((std::streamoff)ios[0].block_no * BLOCK_SIZE, std::ios_base::beg);
+    for (unsigned i = 0; i < count; ++i)
+        diskfile.read((char*)ios[i].buf, BLOCK_SIZE);
+    if (!diskfile.good()) {
+        diskfile.clear();
+        return -1;
+    }
+    return 0;
+}
+
+int
+Disk::write_run(const BlockWrite *ios, unsigned count)
+{
+    stat_add(STAT_BLOCKS_WRITTEN, count);
+    TRACE("write", ios[0].block_no, count);
+    if (map) {
+        for (unsigned i = 0; i < count; ++i)
+            std::memcpy(map + (size_t)ios[i].block_no * BLOCK_SIZE, ios[i].buf, BLOCK_SIZE);
+        return 0;
+    }
+    if (backend == DISK_FD) {
+        iovec inline_iov[IO_INLINE];
+        std::vector<iovec> heap_iov;
+        iovec *iov = inline_iov;
+        if (count > IO_INLINE) {
+            heap_iov.resize(count);
+            iov = heap_iov.data();
+        }
+        for (unsigned i = 0; i < count; ++i)
+            iov[i] = {const_cast<uint8_t*>(ios[i].buf), BLOCK_SIZE};
+        return pio_vec(true, iov, count, (off_t)ios[0].block_no * BLOCK_SIZE);
+    }
+    diskfile.seekp((std::streamoff)ios[0].block_no * BLOCK_SIZE, std::ios_base::beg);
+    for (unsigned i = 0; i < count; ++i)
+        diskfile.write((const char*)ios[i].buf, BLOCK_SIZE);
+    if (!diskfile.good()) {
+        diskfile.clear();
+        return -1;
+    }
+    return 0;
+}
+
 // writes one block to the disk
 int
-Disk::write(unsigned block_no, uint8_t *blk)
+Disk::write(unsigned block_no, const uint8_t *blk)
 {
     if (DEBUG)
         std::cout << "Disk::write(" << block_no << ")\n";
@@ -41,11 +302,11 @@ Disk::write(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
-    return 0;
+    auto hold = guard();
+    if (cache.capacity() == 0)
+        return write_block(block_no, blk);
+    ra_written(block_no);
+    return cache.fill(block_no, blk, true);
 }
 
 // reads one block from the disk
@@ -56,11 +317,318 @@ Disk::read(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::read(" << block_no << ")\n";
     // check if valid block number
     if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+        std::cout << "Disk::read - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    auto hold = guard();
+    if (cache.capacity() == 0)
+        return read_block(block_no, blk);
+    if (cache.read(block_no, blk))
+        return 0;
+    if (read_block(block_no, blk) != 0)
         return -1;
+    return cache.fill(block_no, blk, false);
+}
+
+// reads a run of blocks; cached copies (which may be dirty) are used where
+// present and every uncached stretch in between is one read from the file
+int
+Disk::read_range(unsigned first, unsigned count, uint8_t *buf)
+{
+    if (DEBUG)
+        std::cout << "Disk::read_range(" << first << ", " << count << ")\n";
+    if (first >= no_blocks || count > no_blocks - first) {
+        std::cout << "Disk::read_range - ERROR: Invalid block range (" << first << ", " << count << ")\n";
+        return -1;
+    }
+    auto hold = guard();
+    return read_range_locked(first, count, buf);
+}
+
+int
+Disk::read_range_locked(unsigned first, unsigned count, uint8_t *buf)
+{
+    if (cache.capacity() == 0)
+        return read_blocks(first, count, buf);
+    unsigned pending = 0; // uncached blocks ending just before block i
+    for (unsigned i = 0; i < count; ++i) {
+        const uint8_t *p = cache.find(first + i);
+        if (!p) {
+            ++pending;
+            continue;
+        }
+        if (pending && read_blocks(first + i - pending, pending,
+                                   buf + (size_t)(i - pending) * BLOCK_SIZE) != 0)
+            return -1;
+        pending = 0;
+        std::memcpy(buf + (size_t)i * BLOCK_SIZE, p, BLOCK_SIZE);
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    if (pending)
+        return read_blocks(first + count - pending, pending,
+                           buf + (size_t)(count - pending) * BLOCK_SIZE);
     return 0;
 }
+
+// reads a batch of blocks into separate buffers; cached blocks are copied
+// from the cache, the rest are sorted and read as runs of adjacent blocks
+int
+Disk::readv(const BlockRead *ios, size_t n)
+{
+    if (DEBUG)
+        std::cout << "Disk::readv(" << n << " blocks)\n";
+    // small batches are sorted on the stack
+    BlockRead inline_todo[IO_INLINE];
+    std::vector<BlockRead> heap_todo;
+    BlockRead *todo = inline_todo;
+    if (n > IO_INLINE) {
+        heap_todo.resize(n);
+        todo = heap_todo.data();
+    }
+    auto hold = guard();
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (ios[i].block_no >= no_blocks) {
+            std::cout << "Disk::readv - ERROR: Invalid block number (" << ios[i].block_no << ")\n";
+            return -1;
+        }
+        if (cache.capacity() > 0 && cache.read(ios[i].block_no, ios[i].buf))
+            continue;
+        todo[m++] = ios[i];
+    }
+    std::sort(todo, todo + m,
+              [](const BlockRead &a, const BlockRead &b) { return a.block_no < b.block_no; });
+    for (size_t i = 0; i < m; ) {
+        size_t j = i + 1;
+        while (j < m && todo[j].block_no == todo[j-1].block_no + 1)
+            ++j;
+        if (read_run(&todo[i], j - i) != 0)
+            return -1;
+        i = j;
+    }
+    return 0;
+}
+
+// writes a batch of blocks from separate buffers, bypassing the block cache;
+// a block listed twice ends up with the contents of its last entry
+int
+Disk::writev(const BlockWrite *ios, size_t n)
+{
+    if (DEBUG)
+        std::cout << "Disk::writev(" << n << " blocks)\n";
+    for (size_t i = 0; i < n; ++i) {
+        if (ios[i].block_no >= no_blocks) {
+            std::cout << "Disk::writev - ERROR: Invalid block number (" << ios[i].block_no << ")\n";
+            return -1;
+        }
+    }
+    std::vector<BlockWrite> todo(ios, ios + n);
+    auto hold = guard();
+    std::stable_sort(todo.begin(), todo.end(),
+                     [](const BlockWrite &a, const BlockWrite &b) { return a.block_no < b.block_no; });
+    for (size_t i = 0; i < todo.size(); ) {
+        size_t j = i + 1;
+        while (j < todo.size() && todo[j].block_no == todo[j-1].block_no + 1)
+            ++j;
+        if (write_run(&todo[i], j - i) != 0)
+            return -1;
+        for (size_t k = i; k < j; ++k) {
+            ra_written(todo[k].block_no);
+            cache.overwrite(todo[k].block_no, todo[k].buf);
+        }
+        i = j;
+    }
+    return 0;
+}
+
+// returns a pointer to the block: into the mapping for DISK_MMAP, into the
+// block cache on a hit, otherwise into the scratch buffer after reading it.
+// A cache frame handed out is pinned, so the read-ahead thread cannot evict
+// it while the caller reads through the pointer. In concurrent mode another
+// thread may evict the cached copy or reuse the scratch buffer at any time,
+// so the block is copied to a per-thread buffer.
+const uint8_t *
+Disk::view(unsigned block_no)
+{
+    if (DEBUG)
+        std::cout << "Disk::view(" << block_no << ")\n";
+    if (block_no >= no_blocks) {
+        std::cout << "Disk::view - ERROR: Invalid block number (" << block_no << ")\n";
+        return nullptr;
+    }
+    if (map)
+        return map + (size_t)block_no * BLOCK_SIZE;
+    auto hold = guard();
+    if (concurrent) {
+        thread_local BlockBuf mine;
+        if (cache.capacity() > 0 && cache.read(block_no, mine.data()))
+            return mine.data();
+        if (read_block(block_no, mine.data()) != 0)
+            return nullptr;
+        if (cache.capacity() > 0)
+            cache.fill(block_no, mine.data(), false);
+        return mine.data();
+    }
+    if (cache.capacity() > 0) {
+        if (const uint8_t *p = cache.find(block_no)) {
+            cache.pin(block_no);
+            return p;
+        }
+        cache.unpin();
+    }
+    if (scratch.size() < BLOCK_SIZE)
+        scratch.resize(BLOCK_SIZE);
+    if (read_block(block_no, scratch.data()) != 0)
+        return nullptr;
+    if (cache.capacity() > 0)
+        cache.fill(block_no, scratch.data(), false);
+    return scratch.data();
+}
+
+const uint8_t *
+Disk::view_range(unsigned first, unsigned count)
+{
+    if (count == 1)
+        return view(first);
+    if (map && first < no_blocks && count <= no_blocks - first)
+        return map + (size_t)first * BLOCK_SIZE;
+    if (first >= no_blocks || count > no_blocks - first)
+        return nullptr;
+    std::lock_guard<std::mutex> hold(lock); // scratch is shared in any mode
+    if (scratch.size() < (size_t)count * BLOCK_SIZE)
+        scratch.resize((size_t)count * BLOCK_SIZE);
+    if (read_range_locked(first, count, scratch.data()) != 0)
+        return nullptr;
+    return scratch.data();
+}
+
+void
+Disk::prefetch(const unsigned *blocks, size_t n)
+{
+    if (map || cache.capacity() == 0)
+        return;
+    auto hold = guard();
+    size_t limit = cache.capacity() / 2;
+    for (size_t i = 0; i < n && ra_busy.size() < limit; ++i) {
+        unsigned b = blocks[i];
+        if (b >= no_blocks || ra_busy.count(b) || cache.contains(b))
+            continue;
+        ra_busy.insert(b);
+        ra_todo.push_back(b);
+    }
+    if (ra_todo.empty())
+        return;
+    if (!ra_thread.joinable())
+        ra_thread = std::thread([this] { ra_worker(); });
+    ra_cv.notify_one();
+}
+
+// Takes whatever has been queued, reads it as runs of adjacent blocks and
+// installs the blocks as clean cache entries. Positional reads can run
+// with the lock released; the fstream's seek position cannot be shared.
+// A block written while it was being read is dropped rather than cached,
+// and one cached meanwhile is left alone since that copy is at least as new.
+void
+Disk::ra_worker()
+{
+    std::unique_lock<std::mutex> hold(lock);
+    std::vector<unsigned> batch;
+    std::vector<uint8_t> data;
+    std::vector<bool> ok;
+    for (;;) {
+        ra_cv.wait(hold, [this] { return ra_stop || !ra_todo.empty(); });
+        if (ra_stop)
+            return;
+        batch.swap(ra_todo);
+        ra_todo.clear();
+        std::sort(batch.begin(), batch.end());
+        data.resize(batch.size() * BLOCK_SIZE);
+        ok.assign(batch.size(), false);
+        bool unlocked = backend == DISK_FD;
+        if (unlocked)
+            hold.unlock();
+        for (size_t i = 0; i < batch.size(); ) {
+            size_t j = i + 1;
+            while (j < batch.size() && batch[j] == batch[j-1] + 1)
+                ++j;
+            bool good = read_blocks(batch[i], j - i, &data[i * BLOCK_SIZE]) == 0;
+            std::fill(ok.begin() + i, ok.begin() + j, good);
+            i = j;
+        }
+        if (unlocked)
+            hold.lock();
+        for (size_t i = 0; i < batch.size(); ++i) {
+            unsigned b = batch[i];
+            if (ok[i] && !ra_stale.count(b) && !cache.contains(b))
+                cache.fill(b, &data[i * BLOCK_SIZE], false);
+            ra_busy.erase(b);
+            ra_stale.erase(b);
+        }
+    }
+}
+
+// writes back all dirty blocks and syncs the disk file; with barrier()
+// the only places where the disk file gets flushed
+int
+Disk::sync()
+{
+    if (map)
+        return datasync();
+    auto hold = guard();
+    if (cache.flush() != 0)
+        return -1;
+    return datasync();
+}
+
+int
+Disk::barrier()
+{
+    if (map)
+        return datasync();
+    auto hold = guard();
+    return datasync();
+}
+
+// fstream: its buffer goes to the kernel first; the mapping is written
+// back by msync, the file descriptors by fdatasync
+int
+Disk::datasync()
+{
+    if (map)
+        return msync(map, disk_size, MS_SYNC) == 0 ? 0 : -1;
+    if (backend == DISK_FSTREAM) {
+        diskfile.flush();
+        if (!diskfile.good())
+            return -1;
+    }
+    return fdatasync(fd >= 0 ? fd : sync_fd) == 0 ? 0 : -1;
+}
+
+// blocks still being read ahead are marked stale, so none of them lands in
+// the emptied cache
+int
+Disk::resize(unsigned nblocks)
+{
+    if (nblocks == 0 || sync() != 0)
+        return -1;
+    auto hold = guard();
+    for (unsigned b : ra_busy)
+        ra_stale.insert(b);
+    cache.clear();
+    if (map) {
+        munmap(map, disk_size);
+        map = nullptr;
+    }
+    off_t bytes = (off_t)nblocks * BLOCK_SIZE;
+    int rc = fd >= 0 ? ftruncate(fd, bytes) : truncate(DISKNAME, bytes);
+    if (rc == 0) {
+        no_blocks = nblocks;
+        disk_size = bytes;
+    } else {
+        std::cout << "Disk::resize - ERROR: " << std::strerror(errno) << "\n";
+    }
+    if (backend == DISK_MMAP && map_file() != 0) {
+        std::cerr << "ERROR: Can't map diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    return rc == 0 ? 0 : -1;
+}
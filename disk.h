@@ -1,29 +1,168 @@
 #include <iostream>
 #include <fstream>
 #include <stdint.h>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_set>
+#include <sys/types.h>
+#include "cache.h"
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
-#define BLOCK_SIZE 4096
+#ifndef DISK_BLOCK_SIZE
+#define DISK_BLOCK_SIZE 4096   // set with make BLOCK_SIZE=...; a power of two
+#endif
+#define BLOCK_SIZE DISK_BLOCK_SIZE
+#define DISK_BLOCKS 2048   // size of a newly created disk file
+#ifndef CACHE_BLOCKS
+#define CACHE_BLOCKS 256   // default block cache capacity
+#endif
 #define DEBUG false
+#define IO_INLINE 16       // vectored requests up to this size do not allocate
+#define DIRECT_BOUNCE 16   // blocks per bounce for unaligned O_DIRECT buffers
+
+static_assert(BLOCK_SIZE >= 4096 && (BLOCK_SIZE & (BLOCK_SIZE - 1)) == 0,
+              "BLOCK_SIZE must be a power of two of at least 4096");
+
+struct iovec;
+
+// how the disk file is accessed
+enum DiskBackend {
+    DISK_FSTREAM,   // std::fstream, one seek + read/write per block
+    DISK_MMAP,      // the whole file mapped into memory
+    DISK_FD         // file descriptor, one pread/pwrite(v) per run of blocks
+};
+
+// a staged block image; aligned so on-disk structs can be laid over it
+struct alignas(8) BlockBuf : std::array<uint8_t, BLOCK_SIZE> {};
+
+// one block of a vectored read
+struct BlockRead {
+    unsigned block_no;
+    uint8_t *buf;
+};
+
+// one block of a vectored write
+struct BlockWrite {
+    unsigned block_no;
+    const uint8_t *buf;
+};
+
+struct DiskOptions {
+    DiskBackend backend = DISK_FSTREAM;
+    unsigned blocks = DISK_BLOCKS;        // size of the disk file if there is
+                                          // none yet; an existing one keeps its own
+    unsigned cache_blocks = CACHE_BLOCKS; // 0 writes straight to the disk file;
+                                          // unused by DISK_MMAP (the page cache
+                                          // already holds the blocks)
+    bool direct = false;                  // DISK_FD: open with O_DIRECT, so
+                                          // transfers skip the page cache
+    bool concurrent = false;              // used from several threads: view()
+                                          // then copies into a per-thread buffer
+};
 
 class Disk {
+    friend class AioQueue;          // issues transfers on fd, checks the cache
 private:
+    DiskBackend backend;
     std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    int fd = -1;                     // DISK_MMAP and DISK_FD
+    int sync_fd = -1;                // DISK_FSTREAM: only for fdatasync
+    bool direct = false;             // fd was opened with O_DIRECT
+    uint8_t *map = nullptr;          // DISK_MMAP: start of the mapped file
+    unsigned no_blocks = 0;          // taken from the size of the disk file
+    uint64_t disk_size = 0;
+    bool concurrent;
+    BlockCache cache;
+    std::vector<uint8_t> scratch;    // backs view() when a block is not cached
+    std::mutex lock;                 // serializes the fstream and the cache
+    // the mapping and an uncached fd need no lock: the FS above keeps
+    // threads off each other's blocks and there is no seek position or
+    // cache to share
+    std::unique_lock<std::mutex> guard() {
+        bool shared = !map && (backend != DISK_FD || cache.capacity() > 0);
+        return shared ? std::unique_lock<std::mutex>(lock) : std::unique_lock<std::mutex>();
+    }
+    int read_range_locked(unsigned first, unsigned count, uint8_t *buf);
+    // moves what has been written to the disk file onto stable storage
+    int datasync();
+
+    // background read-ahead into the block cache, see prefetch(); all of
+    // it is guarded by lock
+    std::thread ra_thread;               // started by the first prefetch()
+    std::condition_variable ra_cv;
+    std::vector<unsigned> ra_todo;       // queued, not yet being read
+    std::unordered_set<unsigned> ra_busy; // queued or being read
+    std::unordered_set<unsigned> ra_stale; // written meanwhile: drop the read
+    bool ra_stop = false;
+    void ra_worker();
+    void ra_written(unsigned block_no) {
+        if (!ra_busy.empty() && ra_busy.count(block_no)) ra_stale.insert(block_no);
+    }
     bool disk_file_exists (const std::string& name);
+    int map_file();
+    int open_fd(bool want_direct);
+    // DISK_FD: move len bytes at off, looping over short transfers;
+    // unaligned buffers go through a bounce buffer under O_DIRECT
+    int pio(bool write, uint8_t *buf, size_t len, off_t off);
+    // DISK_FD: scatter/gather version of pio(), for one run of blocks
+    int pio_vec(bool write, iovec *iov, unsigned count, off_t off);
+    // uncached block transfer to/from the disk file
+    int write_block(unsigned block_no, const uint8_t *blk);
+    int read_blocks(unsigned first, unsigned count, uint8_t *buf);
+    // transfer one run of consecutive blocks to/from separate buffers
+    int read_run(const BlockRead *ios, unsigned count);
+    int write_run(const BlockWrite *ios, unsigned count);
+    int read_block(unsigned block_no, uint8_t *blk) { return read_blocks(block_no, 1, blk); }
 public:
-    Disk();
+    Disk(const DiskOptions &opts = DiskOptions());
     ~Disk();
     unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
-    // writes one block to the disk
-    int write(unsigned block_no, uint8_t *blk);
+    // DISK_MMAP: view() points into the mapping, so its views stay valid
+    bool mapped() const { return map != nullptr; }
+    // view() may be called from several threads at once
+    bool concurrent_views() const { return concurrent || map; }
+    uint64_t get_disk_size() { return disk_size; }
+    // makes the disk file nblocks blocks long. Dirty blocks are written back
+    // first and the cache is emptied; nothing else may use the Disk meanwhile.
+    int resize(unsigned nblocks);
+    // writes one block to the disk (held in the cache until sync)
+    int write(unsigned block_no, const uint8_t *blk);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // reads count consecutive blocks into buf with as few transfers as the
+    // block cache allows; the blocks are not added to the cache
+    int read_range(unsigned first, unsigned count, uint8_t *buf);
+    // scatter/gather versions of read_range: the requests are sorted by
+    // block number and adjacent blocks are transferred as one run. Reads
+    // prefer cached copies; writes go straight to the disk file (bulk data
+    // is not worth caching) and refresh any cached copy they replace.
+    int readv(const BlockRead *ios, size_t n);
+    int writev(const BlockWrite *ios, size_t n);
+    // returns a read-only view of one block without copying it, or nullptr
+    // on an invalid block. The view is valid until the next call on the Disk,
+    // background read-ahead included (in concurrent mode: until the calling
+    // thread's next view()).
+    const uint8_t *view(unsigned block_no);
+    // same as view() for count consecutive blocks
+    const uint8_t *view_range(unsigned first, unsigned count);
+    // starts reading blocks into the block cache in the background, so a
+    // later read finds them there. Blocks already cached are skipped and at
+    // most half the cache is ever in flight; without a cache (or with the
+    // mapping) this does nothing.
+    void prefetch(const unsigned *blocks, size_t n);
+    // writes back all dirty blocks and puts the disk file on stable storage
+    int sync();
+    // puts every write handed to the disk file so far on stable storage,
+    // leaving the dirty blocks in the cache where they are; writes after
+    // the barrier cannot reach the disk ahead of those before it
+    int barrier();
+    const BlockCache::Stats &cache_stats() const { return cache.stats(); }
 };
 
 #endif // __DISK_H__
@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <iostream>
+#include "fat.h"
+#include "stats.h"
+
+void
+Fat::reset(unsigned n)
+{
+    nentries = n;
+    npages = (n + FAT_PER_PAGE - 1) / FAT_PER_PAGE;
+    pages.reset(new std::atomic<Page*>[npages]());
+    owned.clear();
+    is_dirty.assign(npages, false);
+    dirty.clear();
+}
+
+void
+Fat::open(unsigned n)
+{
+    reset(n);
+}
+
+void
+Fat::clear(unsigned n)
+{
+    reset(n);
+    for (unsigned p = 0; p < npages; ++p) {
+        owned.push_back(std::make_unique<Page>());
+        std::fill(std::begin(owned.back()->e), std::end(owned.back()->e), FAT_FREE);
+        pages[p].store(owned.back().get(), std::memory_order_release);
+        mark(p);
+    }
+}
+
+// the pointer is published only once the page is filled in, so a reader
+// that finds it set can use it without the lock
+Fat::Page *
+Fat::load(unsigned p)
+{
+    std::lock_guard<std::mutex> hold(load_lock);
+    if (Page *pg = pages[p].load(std::memory_order_acquire))
+        return pg;
+    stat_add(STAT_FAT_LOADS);
+    auto pg = std::make_unique<Page>();
+    if (read(p, reinterpret_cast<uint8_t*>(pg->e)) != 0) {
+        std::cout << "Fat - ERROR: cannot read FAT page " << p << "\n";
+        return nullptr;
+    }
+    pages[p].store(pg.get(), std::memory_order_release);
+    owned.push_back(std::move(pg));
+    return owned.back().get();
+}
+
+Fat::Page *
+Fat::page(unsigned p)
+{
+    Page *pg = pages[p].load(std::memory_order_acquire);
+    return pg ? pg : load(p);
+}
+
+void
+Fat::mark(unsigned p)
+{
+    if (!is_dirty[p]) {
+        is_dirty[p] = true;
+        dirty.push_back(p);
+    }
+}
+
+int32_t
+Fat::raw(unsigned b)
+{
+    stat_add(STAT_FAT_LOOKUPS);
+    if (b >= nentries)
+        return FAT_EOF;
+    Page *pg = page(b / FAT_PER_PAGE);
+    return pg ? pg->e[b % FAT_PER_PAGE] : FAT_EOF;
+}
+
+int32_t
+Fat::get(unsigned b)
+{
+    int32_t v = raw(b);
+    if (v == FAT_EOF_UNWRITTEN)
+        return FAT_EOF;
+    return v < 0 ? v : v & ~FAT_UNWRITTEN;
+}
+
+bool
+Fat::unwritten(unsigned b)
+{
+    int32_t v = raw(b);
+    return v == FAT_EOF_UNWRITTEN || (v > 0 && (v & FAT_UNWRITTEN));
+}
+
+void
+Fat::set(unsigned b, int32_t v)
+{
+    if (b >= nentries)
+        return;
+    unsigned p = b / FAT_PER_PAGE;
+    Page *pg = page(p);
+    if (!pg)
+        return;
+    int32_t &e = pg->e[b % FAT_PER_PAGE];
+    bool flag = e == FAT_EOF_UNWRITTEN || (e > 0 && (e & FAT_UNWRITTEN));
+    if (flag && v != FAT_FREE)
+        v = v == FAT_EOF ? FAT_EOF_UNWRITTEN : v | FAT_UNWRITTEN;
+    e = v;
+    mark(p);
+}
+
+// changes nothing, the page's dirty bit included, if b already is so
+void
+Fat::set_unwritten(unsigned b, bool on)
+{
+    if (b >= nentries)
+        return;
+    unsigned p = b / FAT_PER_PAGE;
+    Page *pg = page(p);
+    if (!pg)
+        return;
+    int32_t &e = pg->e[b % FAT_PER_PAGE];
+    if (e == FAT_FREE)
+        return;
+    int32_t v;
+    if (e == FAT_EOF || e == FAT_EOF_UNWRITTEN)
+        v = on ? FAT_EOF_UNWRITTEN : FAT_EOF;
+    else
+        v = on ? e | FAT_UNWRITTEN : e & ~FAT_UNWRITTEN;
+    if (v != e) {
+        e = v;
+        mark(p);
+    }
+}
+
+// entries past the end of the table are zero in the last page, which is
+// also how a fresh page of clear() leaves them
+int
+Fat::flush(const WriteFn &write)
+{
+    std::sort(dirty.begin(), dirty.end());
+    std::vector<unsigned> failed;
+    for (unsigned p : dirty) {
+        Page *pg = pages[p].load(std::memory_order_acquire);
+        if (write(p, reinterpret_cast<const uint8_t*>(pg->e)) != 0) {
+            failed.push_back(p);
+            continue;
+        }
+        is_dirty[p] = false;
+    }
+    dirty.swap(failed);
+    return dirty.empty() ? 0 : -1;
+}
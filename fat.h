@@ -0,0 +1,93 @@
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "disk.h"
+
+#ifndef __FAT_H__
+#define __FAT_H__
+
+#define FAT_FREE 0
+#define FAT_EOF -1
+#define FAT_PER_PAGE (BLOCK_SIZE / sizeof(int32_t))   // entries in one FAT block
+
+// A block can be reserved for a file without being written (a hole, or
+// space set aside by fallocate): its entry carries FAT_UNWRITTEN, and the
+// block reads as zeros whatever is on the disk. The last block of a chain
+// stores FAT_EOF_UNWRITTEN instead. get() and fat[b] give the link alone.
+#define FAT_UNWRITTEN 0x40000000
+#define FAT_EOF_UNWRITTEN -2
+#define FAT_MAX_BLOCKS FAT_UNWRITTEN   // block numbers leave the flag bit clear
+
+// The FAT, paged in one block at a time. A page is read the first time one
+// of its entries is used and stays in memory after that; set() marks its
+// page dirty and flush() writes back the dirty pages only, so mounting does
+// not read the table and an operation writes just the pages it touched.
+// Pages are loaded under a lock, so readers may use get() alongside the one
+// writer that calls set() and flush().
+class Fat {
+public:
+    using ReadFn = std::function<int(unsigned page, uint8_t *buf)>;
+    using WriteFn = std::function<int(unsigned page, const uint8_t *buf)>;
+
+    // entry b, so that fat[b] reads and assigns like an array element
+    class Ref {
+        Fat &fat;
+        unsigned b;
+    public:
+        Ref(Fat &fat, unsigned b) : fat(fat), b(b) { }
+        operator int32_t() const { return fat.get(b); }
+        Ref &operator=(int32_t v) { fat.set(b, v); return *this; }
+        Ref &operator=(const Ref &r) { return *this = (int32_t)r; }
+    };
+
+private:
+    struct Page {
+        int32_t e[FAT_PER_PAGE];
+    };
+
+    ReadFn read;
+    unsigned nentries = 0;
+    unsigned npages = 0;
+    std::unique_ptr<std::atomic<Page*>[]> pages;  // nullptr until loaded
+    std::vector<std::unique_ptr<Page>> owned;
+    std::vector<bool> is_dirty;
+    std::vector<unsigned> dirty;                  // pages to write back
+    mutable std::mutex load_lock;
+
+    void reset(unsigned n);
+    Page *page(unsigned p);
+    Page *load(unsigned p);
+    void mark(unsigned p);
+    // entry b as stored, flag included
+    int32_t raw(unsigned b);
+
+public:
+    explicit Fat(ReadFn read) : read(std::move(read)) { }
+
+    // n entries whose pages come from read() when first used
+    void open(unsigned n);
+    // n entries, all FAT_FREE; every page is dirty, so the next flush()
+    // writes all of them
+    void clear(unsigned n);
+    unsigned size() const { return nentries; }
+    // FAT_EOF for a block whose page cannot be read
+    int32_t get(unsigned b);
+    // links b to v; b stays unwritten if it was, unless v is FAT_FREE
+    void set(unsigned b, int32_t v);
+    bool unwritten(unsigned b);
+    void set_unwritten(unsigned b, bool on);
+    Ref operator[](unsigned b) { return Ref(*this, b); }
+    bool pending() const { return !dirty.empty(); }
+    // writes the dirty pages in page order; the ones that fail stay dirty
+    int flush(const WriteFn &write);
+    // pages in memory
+    size_t loaded() const {
+        std::lock_guard<std::mutex> hold(load_lock);
+        return owned.size();
+    }
+};
+
+#endif // __FAT_H__
@@ -0,0 +1,356 @@
+// file.cpp: open files (FS::open() and the calls on its handles)
+#include "fs.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+// A handle names its file by directory and name, as a path does, and
+// finds the entry again on every call (a hash lookup in the dentry cache
+// once warm), so it sees changes made through other handles and paths.
+// What it keeps between calls is its position and a cursor into the FAT
+// chain. The cursor is good while the entry still starts at the same block
+// and no chain has lost blocks since (chain_gen); blocks a little past it
+// are found by walking on from there, any others through the chain index.
+//
+// Bytes past a file's size are never read back; every call that makes a
+// file longer zero fills the bytes between the old and the new end first.
+// Only the old last block is written for that: the blocks added behind it
+// are flagged unwritten in the FAT and read as zeros until written.
+
+FS::OpenFile *FS::handle(int fd) {
+    std::lock_guard<std::mutex> hold(files_lock);
+    if (fd < 0 || (size_t)fd >= files.size()) return nullptr;
+    return files[fd].get();
+}
+
+int FS::reopen(OpenFile &h, dir_entry &e, DirLoc &loc) {
+    if (dir_find(h.dir, h.name, loc, &e) != 0 || e.type != TYPE_FILE) {
+        std::cout << "Error: File not found: " << h.name << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int32_t FS::seek_block(OpenFile &h, const dir_entry &e, size_t idx) {
+    uint64_t gen = chain_gen;
+    if (h.first != e.first_blk || h.gen != gen || idx < h.idx || idx - h.idx >= CHAIN_STRIDE) {
+        h.first = e.first_blk;
+        h.gen = gen;
+        h.idx = idx;
+        h.blk = chains.find(e.first_blk, idx);
+        return h.blk;
+    }
+    while (h.idx < idx && h.blk != FAT_EOF) {
+        h.blk = fat[h.blk];
+        ++h.idx;
+    }
+    return h.blk;
+}
+
+// write ios and clear the unwritten flags of their blocks
+int FS::write_blocks(const std::vector<BlockWrite> &ios) {
+    if (disk.writev(ios.data(), ios.size()) != 0) return -1;
+    for (const BlockWrite &w : ios)
+        fat.set_unwritten(w.block_no, false);
+    return 0;
+}
+
+// n bytes at off into e's chain, which already reaches that far; zeros
+// when data is null. Whole blocks are written straight from data, and a
+// partial one is read first unless it starts at or past old_size, where
+// there is nothing to keep. Zeros are not written to a block that is, or
+// as a whole becomes, unwritten.
+int FS::write_range(OpenFile &h, const dir_entry &e, uint64_t off, const uint8_t *data,
+                    size_t n, uint64_t old_size) {
+    static const BlockBuf zeros = {};
+    BlockBuf head, tail;                 // partial first and last block
+    std::vector<BlockWrite> ios;
+    ios.reserve(std::min<size_t>(IO_BATCH, blocks_for(n) + 1));
+    size_t done = 0;
+    while (done < n) {
+        uint64_t pos = off + done;
+        size_t idx = pos / BLOCK_SIZE, in = pos % BLOCK_SIZE;
+        size_t k = std::min<size_t>(BLOCK_SIZE - in, n - done);
+        int32_t blk = seek_block(h, e, idx);
+        if (blk == FAT_EOF) return -1;
+        if (!data && (k == BLOCK_SIZE || fat.unwritten(blk))) {
+            fat.set_unwritten(blk, true);
+            done += k;
+            continue;
+        }
+        const uint8_t *src = data ? data + done : zeros.data();
+        if (k < BLOCK_SIZE) {
+            BlockBuf &b = done == 0 ? head : tail;
+            if ((uint64_t)idx * BLOCK_SIZE < old_size) {
+                if (read_block(blk, b.data()) != 0) return -1;
+            } else {
+                b.fill(0);
+            }
+            if (data) std::memcpy(b.data() + in, data + done, k);
+            else std::memset(b.data() + in, 0, k);
+            src = b.data();
+        }
+        ios.push_back({(unsigned)blk, src});
+        done += k;
+        if (ios.size() == IO_BATCH) {
+            if (write_blocks(ios) != 0) return -1;
+            ios.clear();
+        }
+    }
+    return write_blocks(ios);
+}
+
+// make e's chain long enough for size bytes and zero fill from its old
+// end up to zero_to; the new blocks are unwritten. e.size is left to the
+// caller.
+int FS::extend(OpenFile &h, dir_entry &e, uint64_t size, uint64_t zero_to) {
+    size_t have = std::max<size_t>(1, blocks_for(e.size));
+    size_t want = std::max<size_t>(1, blocks_for(size));
+    if (want > have) {
+        int32_t last = seek_block(h, e, have - 1);
+        if (last == FAT_EOF) return -1;
+        int ext = alloc_chain(want - have);
+        if (ext < 0) return -1;
+        mark_unwritten(ext);
+        fat[last] = ext;
+    }
+    if (zero_to > e.size)
+        return write_range(h, e, e.size, nullptr, zero_to - e.size, e.size);
+    return 0;
+}
+
+int FS::open(std::string_view filepath, int flags) {
+    OpTimer timer(OP_OPEN);
+    if (!(flags & (OPEN_READ | OPEN_WRITE))) return -1;
+    DirGuard g(*this);
+    MetaOp op(*this);
+    uint32_t dir; std::string_view name;
+    if (resolve_path(filepath, dir, name) != 0 || name.empty()) {
+        std::cout << "Error: File not found: " << filepath << std::endl;
+        return -1;
+    }
+    dir_entry e; DirLoc loc;
+    if (dir_find(dir, name, loc, &e) != 0) {
+        if (!(flags & OPEN_CREATE)) {
+            std::cout << "Error: File not found: " << filepath << std::endl;
+            return -1;
+        }
+        if (name.length() > MAX_NAME_LEN) {
+            std::cout << "Error: File name too long (max 55 characters allowed)\n";
+            return -1;
+        }
+        // empty, so inline until the first write
+        e = {};
+        set_entry_name(e, name);
+        e.first_blk = FAT_EOF;
+        e.type = TYPE_FILE;
+        e.access_rights = READ | WRITE;
+        e.flags = ENTRY_INLINE;
+        g.lock(dir);
+        if (dir_add(dir, e) != 0) return -1;
+    }
+    if (e.type != TYPE_FILE) {
+        std::cout << "Error: " << filepath << " is a directory" << std::endl;
+        return -1;
+    }
+    if ((flags & OPEN_READ) && !(e.access_rights & READ)) {
+        std::cout << "Error: Permission denied (no read access) on " << filepath << std::endl;
+        return -1;
+    }
+    if ((flags & (OPEN_WRITE | OPEN_TRUNC)) && !(e.access_rights & WRITE)) {
+        std::cout << "Error: Permission denied (no write access) on " << filepath << std::endl;
+        return -1;
+    }
+
+    auto h = std::make_unique<OpenFile>();
+    h->dir = dir;
+    h->name = name;
+    h->flags = flags;
+    h->first = e.first_blk;
+    h->gen = chain_gen;
+    h->blk = e.first_blk;
+    int fd;
+    {
+        std::lock_guard<std::mutex> hold(files_lock);
+        auto slot = std::find(files.begin(), files.end(), nullptr);
+        fd = slot - files.begin();
+        if (slot == files.end()) files.push_back(std::move(h));
+        else *slot = std::move(h);
+    }
+    if ((flags & OPEN_TRUNC) && e.size > 0 && truncate(fd, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int FS::close(int fd) {
+    std::lock_guard<std::mutex> hold(files_lock);
+    if (fd < 0 || (size_t)fd >= files.size() || !files[fd]) return -1;
+    files[fd].reset();
+    return 0;
+}
+
+// whole blocks are read into buf with one vectored read per IO_BATCH;
+// partial ones go through the block cache, which suits small reads that
+// keep coming back to the same blocks
+ssize_t FS::pread(int fd, void *buf, size_t n, uint64_t off) {
+    OpTimer timer(OP_PREAD);
+    OpenFile *h = handle(fd);
+    if (!h || !(h->flags & OPEN_READ)) return -1;
+    DirGuard g(*this);
+    g.enter(h->dir);
+    dir_entry e; DirLoc loc;
+    if (reopen(*h, e, loc) != 0) return -1;
+    if (off >= e.size) return 0;
+    n = std::min<uint64_t>(n, e.size - off);
+    auto *out = static_cast<uint8_t*>(buf);
+    if (is_inline(e)) {
+        uint8_t data[INLINE_MAX];
+        if (dir_inline(loc, e, data) != 0) return -1;
+        std::memcpy(out, data + off, n);
+        return n;
+    }
+    if (is_compressed(e)) {
+        size_t done = 0;
+        int rc = unpack_range(e.first_blk, e.size, off, n, [&](const uint8_t *p, size_t k) {
+            std::memcpy(out + done, p, k);
+            done += k;
+            return 0;
+        });
+        return rc == 0 ? (ssize_t)n : -1;
+    }
+    size_t done = 0;
+    while (done < n) {
+        uint64_t pos = off + done;
+        size_t idx = pos / BLOCK_SIZE, in = pos % BLOCK_SIZE;
+        int32_t blk = seek_block(*h, e, idx);
+        if (blk == FAT_EOF) return -1;   // the chain is shorter than the size
+        if (in == 0 && n - done >= BLOCK_SIZE) {
+            size_t count = std::min<size_t>((n - done) / BLOCK_SIZE, IO_BATCH);
+            int got = read_chain(blk, count, out + done);
+            if (got <= 0) return -1;
+            h->idx = idx + got;
+            h->blk = blk;
+            done += (size_t)got * BLOCK_SIZE;
+        } else {
+            BlockBuf b;
+            if (read_block(blk, b.data()) != 0) return -1;
+            size_t k = std::min<size_t>(BLOCK_SIZE - in, n - done);
+            std::memcpy(out + done, b.data() + in, k);
+            done += k;
+        }
+    }
+    return n;
+}
+
+ssize_t FS::pwrite(int fd, const void *buf, size_t n, uint64_t off) {
+    OpTimer timer(OP_PWRITE);
+    OpenFile *h = handle(fd);
+    if (!h || !(h->flags & OPEN_WRITE)) return -1;
+    if (off > UINT32_MAX || n > UINT32_MAX - off) return -1;    // dir_entry::size
+    DirGuard g(*this);
+    MetaOp op(*this);
+    dir_entry e; DirLoc loc;
+    if (reopen(*h, e, loc) != 0) return -1;
+    if (n == 0) return 0;
+    g.lock(h->dir);
+    // a reflinked or inline file gets a chain of its own first, which the
+    // entry must then point at even if the write fails
+    uint32_t old_first = e.first_blk;
+    if (unshare(e, loc) != 0) return -1;
+    uint64_t old_size = e.size;
+    int rc = 0;
+    if (off + n > e.size) rc = extend(*h, e, off + n, off);
+    if (rc == 0) rc = write_range(*h, e, off, static_cast<const uint8_t*>(buf), n, old_size);
+    if (rc == 0) e.size = std::max<uint64_t>(e.size, off + n);
+    if ((e.size != old_size || e.first_blk != old_first) && dir_update(h->dir, loc, e) != 0)
+        rc = -1;
+    return rc == 0 ? (ssize_t)n : -1;
+}
+
+ssize_t FS::read(int fd, void *buf, size_t n) {
+    OpenFile *h = handle(fd);
+    if (!h) return -1;
+    ssize_t got = pread(fd, buf, n, h->pos);
+    if (got > 0) h->pos += got;
+    return got;
+}
+
+ssize_t FS::write(int fd, const void *buf, size_t n) {
+    OpenFile *h = handle(fd);
+    if (!h) return -1;
+    ssize_t put = pwrite(fd, buf, n, h->pos);
+    if (put > 0) h->pos += put;
+    return put;
+}
+
+// only the position moves; the chain is walked by the next transfer, from
+// the cursor when the new position is at or past it
+int64_t FS::lseek(int fd, int64_t off, int whence) {
+    OpenFile *h = handle(fd);
+    if (!h) return -1;
+    int64_t base;
+    if (whence == SEEK_SET) {
+        base = 0;
+    } else if (whence == SEEK_CUR) {
+        base = h->pos;
+    } else if (whence == SEEK_END) {
+        DirGuard g(*this);
+        g.enter(h->dir);
+        dir_entry e; DirLoc loc;
+        if (reopen(*h, e, loc) != 0) return -1;
+        base = e.size;
+    } else {
+        return -1;
+    }
+    if (off < -base) return -1;
+    h->pos = base + off;
+    return h->pos;
+}
+
+int FS::truncate(int fd, uint64_t size) {
+    OpTimer timer(OP_TRUNCATE);
+    OpenFile *h = handle(fd);
+    if (!h || !(h->flags & OPEN_WRITE)) return -1;
+    if (size > UINT32_MAX) return -1;
+    DirGuard g(*this);
+    MetaOp op(*this);
+    dir_entry e; DirLoc loc;
+    if (reopen(*h, e, loc) != 0) return -1;
+    if (size == e.size) return 0;
+    g.lock(h->dir);
+    uint32_t old_first = e.first_blk;
+    if (unshare(e, loc) != 0) return -1;
+    int rc = 0;
+    if (size < e.size) {
+        // keep the blocks that hold size bytes (at least one) and free the rest
+        int32_t last = seek_block(*h, e, std::max<size_t>(1, blocks_for(size)) - 1);
+        if (last == FAT_EOF) {
+            rc = -1;
+        } else if (fat[last] != FAT_EOF) {
+            free_chain(fat[last]);
+            fat[last] = FAT_EOF;
+        }
+    } else {
+        rc = extend(*h, e, size, size);
+    }
+    if (rc == 0) e.size = size;
+    if ((rc == 0 || e.first_blk != old_first) && dir_update(h->dir, loc, e) != 0)
+        rc = -1;
+    return rc;
+}
+
+int FS::fallocate(int fd, uint64_t off, uint64_t len) {
+    OpTimer timer(OP_FALLOCATE);
+    OpenFile *h = handle(fd);
+    if (!h || !(h->flags & OPEN_WRITE)) return -1;
+    if (off > UINT32_MAX || len > UINT32_MAX - off) return -1;
+    DirGuard g(*this);
+    MetaOp op(*this);
+    dir_entry e; DirLoc loc;
+    if (reopen(*h, e, loc) != 0) return -1;
+    // every block below the size is in the chain already
+    if (off + len <= e.size) return 0;
+    return truncate(fd, off + len);
+}
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <bit>
+#include "freemap.h"
+
+void
+FreeMap::reset(unsigned n)
+{
+    nblocks = n;
+    nfree = 0;
+    cursor = 0;
+    bits.assign((n + 63) / 64, 0);
+    summary.assign((bits.size() + 63) / 64, 0);
+}
+
+void
+FreeMap::assign(unsigned n, const uint64_t *words)
+{
+    reset(n);
+    std::copy(words, words + bits.size(), bits.begin());
+    if (n % 64)
+        bits.back() &= (uint64_t(1) << (n % 64)) - 1;
+    for (size_t w = 0; w < bits.size(); ++w) {
+        if (bits[w])
+            summary[w / 64] |= uint64_t(1) << (w % 64);
+        nfree += std::popcount(bits[w]);
+    }
+}
+
+void
+FreeMap::set_free(unsigned b)
+{
+    bits[b / 64] |= uint64_t(1) << (b % 64);
+    summary[b / 4096] |= uint64_t(1) << (b / 64 % 64);
+    ++nfree;
+}
+
+void
+FreeMap::set_used(unsigned b)
+{
+    uint64_t &w = bits[b / 64];
+    w &= ~(uint64_t(1) << (b % 64));
+    if (w == 0)
+        summary[b / 4096] &= ~(uint64_t(1) << (b / 64 % 64));
+    --nfree;
+}
+
+int
+FreeMap::first_free(unsigned from) const
+{
+    if (from >= nblocks)
+        return -1;
+    // rest of the word holding 'from'
+    unsigned w = from / 64;
+    uint64_t word = bits[w] & (~uint64_t(0) << (from % 64));
+    if (word)
+        return w * 64 + std::countr_zero(word);
+    // then the summary, starting with the word after it
+    ++w;
+    for (unsigned s = w / 64; s < summary.size(); ++s) {
+        uint64_t sum = summary[s];
+        if (s == w / 64)
+            sum &= ~uint64_t(0) << (w % 64);
+        if (sum) {
+            unsigned fw = s * 64 + std::countr_zero(sum);
+            return fw * 64 + std::countr_zero(bits[fw]);
+        }
+    }
+    return -1;
+}
+
+unsigned
+FreeMap::first_used(unsigned from) const
+{
+    unsigned w = from / 64;
+    if (w >= bits.size())
+        return nblocks;
+    uint64_t word = ~bits[w] & (~uint64_t(0) << (from % 64));
+    while (!word) {
+        if (++w == bits.size())
+            return nblocks;
+        word = ~bits[w];
+    }
+    unsigned b = w * 64 + std::countr_zero(word);
+    return b < nblocks ? b : nblocks;
+}
+
+int
+FreeMap::alloc()
+{
+    int b = first_free();
+    if (b >= 0)
+        set_used(b);
+    return b;
+}
+
+int
+FreeMap::alloc_run(unsigned count)
+{
+    if (count == 0 || count > nfree)
+        return -1;
+    unsigned pos = 0;
+    for (;;) {
+        int start = first_free(pos);
+        if (start < 0)
+            return -1;
+        unsigned end = first_used(start);
+        if (end - start >= count) {
+            for (unsigned b = start; b < start + count; ++b)
+                set_used(b);
+            return start;
+        }
+        pos = end;
+    }
+}
+
+// Looking at every free run would make each extent cost O(free runs) on a
+// fragmented disk, so the search stops after EXTENT_SCAN runs; an exact
+// fit ends it at once.
+int
+FreeMap::alloc_extent(unsigned want, unsigned &got)
+{
+    got = 0;
+    if (want == 0 || nfree == 0)
+        return -1;
+    int best = -1, largest = -1;
+    unsigned best_len = 0, largest_len = 0;
+    unsigned from = cursor < nblocks ? cursor : 0;
+    unsigned pos = from, runs = 0;
+    bool wrapped = false;
+    while (runs < EXTENT_SCAN) {
+        int start = first_free(pos);
+        if (start < 0 || (wrapped && (unsigned)start >= from)) {
+            if (wrapped || from == 0)
+                break;
+            wrapped = true;
+            pos = 0;
+            continue;
+        }
+        unsigned end = first_used(start);
+        unsigned len = end - start;
+        ++runs;
+        if (len == want) {
+            best = start;
+            best_len = len;
+            break;
+        }
+        if (len > want && (best < 0 || len < best_len)) {
+            best = start;
+            best_len = len;
+        }
+        if (len > largest_len) {
+            largest = start;
+            largest_len = len;
+        }
+        pos = end;
+    }
+    if (best < 0) {
+        best = largest;
+        want = largest_len;
+    }
+    for (unsigned b = best; b < best + want; ++b)
+        set_used(b);
+    cursor = best + want;
+    got = want;
+    return best;
+}
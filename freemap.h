@@ -0,0 +1,52 @@
+#include <cstdint>
+#include <vector>
+
+#ifndef __FREEMAP_H__
+#define __FREEMAP_H__
+
+#define EXTENT_SCAN 64   // free runs alloc_extent() looks at, at most
+
+// In-memory free-block bitmap, built from the FAT at mount time unless a
+// clean unmount left a copy on the disk (see FS::save_summary()).
+// A second-level summary word marks which bitmap words still have a free
+// block, so find-first-set skips full regions 4096 blocks at a time.
+class FreeMap {
+private:
+    std::vector<uint64_t> bits;     // bit set = block is free
+    std::vector<uint64_t> summary;  // bit w set = bits[w] != 0
+    unsigned nblocks = 0;
+    unsigned nfree = 0;
+    unsigned cursor = 0;            // alloc_extent() starts looking here
+
+    void set_free(unsigned b);
+    void set_used(unsigned b);
+    // lowest used block >= from, or nblocks if the rest is free
+    unsigned first_used(unsigned from) const;
+
+public:
+    // marks all nblocks blocks as in use
+    void reset(unsigned nblocks);
+    // nblocks blocks, free where a bit of words is set (the layout words()
+    // hands out); bits past the last block are ignored
+    void assign(unsigned nblocks, const uint64_t *words);
+    const std::vector<uint64_t> &words() const { return bits; }
+    void release(unsigned b) { if (!is_free(b)) set_free(b); }
+    void take(unsigned b) { if (is_free(b)) set_used(b); }
+    bool is_free(unsigned b) const { return bits[b / 64] >> (b % 64) & 1; }
+    unsigned free_count() const { return nfree; }
+    // lowest free block >= from, or -1
+    int first_free(unsigned from = 0) const;
+    // allocates the lowest free block, or returns -1 when the disk is full
+    int alloc();
+    // allocates count contiguous blocks (first fit) and returns the first
+    // one, or -1 if no free run is long enough
+    int alloc_run(unsigned count);
+    // allocates up to want contiguous blocks, next fit: of the first
+    // EXTENT_SCAN free runs from where the last extent ended (wrapping
+    // around), the smallest that holds all of them, else the largest. Returns
+    // the first block and sets got to the run length, or -1 when the disk is
+    // full.
+    int alloc_extent(unsigned want, unsigned &got);
+};
+
+#endif // __FREEMAP_H__
@@ -1,133 +1,332 @@
 // fs.cpp
 #include "fs.h"
+#include "aio.h"
 #include <algorithm>
-#include <sstream>
+#include <charconv>
+#include <climits>
+#include <cstdlib>
+#include <memory>
 #include <vector>
 #include <cstring>
 #include <iostream>
+#include <sys/uio.h>
 
 // Constructor: load on‐disk FAT or format fresh
-FS::FS()
-  : current_dir(ROOT_BLOCK)
+FS::FS(const DiskOptions &opts)
+  : disk(opts),
+    journal(disk, [this](size_t n, std::vector<unsigned> &out) { return spill_blocks(n, out); },
+            [this](unsigned b) { freemap.release(b); }),
+    fat([this](unsigned page, uint8_t *buf) { return disk.read_range(FAT_START + page, 1, buf); }),
+    chains(fat)
 {
-    if (disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0) {
-        format();
+    // redo metadata updates that committed but never reached their home blocks
+    if (journal.open(JOURNAL_START) && journal.replay() < 0)
+        std::cout << "Error: journal replay failed\n";
+    if (mount() != 0) {
+        // an unformatted disk gets an empty FAT until format() is called
+        super = {};
+        set_geometry(disk.get_no_blocks(), false);
+        build_freemap();
     }
+    load_refcounts();
 }
 
-FS::~FS() { }
+// a clean unmount leaves an empty journal and saves the free map
+FS::~FS() {
+    if (journal.checkpoint() == 0)
+        save_summary();
+}
+
+thread_local Session *FS::attached = nullptr;
+
+// sync: commit the running journal group, then write back everything the
+// block cache is holding
+int FS::sync() {
+    OpTimer timer(OP_SYNC);
+    std::lock_guard<std::recursive_mutex> hold(meta_lock);
+    int rc = journal.flush();
+    if (rc == 0) unlogged_frees.clear();
+    release_deferred();
+    if (disk.sync() != 0) rc = -1;
+    return rc;
+}
+
+void FS::set_geometry(unsigned n, bool on_disk) {
+    nblocks = n;
+    fat_blocks = fat_size(n);
+    chains.clear();
+    if (on_disk) fat.open(n);
+    else fat.clear(n);
+}
+
+int FS::mount() {
+    const uint8_t *p = disk.view(SUPER_BLOCK);
+    if (!p) return -1;
+    superblock sb;
+    std::memcpy(&sb, p, sizeof(sb));
+    if (sb.magic != SUPER_MAGIC) {
+        // disks from before the superblock had a 16-bit FAT in this block
+        if (sb.magic != 0)
+            std::cout << "Error: unknown disk layout, the disk needs a format\n";
+        return -1;
+    }
+    if (sb.block_size != BLOCK_SIZE) {
+        std::cout << "Error: disk has " << sb.block_size << " byte blocks, this build uses "
+                  << BLOCK_SIZE << "\n";
+        return -1;
+    }
+    if (sb.nblocks > disk.get_no_blocks() || sb.nblocks > FAT_MAX_BLOCKS || sb.fat_start != FAT_START ||
+        sb.fat_blocks != fat_size(sb.nblocks) || sb.journal_start != JOURNAL_START ||
+        sb.refcount_block != REFCOUNT_BLOCK ||
+        (sb.bitmap_blocks && (sb.bitmap_start != FAT_START + sb.fat_blocks ||
+                              sb.bitmap_blocks != bitmap_size(sb.nblocks)))) {
+        std::cout << "Error: superblock is damaged\n";
+        return -1;
+    }
+    super = sb;
+    set_geometry(sb.nblocks, true);
+    if (load_summary() != 0)
+        build_freemap();
+    // from here on a crash leaves the bitmap behind the FAT
+    if (super.clean) {
+        super.clean = 0;
+        if (write_super() != 0) return -1;
+    }
+    return 0;
+}
+
+// the count in the superblock catches a bitmap that was only partly written
+int FS::load_summary() {
+    if (!super.clean || super.bitmap_blocks == 0) return -1;
+    std::vector<uint64_t> words((size_t)super.bitmap_blocks * BLOCK_SIZE / sizeof(uint64_t));
+    if (disk.read_range(super.bitmap_start, super.bitmap_blocks,
+                        reinterpret_cast<uint8_t*>(words.data())) != 0)
+        return -1;
+    freemap.assign(nblocks, words.data());
+    int first = freemap.first_free();
+    if (freemap.free_count() != super.free_blocks || (first >= 0 && (unsigned)first < data_start()))
+        return -1;
+    return 0;
+}
+
+// The bitmap is written ahead of the superblock that vouches for it. Freed
+// blocks still waiting on the journal are none after a checkpoint, so the
+// bitmap is exactly what build_freemap() would make of the FAT.
+int FS::save_summary() {
+    std::lock_guard<std::recursive_mutex> hold(meta_lock);
+    if (super.magic != SUPER_MAGIC || super.bitmap_blocks == 0) return 0;
+    release_deferred();
+    if (!deferred.empty()) return -1;
+    const std::vector<uint64_t> &words = freemap.words();
+    std::vector<uint8_t> buf((size_t)super.bitmap_blocks * BLOCK_SIZE, 0);
+    std::memcpy(buf.data(), words.data(), words.size() * sizeof(uint64_t));
+    std::vector<BlockWrite> ios;
+    for (unsigned i = 0; i < super.bitmap_blocks; ++i)
+        ios.push_back({super.bitmap_start + i, &buf[(size_t)i * BLOCK_SIZE]});
+    if (disk.writev(ios.data(), ios.size()) != 0) return -1;
+    super.free_blocks = freemap.free_count();
+    super.clean = 1;
+    return write_super();
+}
+
+// straight to the disk file, past the journal: only called while the
+// journal holds nothing
+int FS::write_super() {
+    uint8_t buf[BLOCK_SIZE] = {0};
+    std::memcpy(buf, &super, sizeof(super));
+    if (disk.write(SUPER_BLOCK, buf) != 0) return -1;
+    return disk.sync();
+}
 
 // Format the disk: initialize FAT and clear root directory
-int FS::format() {
-    // mark block 0 and 1 as EOF, others free
-    for (int i = 0; i < BLOCK_SIZE/2; ++i) {
-        fat[i] = (i == ROOT_BLOCK || i == FAT_BLOCK) ? FAT_EOF : FAT_FREE;
+int FS::format(unsigned n) {
+    OpTimer timer(OP_FORMAT);
+    DirGuard g(*this);
+    MetaOp op(*this);
+    g.lock_all();
+    if (n == 0) n = disk.get_no_blocks();
+    if (n > FAT_MAX_BLOCKS || n <= FAT_START + fat_size(n) + bitmap_size(n)) {
+        std::cout << "Error: cannot format a disk of " << n << " blocks\n";
+        return -1;
     }
-    // write FAT
+    txn.dirs.clear(); // whatever was staged is about to be wiped
+    deferred.clear();
+    unlogged_frees.clear();
+    dcache.clear();
+    dnames.clear();
+    if (n != disk.get_no_blocks() && disk.resize(n) != 0) return -1;
+    super = {SUPER_MAGIC, BLOCK_SIZE, n, FAT_START, fat_size(n),
+             JOURNAL_START, JOURNAL_BLOCKS, REFCOUNT_BLOCK,
+             FAT_START + fat_size(n), bitmap_size(n), 0, 0};
+    // everything in front of the first data block is marked EOF, the rest free
+    set_geometry(n, false);
+    for (unsigned i = 0; i < data_start(); ++i)
+        fat[i] = FAT_EOF;
+    build_freemap();
+    if (journal.create(JOURNAL_START, JOURNAL_BLOCKS) != 0) return -1;
     {
         uint8_t buf[BLOCK_SIZE] = {0};
-        std::memcpy(buf, fat, sizeof(fat));
-        if (disk.write(FAT_BLOCK, buf) != 0) return -1;
+        std::memcpy(buf, &super, sizeof(super));
+        if (write_meta(SUPER_BLOCK, buf) != 0) return -1;
     }
+    // empty reflink table
+    refcount.clear();
+    reflinks = true;
+    txn.refcounts = true;
     // clear root dir block
     {
         uint8_t buf[BLOCK_SIZE] = {0};
-        if (disk.write(ROOT_BLOCK, buf) != 0) return -1;
+        stage_dir(ROOT_BLOCK, buf);
     }
-    current_dir = ROOT_BLOCK;
+    session().cwd = ROOT_BLOCK;
     return 0;
 }
 
-// Helper: split pathname into directory block + final name
-int FS::resolve_path(const std::string &path,
-                     uint16_t &out_dir,
-                     std::string &out_name)
+// shared locks are taken before the old one is dropped, so the directory
+// being left cannot go away while its entry for the next one is read
+void FS::DirGuard::enter(uint32_t dir) {
+    unsigned s = dir % DIR_LOCKS;
+    if (n == 1 && held[0] == s) return;
+    fs.dir_locks[s].lock_shared();
+    release();
+    held[0] = s;
+    n = 1;
+}
+
+// std::lock backs off instead of waiting while holding a stripe, so a
+// reader moving from one of these stripes to the other cannot deadlock us
+void FS::DirGuard::lock(uint32_t a, uint32_t b) {
+    release();
+    exclusive = true;
+    held[0] = a % DIR_LOCKS;
+    held[1] = b % DIR_LOCKS;
+    if (held[0] == held[1]) {
+        fs.dir_locks[held[0]].lock();
+        n = 1;
+    } else {
+        std::lock(fs.dir_locks[held[0]], fs.dir_locks[held[1]]);
+        n = 2;
+    }
+}
+
+// every stripe, with the same back-off as std::lock
+void FS::DirGuard::lock_all() {
+    release();
+    for (unsigned first = 0;;) {
+        fs.dir_locks[first].lock();
+        unsigned i = 0;
+        while (i < DIR_LOCKS && (i == first || fs.dir_locks[i].try_lock())) ++i;
+        if (i == DIR_LOCKS) break;
+        for (unsigned k = 0; k < i; ++k) fs.dir_locks[k].unlock();
+        if (first > i) fs.dir_locks[first].unlock();
+        first = i;
+    }
+    all = true;
+}
+
+void FS::DirGuard::release() {
+    if (all) {
+        for (auto &m : fs.dir_locks) m.unlock();
+        all = false;
+    }
+    for (unsigned i = 0; i < n; ++i) {
+        if (exclusive) fs.dir_locks[held[i]].unlock();
+        else fs.dir_locks[held[i]].unlock_shared();
+    }
+    n = 0;
+    exclusive = false;
+}
+
+// Helper: block of sub-directory name in dir; a warm dentry cache skips
+// the directory blocks entirely
+int FS::lookup_dir(uint32_t dir, std::string_view name) {
+    DentryCache::Dentry d;
+    if (dcache.lookup(dir, name, d) && d.type == TYPE_DIR) return d.first_blk;
+    dir_entry e; DirLoc loc;
+    if (dir_find(dir, name, loc, &e) != 0 || e.type != TYPE_DIR) return -1;
+    return e.first_blk;
+}
+
+// Helper: split pathname into directory block + final name. The path is
+// walked in place, one '/'-separated view at a time; a single trailing '/'
+// is ignored, so "a/b/" names b.
+int FS::resolve_path(std::string_view path,
+                     uint32_t &out_dir,
+                     std::string_view &out_name,
+                     DirGuard *walk)
 {
-    std::vector<std::string> parts;
-    std::stringstream ss(path);
-    std::string tok;
-    while (std::getline(ss, tok, '/')) parts.push_back(tok);
+    // start at ROOT if leading '/', else at the working directory
+    uint32_t dir = session().cwd;
+    if (!path.empty() && path[0] == '/') {
+        dir = ROOT_BLOCK;
+        path.remove_prefix(1);
+    }
+    if (walk) walk->enter(dir);
+    if (!path.empty() && path.back() == '/') path.remove_suffix(1);
 
-    // start at ROOT if leading '/', else at current_dir
-    uint16_t dir = (!path.empty() && path[0]=='/') ? ROOT_BLOCK : current_dir;
-    size_t start = (!path.empty() && path[0]=='/') ? 1 : 0;
+    size_t last = path.rfind('/');
+    out_name = last == std::string_view::npos ? path : path.substr(last + 1);
+    std::string_view rest = last == std::string_view::npos ? std::string_view() : path.substr(0, last + 1);
 
-    for (size_t i = start; i + 1 < parts.size(); ++i) {
-        const auto &c = parts[i];
+    while (!rest.empty()) {
+        size_t slash = rest.find('/');
+        std::string_view c = rest.substr(0, slash);
+        rest.remove_prefix(slash + 1);
         if (c.empty() || c == ".") continue;
         if (c == "..") {
             dir = get_parent_directory(dir);
-            continue;
-        }
-        // find subdir c in dir
-        uint8_t buf[BLOCK_SIZE];
-        disk.read(dir, buf);
-        auto *ents = reinterpret_cast<dir_entry*>(buf);
-        bool found = false;
-        int slots = BLOCK_SIZE / sizeof(dir_entry);
-        for (int j = 0; j < slots; ++j) {
-            if (c == ents[j].file_name && ents[j].type == TYPE_DIR) {
-                dir = ents[j].first_blk;
-                found = true;
-                break;
-            }
+        } else {
+            int sub = lookup_dir(dir, c);
+            if (sub < 0) return -1;
+            dir = sub;
         }
-        if (!found) return -1;
+        if (walk) walk->enter(dir);
     }
 
-    out_dir  = dir;
-    out_name = parts.empty() ? "" : parts.back();
+    out_dir = dir;
     return 0;
 }
 
-// Helper: write data across FAT‐chained blocks; return first block index
-int FS::write_to_file(const std::string & /*unused*/,
-                      const uint8_t *data,
-                      size_t size)
+// Helper: write data across FAT‐chained blocks; return first block index.
+// The whole chain is reserved up front so it ends up in as few contiguous
+// extents as the free space allows.
+int FS::write_to_file(const uint8_t *data, size_t size)
 {
-    int first = -1;
-    for (int i = 2; i < BLOCK_SIZE/2; ++i) {
-        if (fat[i] == FAT_FREE) { first = i; break; }
-    }
+    size_t nblocks = size ? (size + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+    int first = alloc_chain(nblocks);
     if (first < 0) return -1;
 
-    int prev = first;
-    size_t written = 0;
-    uint8_t buf[BLOCK_SIZE];
-
-    while (written < size) {
-        size_t chunk = std::min<size_t>(BLOCK_SIZE, size - written);
-        std::memset(buf, 0, BLOCK_SIZE);
-        std::memcpy(buf, data + written, chunk);
-        disk.write(prev, buf);
-        written += chunk;
-
-        if (written < size) {
-            int nxt = -1;
-            for (int i = 2; i < BLOCK_SIZE/2; ++i) {
-                if (fat[i] == FAT_FREE) { nxt = i; break; }
-            }
-            if (nxt < 0) return -1;
-            fat[prev] = nxt;
-            prev = nxt;
-        } else {
-            fat[prev] = FAT_EOF;
+    // walk the new chain first, then write it as one batch; full blocks
+    // go straight from data, only a partial last block needs padding
+    std::vector<BlockWrite> ios;
+    ios.reserve(nblocks);
+    uint8_t tail[BLOCK_SIZE];
+    int32_t blk = first;
+    for (size_t off = 0; off < size; off += BLOCK_SIZE) {
+        const uint8_t *src = data + off;
+        if (size - off < BLOCK_SIZE) {
+            std::memset(tail, 0, BLOCK_SIZE);
+            std::memcpy(tail, src, size - off);
+            src = tail;
         }
+        ios.push_back({(unsigned)blk, src});
+        blk = fat[blk];
     }
-
-    // persist FAT
-    {
-        uint8_t fbuf[BLOCK_SIZE] = {0};
-        std::memcpy(fbuf, fat, sizeof(fat));
-        disk.write(FAT_BLOCK, fbuf);
+    if (disk.writev(ios.data(), ios.size()) != 0) {
+        free_chain(first);
+        return -1;
     }
+
     return first;
 }
 
 // create: make or overwrite file from stdin until blank line
-int FS::create(std::string filepath) {
-    uint16_t dirblk;
-    std::string name;
+int FS::create(std::string_view filepath) {
+    OpTimer timer(OP_CREATE);
+    DirGuard g(*this);
+    MetaOp op(*this);
+    uint32_t dirblk;
+    std::string_view name;
     if (resolve_path(filepath, dirblk, name) != 0 || name.empty())
         return -1;
 
@@ -136,78 +335,57 @@ int FS::create(std::string filepath) {
         return -1;
     }
 
-    // load directory
-    uint8_t dirbuf[BLOCK_SIZE];
-    disk.read(dirblk, dirbuf);
-    auto *ents = reinterpret_cast<dir_entry*>(dirbuf);
-    int slots = BLOCK_SIZE / sizeof(dir_entry);
-
-    // check duplicate & fullness
-    int used = 0;
-    for (int i = 0; i < slots; ++i) {
-        if (ents[i].file_name[0]) {
-            ++used;
-            if (name == ents[i].file_name) return -1;
-        }
-    }
-    if (used >= slots) return -1;
+    // check duplicate
+    DirLoc loc;
+    if (dir_find(dirblk, name, loc) == 0) return -1;
 
     // read data
     std::string data, line;
     while (std::getline(std::cin, line) && !line.empty())
         data += line + "\n";
 
-    // write blocks
-    int first = write_to_file(name,
-        reinterpret_cast<const uint8_t*>(data.data()),
-        data.size());
-    if (first < 0) return -1;
+    // write blocks, unless the data fits in the directory
+    auto *bytes = reinterpret_cast<const uint8_t*>(data.data());
+    bool small = data.size() <= INLINE_MAX;
+    int first = small ? FAT_EOF : write_to_file(bytes, data.size());
+    if (!small && first < 0) return -1;
 
     // new entry
     dir_entry nde = {};
-    std::strncpy(nde.file_name, name.c_str(), MAX_NAME_LEN);
-    nde.file_name[MAX_NAME_LEN] = '\0';
+    set_entry_name(nde, name);
     nde.size          = data.size();
     nde.first_blk     = first;
     nde.type          = TYPE_FILE;
     nde.access_rights = READ | WRITE;
+    nde.flags         = small ? ENTRY_INLINE : 0;
 
     // insert
-    for (int i = 0; i < slots; ++i) {
-        if (!ents[i].file_name[0]) {
-            ents[i] = nde;
-            break;
-        }
+    g.lock(dirblk);
+    if (dir_add(dirblk, nde, nullptr, bytes) != 0) {
+        free_chain(first);
+        return -1;
     }
-    disk.write(dirblk, dirbuf);
     return 0;
 }
 
 // cat: print file contents
-int FS::cat(std::string filepath) {
-    uint16_t dirblk;
-    std::string name;
-    if (resolve_path(filepath, dirblk, name) != 0 || name.empty()) {
+int FS::cat_file(std::string_view filepath, bool async, OutputSink &out) {
+    OpTimer timer(OP_CAT);
+    DirGuard g(*this);
+    uint32_t dirblk;
+    std::string_view name;
+    if (resolve_path(filepath, dirblk, name, &g) != 0 || name.empty()) {
         std::cout << "Error: File not found: " << filepath << std::endl;
         return -1;
     }
 
-    uint8_t dirbuf[BLOCK_SIZE];
-    disk.read(dirblk, dirbuf);
-    auto *ents = reinterpret_cast<dir_entry*>(dirbuf);
-    int slots = BLOCK_SIZE / sizeof(dir_entry);
-
-    dir_entry *fe = nullptr;
-    for (int i = 0; i < slots; ++i) {
-        if (name == ents[i].file_name) {
-            fe = &ents[i];
-            break;
-        }
-    }
-    if (!fe) {
+    dir_entry ent;
+    DirLoc loc;
+    if (dir_find(dirblk, name, loc, &ent) != 0) {
         std::cout << "Error: File not found: " << filepath << std::endl;
         return -1;
     }
+    const dir_entry *fe = &ent;
     if (fe->type != TYPE_FILE) {
         std::cout << "Error: " << filepath << " is a directory" << std::endl;
         return -1;
@@ -217,91 +395,145 @@ int FS::cat(std::string filepath) {
         return -1;
     }
 
+    // an inline file is in the directory block the lookup just read
+    if (is_inline(*fe)) {
+        uint8_t data[INLINE_MAX];
+        if (dir_inline(loc, *fe, data) != 0 || out.write(data, fe->size) != 0) return -1;
+        return out.flush();
+    }
+    if (is_compressed(*fe)) {
+        if (unpack_range(fe->first_blk, fe->size, 0, fe->size,
+                         [&out](const uint8_t *p, size_t n) { return out.write(p, n); }) != 0)
+            return -1;
+        return out.flush();
+    }
     size_t rem = fe->size;
-    int blk = fe->first_blk;
-    uint8_t buf[BLOCK_SIZE];
+    int32_t blk = fe->first_blk;
+    if (async && blocks_for(rem) > 1) {
+        AioQueue q(disk);
+        if (stream_chain(blk, rem, q, [&out](const uint8_t *p, size_t n) { out.write(p, n); }) != 0)
+            return -1;
+        return out.flush();
+    }
+    if (disk.mapped()) {
+        // the blocks are in the mapping already: hand the sink pointers to
+        // them, one piece per run of adjacent blocks
+        iovec iov[IO_BATCH];
+        size_t n = 0;
+        static const BlockBuf zeros = {};
+        while (blk != FAT_EOF && rem > 0) {
+            const uint8_t *p = fat.unwritten(blk) ? zeros.data() : disk.view(blk);
+            if (!p) return -1;
+            size_t k = std::min<size_t>(BLOCK_SIZE, rem);
+            if (n > 0 && static_cast<uint8_t*>(iov[n-1].iov_base) + iov[n-1].iov_len == p) {
+                iov[n-1].iov_len += k;
+            } else {
+                if (n == IO_BATCH) {
+                    if (out.writev(iov, n) != 0) return -1;
+                    n = 0;
+                }
+                iov[n++] = {const_cast<uint8_t*>(p), k};
+            }
+            rem -= k;
+            blk = fat[blk];
+        }
+        if (out.writev(iov, n) != 0) return -1;
+        return out.flush();
+    }
+    // a file of one block is read onto the stack; larger ones in batches
+    uint8_t small[BLOCK_SIZE];
+    std::vector<uint8_t> big;
+    size_t batch = std::min<size_t>(IO_BATCH, blocks_for(rem));
+    uint8_t *buf = small;
+    if (batch > 1) {
+        big.resize(batch * BLOCK_SIZE);
+        buf = big.data();
+    }
     while (blk != FAT_EOF && rem > 0) {
-        disk.read(blk, buf);
-        size_t to_write = std::min<size_t>(BLOCK_SIZE, rem);
-        std::cout.write(reinterpret_cast<char*>(buf), to_write);
+        int n = read_chain(blk, std::min<size_t>(batch, blocks_for(rem)), buf);
+        if (n < 0) return -1;
+        size_t to_write = std::min<size_t>((size_t)n * BLOCK_SIZE, rem);
+        if (out.write(buf, to_write) != 0) return -1;
         rem -= to_write;
-        blk = fat[blk];
     }
-    return 0;
+    return out.flush();
 }
 
-// ls: list current_dir, sorted, with name, type, size
-int FS::ls() {
-    uint8_t buf[BLOCK_SIZE];
-    disk.read(current_dir, buf);
-    auto *ents = reinterpret_cast<dir_entry*>(buf);
-    int slots = BLOCK_SIZE / sizeof(dir_entry);
-
-    struct Entry { std::string name; bool is_dir; uint32_t size; uint8_t rights; };
-    std::vector<Entry> all;
-    for (int i = 0; i < slots; ++i) {
-        if (ents[i].file_name[0] == 0) continue;
-        all.push_back({
-            ents[i].file_name,
-            ents[i].type == TYPE_DIR,
-            ents[i].size,
-            ents[i].access_rights
-        });
-    }
-    std::sort(all.begin(), all.end(),
-              [](auto &a, auto &b){ return a.name < b.name; });
-
-    // new header with accessrights
-    std::cout << "name\t type\t accessrights\t size\n";
-    for (auto &e : all) {
-        // build "rwx" string
-        std::string rights;
-        rights += (e.rights & READ)    ? 'r' : '-';
-        rights += (e.rights & WRITE)   ? 'w' : '-';
-        rights += (e.rights & EXECUTE) ? 'x' : '-';
-
-        std::cout
-          << e.name << "\t"
-          << (e.is_dir ? "dir" : "file") << "\t"
-          << rights << "\t"
-          << (e.is_dir ? "-" : std::to_string(e.size))
-          << "\n";
+// ls: list the working directory, sorted, with name, type, size
+int FS::ls(OutputSink &out) {
+    OpTimer timer(OP_LS);
+    DirGuard g(*this);
+    uint32_t cwd = session().cwd;
+    g.enter(cwd);
+    // a single-block directory is sorted on the stack
+    dir_entry small[DIR_SLOTS];
+    std::vector<dir_entry> big;
+    dir_entry *all = small;
+    size_t n = 0;
+    DirIter it = dir_begin(cwd);
+    dir_entry e;
+    int rc;
+    while ((rc = dir_next(it, e)) > 0) {
+        if (n == DIR_SLOTS && all == small)
+            big.assign(small, small + n);
+        if (n < DIR_SLOTS) small[n] = e;
+        else big.push_back(e);
+        ++n;
     }
-    return 0;
+    if (rc < 0) return -1;
+    if (!big.empty()) all = big.data();
+    std::sort(all, all + n,
+              [](auto &a, auto &b){ return entry_name(a) < entry_name(b); });
+
+    // new header with accessrights; rows are formatted in the sink's buffer
+    out.write("name\t type\t accessrights\t size\n");
+    for (size_t i = 0; i < n; ++i) {
+        const dir_entry &e = all[i];
+        bool is_dir = e.type == TYPE_DIR;
+        char *row = out.reserve(LS_ROW_MAX);
+        if (!row) return -1;
+        std::string_view name = entry_name(e);
+        char *p = std::copy(name.begin(), name.end(), row);
+        *p++ = '\t';
+        p = is_dir ? std::copy_n("dir", 3, p) : std::copy_n("file", 4, p);
+        *p++ = '\t';
+        *p++ = (e.access_rights & READ)    ? 'r' : '-';
+        *p++ = (e.access_rights & WRITE)   ? 'w' : '-';
+        *p++ = (e.access_rights & EXECUTE) ? 'x' : '-';
+        *p++ = '\t';
+        if (is_dir) *p++ = '-';
+        else p = std::to_chars(p, row + LS_ROW_MAX, e.size).ptr;
+        *p++ = '\n';
+        out.commit(p - row);
+    }
+    return out.flush();
 }
 
-// cp: copy file or into directory
-int FS::cp(std::string sourcepath, std::string destpath) {
+// cp: copy file or into directory. With reflink the copy shares the
+// source's blocks until either file is appended to. A compressed file's
+// chain is copied as it is, so the copy stays compressed.
+int FS::cp_file(std::string_view sourcepath, std::string_view destpath, bool reflink, bool async) {
+    OpTimer timer(OP_CP);
+    DirGuard g(*this);
+    MetaOp op(*this);
     // resolve source
-    uint16_t sdir; std::string sname;
+    uint32_t sdir; std::string_view sname;
     if (resolve_path(sourcepath, sdir, sname)!=0 || sname.empty())
         return -1;
-    uint8_t sb[BLOCK_SIZE]; disk.read(sdir,sb);
-    auto *sents = reinterpret_cast<dir_entry*>(sb);
-    int slots = BLOCK_SIZE/sizeof(dir_entry);
-    dir_entry *src = nullptr;
-    for (int i = 0; i < slots; ++i)
-        if (sname==sents[i].file_name && sents[i].type==TYPE_FILE)
-            src=&sents[i];
-    if (!src) return -1;
+    dir_entry src; DirLoc sloc;
+    if (dir_find(sdir, sname, sloc, &src) != 0 || src.type != TYPE_FILE) return -1;
 
     // resolve dest
-    uint16_t ddir; std::string dname;
-    bool into_dir=false;
+    uint32_t ddir; std::string_view dname;
     if (resolve_path(destpath, ddir, dname)==0 && !dname.empty()) {
-        uint8_t db[BLOCK_SIZE]; disk.read(ddir,db);
-        auto *dents = reinterpret_cast<dir_entry*>(db);
-        for (int i=0;i<slots;++i){
-            if (dname==dents[i].file_name && dents[i].type==TYPE_DIR){
-                into_dir=true;
-                ddir = dents[i].first_blk;
-                dname = sname;
-                break;
-            }
-            if (dname==dents[i].file_name) return -1;
+        dir_entry de; DirLoc dloc;
+        if (dir_find(ddir, dname, dloc, &de) == 0) {
+            if (de.type != TYPE_DIR) return -1;
+            ddir = de.first_blk;
+            dname = sname;
         }
     } else {
-        ddir = current_dir;
+        ddir = session().cwd;
         dname = destpath;
     }
 
@@ -310,67 +542,70 @@ int FS::cp(std::string sourcepath, std::string destpath) {
         return -1;
     }
 
-    // read src data
-    std::vector<uint8_t> data;
-    {
-        size_t rem = src->size;
-        int16_t b = src->first_blk;
-        uint8_t buf[BLOCK_SIZE];
-        while(b!=FAT_EOF && rem>0){
-            disk.read(b,buf);
-            size_t c = std::min<size_t>(BLOCK_SIZE, rem);
-            data.insert(data.end(), buf, buf+c);
-            rem -= c; b = fat[b];
+    // an inline file is copied as one, reflink or not
+    uint8_t data[INLINE_MAX];
+    bool small = is_inline(src);
+    if (small && dir_inline(sloc, src, data) != 0) return -1;
+    int first = FAT_EOF;
+    bool shared = !small && reflink && add_ref(src.first_blk) == 0;
+    if (shared) {
+        first = src.first_blk;
+    } else if (!small) {
+        // stream the data across in IO_BATCH-sized pieces
+        size_t len = chain_bytes(src);
+        first = alloc_chain(std::max<size_t>(1, blocks_for(len)));
+        if (first<0) return -1;
+        int rc;
+        if (async) {
+            AioQueue q(disk);
+            rc = copy_chain_async(src.first_blk, len, first, q);
+        } else {
+            rc = copy_chain(src.first_blk, len, first, 0);
+        }
+        if (rc != 0) {
+            free_chain(first);
+            return -1;
         }
     }
 
-    int first = write_to_file(dname, data.data(), data.size());
-    if (first<0) return -1;
-
     // insert into ddir
-    uint8_t dbuf[BLOCK_SIZE]; disk.read(ddir,dbuf);
-    auto *dents = reinterpret_cast<dir_entry*>(dbuf);
     dir_entry nde={};
-    std::strncpy(nde.file_name, dname.c_str(), MAX_NAME_LEN);
-    nde.file_name[MAX_NAME_LEN] = '\0';
-    nde.type=TYPE_FILE; nde.first_blk=first; nde.size=src->size;
-    nde.access_rights=src->access_rights;
-    for(int i=0;i<slots;++i){
-        if(!dents[i].file_name[0]){ dents[i]=nde; break; }
-    }
-    disk.write(ddir, dbuf);
+    set_entry_name(nde, dname);
+    nde.type=TYPE_FILE; nde.first_blk=first; nde.size=src.size;
+    nde.access_rights=src.access_rights; nde.flags=src.flags; nde.zblocks=src.zblocks;
+    g.lock(ddir);
+    DirLoc taken;
+    if (dir_find(ddir, dname, taken) == 0 || dir_add(ddir, nde, nullptr, data) != 0) {
+        if (shared) release_ref(first);
+        else free_chain(first);
+        return -1;
+    }
     std::cout<<"File copied successfully\n";
     return 0;
 }
 
 // mv: rename or move into directory
-int FS::mv(std::string sourcepath, std::string destpath) {
+int FS::mv(std::string_view sourcepath, std::string_view destpath) {
+    OpTimer timer(OP_MV);
+    DirGuard g(*this);
+    MetaOp op(*this);
     // resolve src
-    uint16_t sdir; std::string sname;
+    uint32_t sdir; std::string_view sname;
     if (resolve_path(sourcepath, sdir, sname)!=0 || sname.empty())
         return -1;
-    uint8_t sb[BLOCK_SIZE]; disk.read(sdir,sb);
-    auto *sents = reinterpret_cast<dir_entry*>(sb);
-    int slots = BLOCK_SIZE/sizeof(dir_entry);
-    int idx=-1;
-    for(int i=0;i<slots;++i)
-        if(sname==sents[i].file_name){ idx=i; break; }
-    if(idx<0) return -1;
+    dir_entry ent; DirLoc sloc;
+    if (dir_find(sdir, sname, sloc, &ent) != 0) return -1;
 
     // resolve dest
-    uint16_t ddir; std::string dname;
+    uint32_t ddir; std::string_view dname;
     bool into_dir=false;
     if(resolve_path(destpath,ddir,dname)==0 && !dname.empty()){
-        uint8_t db[BLOCK_SIZE]; disk.read(ddir,db);
-        auto *dents = reinterpret_cast<dir_entry*>(db);
-        for(int i=0;i<slots;++i){
-            if(dname==dents[i].file_name && dents[i].type==TYPE_DIR){
-                into_dir=true;
-                ddir = dents[i].first_blk;
-                dname = sname;
-                break;
-            }
-            if(dname==dents[i].file_name) return -1;
+        dir_entry de; DirLoc dloc;
+        if (dir_find(ddir, dname, dloc, &de) == 0) {
+            if (de.type != TYPE_DIR) return -1;
+            into_dir=true;
+            ddir = de.first_blk;
+            dname = sname;
         }
     } else {
         ddir = sdir;
@@ -383,68 +618,58 @@ int FS::mv(std::string sourcepath, std::string destpath) {
     }
 
 
-    if(into_dir) {
-        // remove from sdir, insert into ddir
-        dir_entry temp = sents[idx];
-        std::memset(&sents[idx],0,sizeof(dir_entry));
-        disk.write(sdir,sb);
-
-        uint8_t db[BLOCK_SIZE]; disk.read(ddir,db);
-        auto *dents = reinterpret_cast<dir_entry*>(db);
-        for(int i=0;i<slots;++i){
-            if(!dents[i].file_name[0]){ dents[i]=temp; break; }
-        }
-        disk.write(ddir,db);
-    } else {
+    g.lock(sdir, ddir);
+    // dir_add does not reject a name that is already taken
+    DirLoc dloc;
+    if (dir_find(ddir, dname, dloc) == 0) return -1;
+    if(ddir == sdir && !dir_index(sdir)) {
         // rename in place
-        std::strncpy(sents[idx].file_name, dname.c_str(), MAX_NAME_LEN);
-        sents[idx].file_name[MAX_NAME_LEN] = '\0';
-
-        disk.write(sdir,sb);
+        set_entry_name(ent, dname);
+        if (dir_update(sdir, sloc, ent) != 0) return -1;
+    } else {
+        // insert under the new name or directory first, so a failure leaves
+        // the source where it was; the insert may have moved the source
+        // entry to another leaf, so it is looked up again
+        uint8_t data[INLINE_MAX];
+        if (is_inline(ent) && dir_inline(sloc, ent, data) != 0) return -1;
+        if (!into_dir) set_entry_name(ent, dname);
+        if (dir_add(ddir, ent, nullptr, data) != 0) return -1;
+        if (dir_find(sdir, sname, sloc) != 0 || dir_remove(sdir, sloc) != 0) return -1;
     }
     std::cout<<"File renamed successfully\n";
     return 0;
 }
 
 // rm: delete file or empty directory
-int FS::rm(std::string filepath) {
-    uint16_t dirblk; std::string name;
+int FS::rm(std::string_view filepath) {
+    OpTimer timer(OP_RM);
+    DirGuard g(*this);
+    MetaOp op(*this);
+    uint32_t dirblk; std::string_view name;
     if(resolve_path(filepath,dirblk,name)!=0 || name.empty()) return -1;
-    uint8_t dbuf[BLOCK_SIZE]; disk.read(dirblk,dbuf);
-    auto *ents = reinterpret_cast<dir_entry*>(dbuf);
-    int slots= BLOCK_SIZE/sizeof(dir_entry);
-    for(int i=0;i<slots;++i){
-        if(name==ents[i].file_name){
-            if(ents[i].type==TYPE_DIR){
-                // check empty
-                uint8_t b2[BLOCK_SIZE]; disk.read(ents[i].first_blk,b2);
-                auto *sub = reinterpret_cast<dir_entry*>(b2);
-                for(int j=2;j<slots;++j) if(sub[j].file_name[0]) return -1;
-            }
-            // free FAT chain
-            int16_t blk=ents[i].first_blk;
-            while(blk!=FAT_EOF){
-                int16_t next=fat[blk];
-                fat[blk]=FAT_FREE;
-                blk=next;
-            }
-            std::memset(&ents[i],0,sizeof(dir_entry));
-            // write FAT
-            uint8_t fbuf[BLOCK_SIZE]={0};
-            std::memcpy(fbuf, fat, sizeof(fat));
-            disk.write(FAT_BLOCK, fbuf);
-            // write dir
-            disk.write(dirblk, dbuf);
-            return 0;
-        }
+    dir_entry ent; DirLoc loc;
+    if(dir_find(dirblk, name, loc, &ent) != 0) return -1;
+    // a directory being removed may have readers inside it
+    g.lock(dirblk, ent.type == TYPE_DIR ? ent.first_blk : dirblk);
+    if(ent.type==TYPE_DIR){
+        // check empty
+        if(!dir_empty(ent.first_blk)) return -1;
+        dcache.invalidate_dir(ent.first_blk);
     }
-    return -1;
+    // free FAT chain unless another reflinked file still uses it
+    if(release_ref(ent.first_blk))
+        free_chain(ent.first_blk);
+    // write dir
+    return dir_remove(dirblk, loc);
 }
 
 // append: append file1 to file2
-int FS::append(std::string f1, std::string f2) {
+int FS::append(std::string_view f1, std::string_view f2) {
+    OpTimer timer(OP_APPEND);
+    DirGuard g(*this);
+    MetaOp op(*this);
     // resolve both files
-    uint16_t d1, d2; std::string n1, n2;
+    uint32_t d1, d2; std::string_view n1, n2;
     if (resolve_path(f1, d1, n1) != 0 || n1.empty()) {
         std::cout << "Error: File not found: " << f1 << std::endl;
         return -1;
@@ -454,18 +679,10 @@ int FS::append(std::string f1, std::string f2) {
         return -1;
     }
 
-    uint8_t b1[BLOCK_SIZE], b2[BLOCK_SIZE];
-    disk.read(d1, b1);
-    disk.read(d2, b2);
-    auto *e1 = reinterpret_cast<dir_entry*>(b1);
-    auto *e2 = reinterpret_cast<dir_entry*>(b2);
-    int slots = BLOCK_SIZE / sizeof(dir_entry);
-
-    dir_entry *ent1 = nullptr, *ent2 = nullptr;
-    for (int i = 0; i < slots; ++i) {
-        if (n1 == e1[i].file_name) ent1 = &e1[i];
-        if (n2 == e2[i].file_name) ent2 = &e2[i];
-    }
+    dir_entry e1, e2;
+    DirLoc l1, l2;
+    dir_entry *ent1 = dir_find(d1, n1, l1, &e1) == 0 ? &e1 : nullptr;
+    dir_entry *ent2 = dir_find(d2, n2, l2, &e2) == 0 ? &e2 : nullptr;
     if (!ent1) {
         std::cout << "Error: File not found: " << f1 << std::endl;
         return -1;
@@ -483,75 +700,78 @@ int FS::append(std::string f1, std::string f2) {
         return -1;
     }
 
-    // Read entire content of f1
-    std::vector<uint8_t> data;
-    uint16_t blk = ent1->first_blk;
-    int remaining = ent1->size;
-    while (blk != FAT_EOF && remaining > 0) {
-        uint8_t temp[BLOCK_SIZE];
-        disk.read(blk, temp);
-        int to_copy = std::min(remaining, BLOCK_SIZE);
-        data.insert(data.end(), temp, temp + to_copy);
-        remaining -= to_copy;
-        blk = fat[blk];
+    g.lock(d2);
+    // f2 is about to change, so it can no longer share blocks with a reflink;
+    // if that gave it a new chain, the entry must be saved even on failure
+    uint32_t old_first = ent2->first_blk;
+    if (unshare(*ent2, l2) != 0) return -1;
+    if (d1 == d2 && n1 == n2) e1 = e2; // appended to itself: read the new chain
+    auto fail = [&]() {
+        if (ent2->first_blk != old_first) dir_update(d2, l2, *ent2);
+        return -1;
+    };
+
+    // last block of f2, from the chain index; the loop only runs if the
+    // chain holds more blocks than the size needs
+    int32_t last_blk = chains.find(ent2->first_blk, std::max<size_t>(1, blocks_for(ent2->size)) - 1);
+    if (last_blk == FAT_EOF) last_blk = ent2->first_blk;
+    while (fat[last_blk] != FAT_EOF) {
+        last_blk = fat[last_blk];
     }
 
-    // Now write this data to the end of f2
-    uint16_t last_blk = ent2->first_blk;
-    if (last_blk == FAT_EOF) {
-        // Empty file, allocate first block
-        last_blk = find_free_block();
-        if (last_blk == -1) return -1;
-        ent2->first_blk = last_blk;
-        fat[last_blk] = FAT_EOF;
-    } else {
-        // Traverse to last block
-        while (fat[last_blk] != FAT_EOF) {
-            last_blk = fat[last_blk];
-        }
+    // Determine where to start writing: the free tail of the last block,
+    // then new blocks reserved up front for everything that does not fit
+    size_t len = ent1->size;
+    size_t used = ent2->size % BLOCK_SIZE;
+    if (used == 0 && ent2->size > 0) used = BLOCK_SIZE;
+    size_t room = BLOCK_SIZE - used;
+    if (len > room) {
+        int ext = alloc_chain(blocks_for(len - room));
+        if (ext < 0) return fail();
+        fat[last_blk] = ext;
     }
 
-    // Determine where to start writing
-    int f2_offset = ent2->size % BLOCK_SIZE;
-    int f2_written = 0;
-    blk = last_blk;
-    uint8_t temp[BLOCK_SIZE];
-    if (f2_offset != 0) {
-        disk.read(blk, temp);
-    } else {
-        std::fill(temp, temp + BLOCK_SIZE, 0);
-    }
-
-    for (size_t i = 0; i < data.size(); ++i) {
-        temp[f2_offset++] = data[i];
-        ent2->size++;
-        f2_written++;
-
-        if (f2_offset == BLOCK_SIZE) {
-            disk.write(blk, temp);
-            // Allocate next block
-            uint16_t new_blk = find_free_block();
-            if (new_blk == -1) return -1;
-            fat[blk] = new_blk;
-            fat[new_blk] = FAT_EOF;
-            blk = new_blk;
-            f2_offset = 0;
-            std::fill(temp, temp + BLOCK_SIZE, 0);
+    // stream f1 onto the end of f2; an inline f1 fits in the tail of f2's
+    // last block and the one after it, a compressed one is decoded a group
+    // at a time and put there the same way
+    int32_t dst = used == BLOCK_SIZE ? fat[last_blk] : last_blk;
+    size_t at = used % BLOCK_SIZE;
+    auto put = [&](const uint8_t *data, size_t n) {
+        for (size_t off = 0; off < n; ) {
+            BlockBuf b = {};
+            size_t k = std::min(n - off, BLOCK_SIZE - at);
+            if (at > 0 && read_block(dst, b.data()) != 0) return -1;
+            std::memcpy(b.data() + at, data + off, k);
+            if (disk.write(dst, b.data()) != 0) return -1;
+            fat.set_unwritten(dst, false);
+            off += k;
+            at = (at + k) % BLOCK_SIZE;
+            if (at == 0) dst = fat[dst];
         }
+        return 0;
+    };
+    if (is_inline(*ent1)) {
+        uint8_t data[INLINE_MAX];
+        if (dir_inline(l1, *ent1, data) != 0 || put(data, len) != 0) return fail();
+    } else if (is_compressed(*ent1)) {
+        if (unpack_range(ent1->first_blk, len, 0, len, put) != 0) return fail();
+    } else if (len > 0) {
+        if (copy_chain(ent1->first_blk, len, dst, used % BLOCK_SIZE) != 0) return fail();
+        // the tail of f2 may have been reserved; the blocks after it are new
+        fat.set_unwritten(dst, false);
     }
-
-    // Write last block
-    disk.write(blk, temp);
+    ent2->size += len;
 
     // Update directory entry and write it back
-    disk.write(d2, b2);
-
-    return 0;
+    return dir_update(d2, l2, *ent2);
 }
 
 // mkdir: make single directory
-int FS::mkdir(std::string dirpath) {
-    uint16_t parent; std::string name;
+int FS::mkdir(std::string_view dirpath) {
+    OpTimer timer(OP_MKDIR);
+    DirGuard g(*this);
+    MetaOp op(*this);
+    uint32_t parent; std::string_view name;
     if(resolve_path(dirpath,parent,name)!=0||name.empty()) return -1;
     
     if (name.length() > MAX_NAME_LEN) {
@@ -560,15 +780,20 @@ int FS::mkdir(std::string dirpath) {
     }
 
 
-    uint8_t buf[BLOCK_SIZE]; disk.read(parent,buf);
-    auto *ents = reinterpret_cast<dir_entry*>(buf);
-    int slots=BLOCK_SIZE/sizeof(dir_entry);
-    for(int i=0;i<slots;++i) if(name==ents[i].file_name) return -1;
+    DirLoc loc;
+    if(dir_find(parent, name, loc) == 0) return -1;
+
+    g.lock(parent);
+    return dir_create(parent, name) < 0 ? -1 : 0;
+}
 
+// new sub-directory name of parent, which the caller has locked; its
+// block or -1
+int FS::dir_create(uint32_t parent, std::string_view name) {
     // allocate block
-    int16_t nb=-1;
-    for(int i=2;i<BLOCK_SIZE/2;++i) if(fat[i]==FAT_FREE){ nb=i; fat[i]=FAT_EOF; break; }
+    int32_t nb=alloc_block();
     if(nb<0) return -1;
+    fat[nb]=FAT_EOF;
 
     // init new dir
     dir_entry dot={}, dotdot={};
@@ -578,51 +803,58 @@ int FS::mkdir(std::string dirpath) {
         uint8_t b2[BLOCK_SIZE]={0};
         auto *dents = reinterpret_cast<dir_entry*>(b2);
         dents[0]=dot; dents[1]=dotdot;
-        disk.write(nb,b2);
+        stage_dir(nb,b2);
     }
     // add to parent
-    for(int i=0;i<slots;++i){
-        if(!ents[i].file_name[0]){
-            std::strncpy(ents[i].file_name, name.c_str(), MAX_NAME_LEN);
-            ents[i].file_name[MAX_NAME_LEN] = '\0';
-            ents[i].first_blk=nb; ents[i].type=TYPE_DIR; ents[i].size=0; ents[i].access_rights=READ|WRITE|EXECUTE;
-            break;
-        }
+    dir_entry nde={};
+    set_entry_name(nde, name);
+    nde.first_blk=nb; nde.type=TYPE_DIR; nde.size=0; nde.access_rights=READ|WRITE|EXECUTE;
+    if(dir_add(parent, nde) != 0){
+        free_chain(nb);
+        return -1;
     }
-    disk.write(parent,buf);
-    return 0;
+    return nb;
 }
 
 // cd: change directory
-int FS::cd(std::string dirpath) {
-    if(dirpath==".") return 0;
-    if(dirpath==".."){
-        current_dir = get_parent_directory(current_dir);
-        return 0;
+int FS::cd(std::string_view dirpath) {
+    OpTimer timer(OP_CD);
+    DirGuard g(*this);
+    uint32_t parent; std::string_view name;
+    if(resolve_path(dirpath,parent,name,&g)!=0) return -1;
+    // the last component has to be a directory as well
+    if(name.empty() || name=="."){
+        session().cwd = parent;
+    } else if(name==".."){
+        session().cwd = get_parent_directory(parent);
+    } else {
+        int sub = lookup_dir(parent, name);
+        if(sub<0) return -1;
+        session().cwd = sub;
     }
-    uint16_t parent; std::string name;
-    // trick: append "/." so last resolves as dir
-    std::string p = (dirpath.back()=='/'?dirpath:dirpath+"/.") ;
-    if(resolve_path(p,parent,name)!=0) return -1;
-    current_dir = parent;
     return 0;
 }
 
 // pwd: print path
 int FS::pwd() {
+    OpTimer timer(OP_PWD);
     std::vector<std::string> parts;
-    uint16_t dir = current_dir;
+    DirGuard g(*this);
+    uint32_t dir = session().cwd;
+    g.enter(dir);
     while(dir != ROOT_BLOCK) {
-        uint16_t par = get_parent_directory(dir);
-        uint8_t buf[BLOCK_SIZE]; disk.read(par,buf);
-        auto *ents = reinterpret_cast<dir_entry*>(buf);
-        int slots=BLOCK_SIZE/sizeof(dir_entry);
-        for(int i=0;i<slots;++i){
-            if(ents[i].first_blk==dir && std::string(ents[i].file_name)!="." && std::string(ents[i].file_name)!=".."){
-                parts.push_back(ents[i].file_name);
+        uint32_t par = get_parent_directory(dir);
+        g.enter(par);
+        DirIter it = dir_begin(par);
+        dir_entry e;
+        int rc;
+        while((rc = dir_next(it, e)) > 0){
+            if(e.first_blk==dir && entry_name(e)!="." && entry_name(e)!=".."){
+                parts.emplace_back(entry_name(e));
                 break;
             }
         }
+        if(rc < 0) return -1;
         dir=par;
     }
     std::cout<<"/";
@@ -633,44 +865,476 @@ int FS::pwd() {
 }
 
 // chmod: change access bits
-int FS::chmod(std::string accessrights, std::string filepath) {
-    uint16_t dirblk; std::string name;
+int FS::chmod(std::string_view accessrights, std::string_view filepath) {
+    OpTimer timer(OP_CHMOD);
+    DirGuard g(*this);
+    MetaOp op(*this);
+    uint32_t dirblk; std::string_view name;
     if(resolve_path(filepath,dirblk,name)!=0||name.empty()) return -1;
-    uint8_t buf[BLOCK_SIZE]; disk.read(dirblk,buf);
-    auto *ents = reinterpret_cast<dir_entry*>(buf);
-    int slots=BLOCK_SIZE/sizeof(dir_entry);
-    int val = std::stoi(accessrights, nullptr, 8 /*octal*/);
-    for(int i=0;i<slots;++i){
-        if(name==ents[i].file_name){
-            ents[i].access_rights = val;
-            disk.write(dirblk,buf);
-            return 0;
-        }
-    }
-    return -1;
+    int val;
+    auto [end, ec] = std::from_chars(accessrights.data(), accessrights.data() + accessrights.size(), val, 8 /*octal*/);
+    if(ec != std::errc() || end == accessrights.data()) return -1;
+    dir_entry ent; DirLoc loc;
+    if(dir_find(dirblk, name, loc, &ent) != 0) return -1;
+    ent.access_rights = val;
+    g.lock(dirblk);
+    return dir_update(dirblk, loc, ent);
 }
 
 // helpers:
-bool FS::is_directory(uint16_t dir_block) {
-    uint8_t buf[BLOCK_SIZE]; if(disk.read(dir_block,buf)!=0) return false;
-    auto *ents = reinterpret_cast<dir_entry*>(buf);
+bool FS::is_directory(uint32_t dir_block) {
+    const uint8_t *buf = this->dir_block(dir_block); if(!buf) return false;
+    auto *ents = reinterpret_cast<const dir_entry*>(buf);
     return ents[0].type == TYPE_DIR;
 }
-uint16_t FS::get_parent_directory(uint16_t dir_block) {
-    uint8_t buf[BLOCK_SIZE]; if(disk.read(dir_block,buf)!=0) return ROOT_BLOCK;
-    auto *ents = reinterpret_cast<dir_entry*>(buf);
-    int slots=BLOCK_SIZE/sizeof(dir_entry);
-    for(int i=0;i<slots;++i){
-        if(std::string(ents[i].file_name) == "..")
-            return ents[i].first_blk;
-    }
+uint32_t FS::get_parent_directory(uint32_t dir_block) {
+    DentryCache::Dentry d;
+    if(dcache.lookup(dir_block, "..", d)) return d.first_blk;
+    dir_entry e; DirLoc loc;
+    if(dir_find(dir_block, "..", loc, &e) == 0) return e.first_blk;
     return ROOT_BLOCK;
 }
 
-int FS::find_free_block() {
-    for (int i = 2; i < BLOCK_SIZE / 2; ++i) { // Skip ROOT and FAT
+void FS::build_freemap() {
+    freemap.reset(nblocks);
+    for (unsigned i = data_start(); i < nblocks; ++i) { // the reserved blocks never are
         if (fat[i] == FAT_FREE)
-            return i;
+            freemap.release(i);
+    }
+}
+
+int FS::alloc_block() {
+    return freemap.alloc(); // -1 when the disk is full
+}
+
+// free blocks that a crash before the commit cannot make live again
+int FS::spill_blocks(size_t n, std::vector<unsigned> &out) {
+    size_t had = out.size();
+    for (int b = freemap.first_free(); b >= 0 && out.size() - had < n; b = freemap.first_free(b + 1))
+        if (!unlogged_frees.count(b)) out.push_back(b);
+    if (out.size() - had < n) {
+        out.resize(had);
+        return -1;
+    }
+    for (size_t i = had; i < out.size(); ++i) freemap.take(out[i]);
+    return 0;
+}
+
+// reserve and link a chain of nblocks blocks, taking the best-fitting free
+// extents first; returns the first block or -1 if they do not all fit
+int FS::alloc_chain(size_t nblocks) {
+    if (nblocks == 0 || nblocks > freemap.free_count()) return -1;
+    int first = -1, prev = -1;
+    while (nblocks > 0) {
+        unsigned got;
+        int start = freemap.alloc_extent(nblocks, got);
+        if (start < 0) return -1;
+        for (unsigned i = 0; i < got; ++i) {
+            int b = start + i;
+            if (prev < 0) first = b; else fat[prev] = b;
+            fat[b] = FAT_EOF;
+            prev = b;
+        }
+        nblocks -= got;
+    }
+    return first;
+}
+
+// copy len bytes from the chain at src into the chain at dst, starting off
+// bytes into dst's first block (the bytes in front of off are kept). Data
+// moves in batches of IO_BATCH blocks, so memory use does not depend on len.
+// Unwritten source blocks are written out as zeros. The FAT is only read
+// here, as cp_tree copies on worker threads: dst must be a new chain, or
+// one whose first block the caller marks written once the copy is done.
+int FS::copy_chain(int32_t src, size_t len, int32_t dst, size_t off) {
+    std::vector<uint8_t> in(IO_BATCH * BLOCK_SIZE);
+    std::vector<uint8_t> out(off ? (IO_BATCH + 1) * BLOCK_SIZE : 0);
+    std::vector<BlockWrite> ios;
+    ios.reserve(IO_BATCH + 1);
+    size_t fill = off; // bytes waiting at the start of out
+    if (off > 0 && read_block(dst, out.data()) != 0) return -1;
+    while (len > 0) {
+        int n = read_chain(src, std::min<size_t>(IO_BATCH, blocks_for(len)), in.data());
+        if (n <= 0) return -1;
+        size_t bytes = std::min<size_t>((size_t)n * BLOCK_SIZE, len);
+        len -= bytes;
+        uint8_t *buf = in.data();
+        size_t total = bytes;
+        if (fill > 0) {
+            std::memcpy(out.data() + fill, in.data(), bytes);
+            buf = out.data();
+            total += fill;
+        }
+        // a partial block is held back for the next batch unless the data
+        // ends here, in which case it is zero padded
+        size_t nout = len > 0 ? total / BLOCK_SIZE : blocks_for(total);
+        if (len == 0 && total % BLOCK_SIZE)
+            std::memset(buf + total, 0, BLOCK_SIZE - total % BLOCK_SIZE);
+        ios.clear();
+        for (size_t i = 0; i < nout; ++i) {
+            ios.push_back({(unsigned)dst, buf + i * BLOCK_SIZE});
+            dst = fat[dst];
+        }
+        if (disk.writev(ios.data(), ios.size()) != 0) return -1;
+        fill = len > 0 ? total - nout * BLOCK_SIZE : 0;
+        if (fill > 0)
+            std::memmove(out.data(), buf + nout * BLOCK_SIZE, fill);
+    }
+    return 0;
+}
+
+namespace {
+
+// block buffers for an AioQueue, aligned so O_DIRECT can use them as is
+std::unique_ptr<uint8_t[], void (*)(void *)> aio_buffers(size_t nblocks) {
+    void *p = std::aligned_alloc(CACHE_ALIGN, nblocks * BLOCK_SIZE);
+    if (!p) throw std::bad_alloc();
+    return {static_cast<uint8_t*>(p), std::free};
+}
+
+} // namespace
+
+// Reads complete out of order; block i of the file goes to slot i % depth
+// and is only emitted once every block before it has been. An unwritten
+// block is zeroed in its slot and has arrived without a read.
+int FS::stream_chain(int32_t blk, size_t len, AioQueue &q,
+                     const std::function<void(const uint8_t *, size_t)> &emit) {
+    size_t nblocks = blocks_for(len);
+    unsigned depth = q.depth();
+    auto ring = aio_buffers(depth);
+    std::vector<AioDone> done(depth);
+    std::vector<bool> arrived(depth);
+    size_t issued = 0, emitted = 0;
+    int rc = 0;
+    while (emitted < nblocks && rc == 0) {
+        while (issued < nblocks && issued - emitted < depth && blk != FAT_EOF) {
+            uint8_t *slot = &ring[(issued % depth) * BLOCK_SIZE];
+            if (fat.unwritten(blk)) {
+                std::memset(slot, 0, BLOCK_SIZE);
+                arrived[issued % depth] = true;
+            } else if (q.read(blk, slot, issued) != 0) {
+                rc = -1;
+                break;
+            }
+            blk = fat[blk];
+            ++issued;
+        }
+        if (rc != 0 || issued == emitted) break; // the chain ended early, as in cat()
+        size_t n = q.in_flight() ? q.reap(done.data(), depth, true) : 0;
+        if (n == 0 && !arrived[emitted % depth]) rc = -1;
+        for (size_t i = 0; i < n; ++i) {
+            if (done[i].result != 0) rc = -1;
+            arrived[done[i].tag % depth] = true;
+        }
+        while (rc == 0 && emitted < issued && arrived[emitted % depth]) {
+            arrived[emitted % depth] = false;
+            emit(&ring[(emitted % depth) * BLOCK_SIZE],
+                 std::min<size_t>(BLOCK_SIZE, len - emitted * BLOCK_SIZE));
+            ++emitted;
+        }
+    }
+    q.drain();
+    return rc;
+}
+
+// A slot holds one block from its read until its write has completed;
+// tags are the slot number shifted left, with the low bit set for writes.
+// An unwritten source block is not read: its slot is zeroed and written.
+int FS::copy_chain_async(int32_t src, size_t len, int32_t dst, AioQueue &q) {
+    size_t nblocks = blocks_for(len);
+    unsigned depth = q.depth();
+    auto ring = aio_buffers(depth);
+    std::vector<AioDone> done(depth);
+    std::vector<int32_t> target(depth);
+    std::vector<bool> last(depth);
+    std::vector<unsigned> idle;
+    for (unsigned s = depth; s-- > 0; ) idle.push_back(s);
+    size_t issued = 0, written = 0;
+    int rc = 0;
+    while (written < nblocks && rc == 0) {
+        while (issued < nblocks && !idle.empty() && src != FAT_EOF && dst != FAT_EOF) {
+            unsigned s = idle.back();
+            idle.pop_back();
+            target[s] = dst;
+            last[s] = issued == nblocks - 1;
+            uint8_t *buf = &ring[s * BLOCK_SIZE];
+            int queued;
+            if (fat.unwritten(src)) {
+                std::memset(buf, 0, BLOCK_SIZE);
+                queued = q.write(dst, buf, ((uint64_t)s << 1) | 1);
+            } else {
+                queued = q.read(src, buf, (uint64_t)s << 1);
+            }
+            if (queued != 0) {
+                rc = -1;
+                break;
+            }
+            src = fat[src];
+            dst = fat[dst];
+            ++issued;
+        }
+        if (rc != 0 || q.in_flight() == 0) { rc = -1; break; }
+        size_t n = q.reap(done.data(), depth, true);
+        if (n == 0) rc = -1;
+        for (size_t i = 0; i < n; ++i) {
+            unsigned s = done[i].tag >> 1;
+            if (done[i].result != 0) {
+                rc = -1;
+            } else if (done[i].tag & 1) {
+                fat.set_unwritten(target[s], false);
+                idle.push_back(s);
+                ++written;
+            } else {
+                uint8_t *buf = &ring[s * BLOCK_SIZE];
+                if (last[s] && len % BLOCK_SIZE)
+                    std::memset(buf + len % BLOCK_SIZE, 0, BLOCK_SIZE - len % BLOCK_SIZE);
+                if (q.write(target[s], buf, done[i].tag | 1) != 0) rc = -1;
+            }
+        }
+    }
+    q.drain();
+    return rc;
+}
+
+// read up to nblocks blocks of the chain starting at blk into out with one
+// vectored read; blk is advanced past them. Unwritten blocks are zero
+// filled and left out of the read. Returns the number of blocks read
+// (fewer if the chain ends first) or -1 on error.
+int FS::read_chain(int32_t &blk, size_t nblocks, uint8_t *out) {
+    BlockRead inline_ios[IO_INLINE];
+    std::vector<BlockRead> heap_ios;
+    BlockRead *ios = inline_ios;
+    if (nblocks > IO_INLINE) {
+        heap_ios.resize(nblocks);
+        ios = heap_ios.data();
+    }
+    size_t n = 0, nios = 0;
+    int32_t start = blk;
+    while (n < nblocks && blk != FAT_EOF) {
+        if (fat.unwritten(blk))
+            std::memset(out + n * BLOCK_SIZE, 0, BLOCK_SIZE);
+        else
+            ios[nios++] = {(unsigned)blk, out + n * BLOCK_SIZE};
+        ++n;
+        blk = fat[blk];
+    }
+    if (disk.readv(ios, nios) != 0) return -1;
+    if (n > 0) read_ahead(start, blk, n);
+    return n;
+}
+
+int FS::read_block(int32_t blk, uint8_t *buf) {
+    if (fat.unwritten(blk)) {
+        std::memset(buf, 0, BLOCK_SIZE);
+        return 0;
+    }
+    return disk.read(blk, buf);
+}
+
+void FS::mark_unwritten(int32_t blk) {
+    for (; blk != FAT_EOF; blk = fat[blk])
+        fat.set_unwritten(blk, true);
+}
+
+// A read that starts where the previous one on this thread ended continues
+// a sequential walk of a chain; the window then doubles and the chain is
+// prefetched that far past the read, from the FAT alone. Any other read
+// starts over. Blocks still ahead from an earlier prefetch are not asked
+// for again.
+void FS::read_ahead(int32_t start, int32_t next, size_t nblocks) {
+    struct Walk {
+        int32_t expect = FAT_EOF;        // block the next read would start at
+        int32_t frontier = FAT_EOF;      // first chain block not yet prefetched
+        size_t ahead = 0;                // blocks prefetched past expect
+        size_t window = 0;
+    };
+    thread_local Walk w;
+    if (start != w.expect || start == FAT_EOF) {
+        w = Walk();
+        w.expect = next;
+        return;
+    }
+    w.window = std::min<size_t>(RA_MAX, std::max<size_t>({RA_MIN, w.window * 2, nblocks}));
+    w.expect = next;
+    w.ahead = w.ahead > nblocks ? w.ahead - nblocks : 0;
+    if (w.ahead == 0) w.frontier = next;
+    unsigned blocks[RA_MAX];
+    size_t n = 0, walked = 0;            // unwritten blocks are walked, not read
+    while (w.ahead + walked < w.window && w.frontier != FAT_EOF && w.frontier > 0) {
+        if (!fat.unwritten(w.frontier)) blocks[n++] = w.frontier;
+        ++walked;
+        w.frontier = fat[w.frontier];
+    }
+    w.ahead += walked;
+    if (n > 0) disk.prefetch(blocks, n);
+}
+
+void FS::free_chain(int32_t blk) {
+    ++chain_gen;
+    while (blk != FAT_EOF && blk != FAT_FREE) {
+        int32_t next = fat[blk];
+        fat[blk] = FAT_FREE;
+        chains.forget(blk);
+        txn.dirs.erase(blk);
+        // a metadata block with an image in the journal must not become file
+        // data before the log is reset, or a replay would overwrite the data
+        if (journal.logged(blk)) deferred.push_back(blk);
+        else freemap.release(blk);
+        if (journal.enabled()) unlogged_frees.insert(blk);
+        blk = next;
+    }
+}
+
+int FS::save_fat() {
+    return fat.flush([this](unsigned page, const uint8_t *buf) {
+        return write_meta(FAT_START + page, buf);
+    });
+}
+
+// The reflink table lives in REFCOUNT_BLOCK: a magic number, the number of
+// entries, then one (first block, references) pair per shared chain. Disks
+// formatted before the table existed may use that block for data, so
+// reflinks stay off unless the magic number is found there.
+void FS::load_refcounts() {
+    refcount.clear();
+    reflinks = false;
+    if (fat[REFCOUNT_BLOCK] != FAT_EOF) return;
+    const uint8_t *buf = disk.view(REFCOUNT_BLOCK);
+    if (!buf) return;
+    auto *hdr = reinterpret_cast<const uint32_t*>(buf);
+    if (hdr[0] != REFCOUNT_MAGIC || hdr[1] > REFCOUNT_SLOTS) return;
+    auto *ents = reinterpret_cast<const refcount_entry*>(buf + 8);
+    for (uint32_t i = 0; i < hdr[1]; ++i)
+        refcount[ents[i].first_blk] = ents[i].refs;
+    reflinks = true;
+}
+
+int FS::save_refcounts() {
+    if (!reflinks) return 0;
+    uint8_t buf[BLOCK_SIZE] = {0};
+    auto *hdr = reinterpret_cast<uint32_t*>(buf);
+    auto *ents = reinterpret_cast<refcount_entry*>(buf + 8);
+    hdr[0] = REFCOUNT_MAGIC;
+    hdr[1] = refcount.size();
+    size_t i = 0;
+    for (auto &rc : refcount)
+        ents[i++] = {rc.first, rc.second};
+    return write_meta(REFCOUNT_BLOCK, buf);
+}
+
+// one more file uses the chain at first; -1 if reflinks are unavailable
+int FS::add_ref(int32_t first) {
+    if (!reflinks) return -1;
+    auto it = refcount.find(first);
+    if (it == refcount.end()) {
+        if (refcount.size() >= REFCOUNT_SLOTS) return -1;
+        refcount[first] = 2;
+    } else {
+        ++it->second;
     }
-    return -1; // Disk full
+    txn.refcounts = true;
+    return 0;
+}
+
+// one file less uses the chain at first; true if it was the last user
+bool FS::release_ref(int32_t first) {
+    auto it = refcount.find(first);
+    if (it == refcount.end()) return true;
+    if (--it->second < 2) refcount.erase(it);
+    txn.refcounts = true;
+    return false;
+}
+
+int FS::unshare(dir_entry &e, const DirLoc &loc) {
+    if (is_inline(e)) {
+        uint8_t data[INLINE_MAX];
+        if (dir_inline(loc, e, data) != 0) return -1;
+        int first = write_to_file(data, e.size);
+        if (first < 0) return -1;
+        e.first_blk = first;
+        e.flags &= ~ENTRY_INLINE;
+        return 0;
+    }
+    if (is_compressed(e)) return unpack_entry(e);
+    if (!refcount.count(e.first_blk)) return 0;
+    int copy = alloc_chain(std::max<size_t>(1, blocks_for(e.size)));
+    if (copy < 0) return -1;
+    if (copy_chain(e.first_blk, e.size, copy, 0) != 0) {
+        free_chain(copy);
+        return -1;
+    }
+    release_ref(e.first_blk);
+    e.first_blk = copy;
+    return 0;
+}
+
+// Metadata transactions: operations stage the directory blocks they change
+// and flag the FAT / reflink table as dirty; nothing is written until the
+// outermost MetaOp ends, at which point every dirty block is written once.
+// With a journal the blocks join the running group instead, which is
+// committed as a whole at the next sync or once it has grown large enough.
+int FS::commit() {
+    int rc = 0;
+    if (fat.pending() && save_fat() != 0) rc = -1;
+    if (txn.refcounts && save_refcounts() != 0) rc = -1;
+    for (auto &d : txn.dirs) {
+        if (write_meta(d.first, d.second.data()) != 0) rc = -1;
+    }
+    txn.refcounts = false;
+    txn.dirs.clear();
+    if (journal.pending() >= JOURNAL_GROUP) {
+        if (journal.flush() != 0) rc = -1;
+        else unlogged_frees.clear();
+    }
+    release_deferred();
+    return rc;
+}
+
+// other threads may see the new block as soon as it is written or logged
+int FS::write_meta(uint32_t blk, const uint8_t *buf) {
+    int rc = 0;
+    if (!journal.enabled()) rc = disk.write(blk, buf);
+    else journal.add(blk, buf);
+    dnames.invalidate(blk);
+    return rc;
+}
+
+void FS::release_deferred() {
+    auto keep = std::remove_if(deferred.begin(), deferred.end(), [this](uint32_t b) {
+        if (journal.logged(b)) return false;
+        freemap.release(b);
+        return true;
+    });
+    deferred.erase(keep, deferred.end());
+}
+
+// read a directory block, seeing changes staged by the current operation
+int FS::load_dir(uint32_t blk, uint8_t *buf) {
+    const uint8_t *p = dir_block(blk);
+    if (!p) return -1;
+    std::memcpy(buf, p, BLOCK_SIZE);
+    return 0;
+}
+
+// read-only view of a directory block, seeing staged changes and those
+// still waiting in the journal's running group. Only the writing thread
+// may look at its transaction; any other thread copies from the group,
+// which the writer may change or flush meanwhile.
+const uint8_t *FS::dir_block(uint32_t blk) {
+    if (txn.owner.load(std::memory_order_relaxed) == std::this_thread::get_id()) {
+        auto it = txn.dirs.find(blk);
+        if (it != txn.dirs.end()) return it->second.data();
+        if (const uint8_t *p = journal.find(blk)) return p;
+        return disk.view(blk);
+    }
+    thread_local BlockBuf mine;
+    if (journal.copy(blk, mine.data())) return mine.data();
+    return disk.view(blk);
+}
+
+// hand a modified directory block to the current transaction
+int FS::stage_dir(uint32_t blk, const uint8_t *buf) {
+    if (txn.depth == 0) return write_meta(blk, buf);
+    std::memcpy(txn.dirs[blk].data(), buf, BLOCK_SIZE);
+    return 0;
 }
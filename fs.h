@@ -6,14 +6,50 @@
 #include <fstream>
 #include <cstdint>
 #include <cstring>
+#include <algorithm>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <cstdio>
 #include "disk.h"
+#include "fat.h"
+#include "chain.h"
+#include "freemap.h"
+#include "journal.h"
+#include "dcache.h"
+#include "dirnames.h"
+#include "stats.h"
+#include "sink.h"
+
+class AioQueue;
 
 #define ROOT_BLOCK 0
-#define FAT_BLOCK 1
-#define FAT_FREE 0
-#define FAT_EOF -1
+#define SUPER_BLOCK 1            // geometry, see struct superblock
+#define SUPER_MAGIC 0x52505553   // "SUPR"
+#define REFCOUNT_BLOCK 2         // table of chains shared by reflinked files
+#define REFCOUNT_MAGIC 0x54434652
+#define JOURNAL_START 3          // metadata journal, JOURNAL_BLOCKS long
+#define JOURNAL_BLOCKS 128
+#define JOURNAL_GROUP 32         // blocks gathered before a group commit
+#define FAT_START (JOURNAL_START + JOURNAL_BLOCKS) // FAT, as many blocks as it needs
+
+#define IO_BATCH 256    // max blocks per vectored read
+#define LS_ROW_MAX 96   // longest line of ls output
+#define DIR_LOCKS 64    // stripes of per-directory reader/writer locks
+#define RA_MIN 8        // read-ahead window once a chain walk is sequential,
+#define RA_MAX 128      // doubling up to RA_MAX blocks while it stays so
+#define WORKERS 8                // threads of import, export and the tree walks
+#define IMPORT_BATCH (64 << 20)  // bytes of files added per import transaction
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
@@ -21,58 +57,530 @@
 #define WRITE 0x02
 #define EXECUTE 0x01
 
+#define OPEN_READ 0x1   // flags of FS::open()
+#define OPEN_WRITE 0x2
+#define OPEN_CREATE 0x4 // make an empty file if there is none
+#define OPEN_TRUNC 0x8  // cut the file to 0 bytes
+
 struct dir_entry {
     char    file_name[56];       // name of the file / sub-directory
     uint32_t size;               // size of the file in bytes
-    uint16_t first_blk;          // index in the FAT for the first block of the file
+    uint32_t first_blk;          // index in the FAT for the first block of the file
     uint8_t  type;               // directory (1) or file (0)
     uint8_t  access_rights;      // read (0x04), write (0x02), execute (0x01)
+    uint8_t  flags;              // ENTRY_* bits
+    uint8_t  reserved;           // zero
+    uint32_t zblocks;            // blocks in the chain of a compressed file, else zero
 };
 
+#define ENTRY_INLINE 0x1         // data kept in the directory block, see INLINE_MAX
+#define ENTRY_COMPRESSED 0x2     // data kept in compressed groups, see ZGROUP_BLOCKS
+
 constexpr size_t MAX_NAME_LEN = sizeof(dir_entry::file_name) - 1;
 
+// the name of an entry as a view, without relying on a terminator
+inline std::string_view entry_name(const dir_entry &e) {
+    return std::string_view(e.file_name, strnlen(e.file_name, sizeof(e.file_name)));
+}
+
+inline bool is_dot(std::string_view name) { return name == "." || name == ".."; }
+
+// store name (at most MAX_NAME_LEN characters) in e, zero padded
+inline void set_entry_name(dir_entry &e, std::string_view name) {
+    std::memset(e.file_name, 0, sizeof(e.file_name));
+    std::memcpy(e.file_name, name.data(), std::min(name.size(), MAX_NAME_LEN));
+}
+
+constexpr size_t DIR_SLOTS = BLOCK_SIZE / sizeof(dir_entry);
+
+// Files of up to INLINE_MAX bytes live in their directory block. The entry
+// is flagged ENTRY_INLINE and has no chain (first_blk is FAT_EOF, which
+// frees as nothing); the data fills the slots right after it, INLINE_CHUNK
+// bytes each behind a '/' and the slot's number, so scans for names and
+// free slots pass over them. A file that is written to gets a chain first.
+#define INLINE_SLOTS 4
+constexpr size_t INLINE_CHUNK = sizeof(dir_entry) - 2;
+constexpr size_t INLINE_MAX = INLINE_SLOTS * INLINE_CHUNK;
+
+inline bool is_inline(const dir_entry &e) { return e.flags & ENTRY_INLINE; }
+
+// slots taken by e, its inline data included
+inline unsigned entry_slots(const dir_entry &e) {
+    return 1 + (is_inline(e) ? (e.size + INLINE_CHUNK - 1) / INLINE_CHUNK : 0);
+}
+// The chain of a compressed file holds its data in groups of ZGROUP_BYTES
+// (the last one shorter), each compressed on its own with the codec of
+// lz.h. A group starts at a block boundary with a zgroup_header, followed
+// by its packed bytes, and takes as many blocks as those need; a group
+// that does not shrink is stored as it is behind its header. Groups are
+// read and decoded one at a time. A compressed file that is written to,
+// truncated or grown is unpacked into a plain chain first.
+#define ZGROUP_BLOCKS 16
+#define ZGROUP_MAGIC 0x50475a43  // "CZGP"
+constexpr size_t ZGROUP_BYTES = ZGROUP_BLOCKS * BLOCK_SIZE;
+
+struct zgroup_header {
+    uint32_t magic;
+    uint32_t raw;                // bytes of file data in the group
+    uint32_t packed;             // bytes that follow the header; raw if stored as is
+    uint32_t reserved;
+};
+
+inline bool is_compressed(const dir_entry &e) { return e.flags & ENTRY_COMPRESSED; }
+
+// bytes at the start of e's chain that a copy of e must take along
+inline size_t chain_bytes(const dir_entry &e) {
+    return is_compressed(e) ? (size_t)e.zblocks * BLOCK_SIZE : e.size;
+}
+static_assert(sizeof(dir_entry) == 72, "a directory entry is 72 bytes on the disk");
+static_assert(DIR_SLOTS == DNAMES_SLOTS, "decoded directory blocks are sized for 72-byte entries");
+
+// Directories start as a single block of entries. When that block fills up
+// the directory is indexed: the last slot of its first block gets a hidden
+// entry named HTREE_NAME (no path component can start with '/') pointing
+// to an index block, and the entries move to leaf blocks chosen by a hash
+// of their name. Only "." and ".." stay behind in the first block. The
+// index, the leaves and the first block form the directory's FAT chain.
+#define HTREE_NAME "/htree"
+#define HTREE_MAGIC 0x45455248
+
+struct htree_node {
+    uint32_t hash;               // lowest name hash stored in blk
+    uint32_t blk;                // leaf block
+};
+
+struct htree_index {
+    uint32_t magic;
+    uint32_t count;              // nodes in use, sorted by hash; nodes[0].hash == 0
+    uint64_t reserved;
+    htree_node nodes[(BLOCK_SIZE - 16) / sizeof(htree_node)];
+};
+
+constexpr size_t HTREE_NODES = sizeof(htree_index::nodes) / sizeof(htree_node);
+
+// where a directory entry lives: the block holding it and its slot there
+struct DirLoc {
+    uint32_t blk;
+    uint16_t slot;
+};
+
+// cursor over the entries of one directory, see FS::dir_next()
+struct DirIter {
+    uint32_t dir;                // first block of the directory
+    uint32_t index = 0;          // index block, 0 if the directory has none
+    int node = -1;               // leaf being walked; -1 is the first block
+    unsigned slot = 0;           // next slot to look at
+    bool decoded = false;        // used holds the slots of the current block
+    DirSlots used;
+};
+
+struct refcount_entry {
+    uint32_t first_blk;          // first block of a shared chain
+    uint32_t refs;               // number of files using it (>= 2)
+};
+
+constexpr size_t REFCOUNT_SLOTS = (BLOCK_SIZE - 8) / sizeof(refcount_entry);
+
+// Block 1 of a formatted disk. The FAT has one 32-bit entry per block and
+// starts at fat_start, followed by room for the free-block bitmap; the
+// blocks in front of the first data block (the root, this block, the
+// reflink table, the journal, the FAT and the bitmap) are marked FAT_EOF
+// in the FAT. A disk only mounts with the BLOCK_SIZE it was formatted with.
+// While clean is set the bitmap matches the FAT and the mount loads it
+// instead of scanning the FAT; the mount clears the flag again, so after a
+// crash the bitmap is rebuilt.
+struct superblock {
+    uint32_t magic;              // SUPER_MAGIC
+    uint32_t block_size;
+    uint32_t nblocks;            // blocks on the disk
+    uint32_t fat_start;
+    uint32_t fat_blocks;
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    uint32_t refcount_block;
+    uint32_t bitmap_start;       // one bit per block, set = free
+    uint32_t bitmap_blocks;      // 0 on disks formatted without a bitmap
+    uint32_t free_blocks;        // number of bits set in the bitmap
+    uint32_t clean;              // 1 from a clean unmount to the next mount
+};
+
+// one client of the file system; threads start out in their FS's own
+// session and may switch to one of their own with FS::attach()
+struct Session {
+    uint32_t cwd = ROOT_BLOCK;           // block number of current directory
+};
+
 class FS {
 private:
     Disk disk;
-    int16_t fat[BLOCK_SIZE/2];           // in-memory FAT
-    uint16_t current_dir = ROOT_BLOCK;   // block number of current directory
+    Journal journal;                     // off on disks formatted without one
+    Fat fat;                             // one entry per block, paged in on use
+    ChainIndex chains;                   // skip index over long file chains
+    unsigned nblocks = 0;                // blocks the FAT covers
+    unsigned fat_blocks = 0;             // and the blocks it takes up
+    superblock super = {};               // as on the disk; magic 0 if unformatted
+    Session main_session;
+    static thread_local Session *attached;
+    Session &session() { return attached ? *attached : main_session; }
+    FreeMap freemap;                     // free blocks, rebuilt from the FAT on mount
+    std::unordered_map<uint32_t, uint32_t> refcount; // shared chains -> users
+    bool reflinks = false;               // disk has a reflink table
+    std::vector<uint32_t> deferred;      // freed, but still imaged in the journal
+    std::unordered_set<uint32_t> unlogged_frees; // freed by the running journal
+                                         // group: still in use on the disk
+    DentryCache dcache;                  // (dir block, name) -> entry
+    DirNamesCache dnames;                // dir block -> hashes of its names
+    std::atomic<uint64_t> chain_gen{0};  // bumped whenever a chain loses blocks
+
+    // Locking. Operations that change anything hold meta_lock from start
+    // to end, so there is one writer at a time and the FAT, free map,
+    // reflink table and transaction below need no other lock. Readers
+    // (cat, ls, cd, pwd) never take it: they lock directories shared, one
+    // at a time along the path, while a writer locks the directories it
+    // changes exclusively until its transaction has committed.
+    std::recursive_mutex meta_lock;
+    std::shared_mutex dir_locks[DIR_LOCKS]; // by first block % DIR_LOCKS
+
+    // the directory stripes held by one operation, released on destruction
+    class DirGuard {
+        FS &fs;
+        unsigned held[2];
+        unsigned n = 0;
+        bool exclusive = false;
+        bool all = false;
+    public:
+        explicit DirGuard(FS &fs) : fs(fs) { }
+        ~DirGuard() { release(); }
+        // shared: lock dir, then drop whatever was held before
+        void enter(uint32_t dir);
+        // exclusive: lock a and b together (writers only)
+        void lock(uint32_t a, uint32_t b);
+        void lock(uint32_t dir) { lock(dir, dir); }
+        void lock_all();
+        void release();
+    };
+
+    // metadata dirtied by the operation in progress; written out together
+    // when the outermost MetaOp ends
+    struct MetaTxn {
+        unsigned depth = 0;
+        std::atomic<std::thread::id> owner{}; // thread running the operation
+        bool refcounts = false;          // reflink table differs from disk
+        std::map<uint32_t, BlockBuf> dirs; // staged dir blocks
+    } txn;
+
+    // scope of one metadata transaction; nested scopes join the outer one
+    struct MetaOp {
+        FS &fs;
+        MetaOp(FS &fs) : fs(fs) {
+            fs.meta_lock.lock();
+            if (fs.txn.depth++ == 0) fs.txn.owner = std::this_thread::get_id();
+        }
+        ~MetaOp() {
+            if (--fs.txn.depth == 0) {
+                fs.commit();
+                fs.txn.owner = std::thread::id();
+            }
+            fs.meta_lock.unlock();
+        }
+    };
+    int commit();
+    // directory access that sees blocks staged by the current transaction
+    int load_dir(uint32_t blk, uint8_t *buf);
+    const uint8_t *dir_block(uint32_t blk);
+    int stage_dir(uint32_t blk, const uint8_t *buf);
+    // write a committed metadata block through the journal when there is one
+    int write_meta(uint32_t blk, const uint8_t *buf);
+    // hand freed blocks to the free map once replay can no longer touch them
+    void release_deferred();
 
     // Helper: write raw data across chained blocks
-    int write_to_file(const std::string &filepath,
-                      const uint8_t *data,
-                      size_t size);
+    int write_to_file(const uint8_t *data, size_t size);
 
     // Resolve an absolute or relative path into:
     //   out_dir  = block number of containing directory
-    //   out_name = final component (file or directory name)
-    // Returns 0 on success, -1 on failure.
-    int resolve_path(const std::string &path,
-                     uint16_t &out_dir,
-                     std::string &out_name);
+    //   out_name = final component (file or directory name), a view into path
+    // Returns 0 on success, -1 on failure. Nothing is allocated.
+    // Readers pass walk: each directory on the way is locked shared before
+    // the previous one is let go, and out_dir is left locked.
+    int resolve_path(std::string_view path,
+                     uint32_t &out_dir,
+                     std::string_view &out_name,
+                     DirGuard *walk = nullptr);
+    // block of the sub-directory name of dir, or -1
+    int lookup_dir(uint32_t dir, std::string_view name);
+
+    // Directory layer (dir.cpp). Directories are named by their first
+    // block; every lookup and change goes through these, so callers never
+    // see the layout of a directory's blocks.
+    // find name in dir, copying the entry to out; -1 if absent
+    int dir_find(uint32_t dir, std::string_view name, DirLoc &loc, dir_entry *out = nullptr);
+    // add e to dir, growing the directory as needed; -1 when it cannot grow.
+    // data is the content of an inline e.
+    int dir_add(uint32_t dir, const dir_entry &e, DirLoc *loc = nullptr,
+                const uint8_t *data = nullptr);
+    // replace / clear the entry at loc, which dir_find() returned. Inline
+    // data is kept as far as e still takes its slots; e cannot take more.
+    int dir_update(uint32_t dir, const DirLoc &loc, const dir_entry &e);
+    // copy the data of inline entry e at loc to out (INLINE_MAX bytes)
+    int dir_inline(const DirLoc &loc, const dir_entry &e, uint8_t *out);
+    int dir_remove(uint32_t dir, const DirLoc &loc);
+    // walk every entry of a directory (in no particular order); the hidden
+    // index entry is skipped. Returns 1 with the next entry, 0 at the end.
+    DirIter dir_begin(uint32_t dir);
+    int dir_next(DirIter &it, dir_entry &e, DirLoc *loc = nullptr);
+    // true if dir holds nothing but "." and ".."
+    bool dir_empty(uint32_t dir);
+    // slots of directory block blk in use, or in use by a name with hash
+    // *h, from the block's decoded names; ents is set to its entries, or
+    // nullptr if it cannot be read
+    DirSlots dir_slots(uint32_t blk, const dir_entry *&ents, const uint32_t *h = nullptr);
+    // index block of dir, or 0 if it is a single block
+    uint32_t dir_index(uint32_t dir);
+    // leaf of an indexed directory that holds names with hash h
+    int htree_leaf(uint32_t index, uint32_t h, unsigned *node = nullptr);
+    int htree_convert(uint32_t dir);
+    int htree_split(uint32_t index, unsigned node);
+    // link a fresh block into dir's chain right after block after
+    int dir_grow(uint32_t after);
+    // new sub-directory name of parent (locked by the caller); its block or -1
+    int dir_create(uint32_t parent, std::string_view name);
+
+    // rebuild the free map from the in-memory FAT
+    void build_freemap();
+    // take a free block out of the free map (the caller links it in the FAT);
+    // returns -1 when the disk is full
+    int alloc_block();
+    // n blocks for journal images that do not fit in the log, see Journal
+    int spill_blocks(size_t n, std::vector<unsigned> &out);
+    // reserve and link a chain of nblocks blocks in as few extents as possible
+    int alloc_chain(size_t nblocks);
+    // copy len bytes between chains with memory bounded by IO_BATCH
+    int copy_chain(int32_t src, size_t len, int32_t dst, size_t off);
+    // read the next nblocks blocks of a chain with one vectored read
+    int read_chain(int32_t &blk, size_t nblocks, uint8_t *out);
+    // called by read_chain after reading the blocks from start up to next
+    void read_ahead(int32_t start, int32_t next, size_t nblocks);
+    // one block of a file's chain; zeros, without a read, if it is unwritten
+    int read_block(int32_t blk, uint8_t *buf);
+    // flag every block of the chain from blk on as unwritten (fat.h)
+    void mark_unwritten(int32_t blk);
+    // asynchronous versions: every block of the chain is known from the
+    // FAT up front, so q is kept full while earlier blocks are handled.
+    // stream_chain passes len bytes of the chain to emit in chain order.
+    int stream_chain(int32_t blk, size_t len, AioQueue &q,
+                     const std::function<void(const uint8_t *, size_t)> &emit);
+    int copy_chain_async(int32_t src, size_t len, int32_t dst, AioQueue &q);
+    int cat_file(std::string_view filepath, bool async, OutputSink &out);
+    int cp_file(std::string_view sourcepath, std::string_view destpath, bool reflink, bool async);
+    static size_t blocks_for(size_t bytes) { return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE; }
+    // blocks of a FAT for a disk of n blocks
+    static unsigned fat_size(unsigned n) { return blocks_for((size_t)n * sizeof(int32_t)); }
+    // blocks of the free-block bitmap for a disk of n blocks
+    static unsigned bitmap_size(unsigned n) { return blocks_for(((size_t)n + 63) / 64 * 8); }
+    // first block after the FAT and the bitmap, i.e. the first one files can use
+    unsigned data_start() const { return FAT_START + fat_blocks + super.bitmap_blocks; }
+    // size the FAT for n blocks: read from the disk, or every entry free
+    void set_geometry(unsigned n, bool on_disk);
+    // read the superblock and set up the free map; -1 if the disk is not
+    // formatted
+    int mount();
+    // the free map from the bitmap a clean unmount saved; -1 if there is none
+    int load_summary();
+    // save the free map and mark the disk clean; the journal must be empty
+    int save_summary();
+    int write_super();
+    // write back the FAT pages the transaction changed
+    int save_fat();
+
+    // reflink bookkeeping
+    void load_refcounts();
+    int save_refcounts();
+    int add_ref(int32_t first);
+    bool release_ref(int32_t first);
+    // give e at loc a chain of its own: a private copy of a reflinked one,
+    // or a new plain one holding its inline or compressed data; the caller
+    // saves e
+    int unshare(dir_entry &e, const DirLoc &loc);
+    // return every block of a FAT chain to the free map
+    void free_chain(int32_t blk);
+
+    // Compressed files (compress.cpp). buf is scratch space for one stored
+    // group, ZGROUP_BLOCKS + 1 blocks.
+    // pack n <= ZGROUP_BYTES bytes of data as the next group of the chain
+    // from first to last (FAT_EOF while it is empty); blocks counts the chain
+    int pack_group(const uint8_t *data, size_t n, int32_t &first, int32_t &last,
+                   uint32_t &blocks, std::vector<uint8_t> &buf);
+    // header of the group at blk, read with its block into buf
+    int group_header(int32_t blk, uint8_t *buf, zgroup_header &h);
+    // decode the group at blk into out (ZGROUP_BYTES) and move blk to the
+    // next one; the bytes decoded or -1
+    ssize_t unpack_group(int32_t &blk, uint8_t *out, std::vector<uint8_t> &buf);
+    // bytes [off, off + n) of the compressed data of size bytes in the chain
+    // at first, passed to emit group by group; emit may rely on zeros after
+    // the bytes it gets up to the end of their last block. Only reads, so
+    // a reader or a worker thread may call it.
+    int unpack_range(int32_t first, uint64_t size, uint64_t off, uint64_t n,
+                     const std::function<int(const uint8_t *, size_t)> &emit);
+    // give compressed e a plain chain with its data; the caller saves e
+    int unpack_entry(dir_entry &e);
+
+    // File handles (file.cpp). A handle keeps its file's directory and
+    // name, its position and a cursor into the file's chain: block idx of
+    // the chain starting at first is blk, as of chain_gen == gen. Other
+    // blocks are looked up in chains.
+    struct OpenFile {
+        uint32_t dir;
+        std::string name;
+        int flags;
+        uint64_t pos = 0;                // for read(), write() and lseek()
+        uint32_t first = 0;
+        uint64_t gen = 0;
+        size_t idx = 0;
+        int32_t blk = FAT_EOF;
+    };
+    std::vector<std::unique_ptr<OpenFile>> files; // by handle, nullptr if closed
+    std::mutex files_lock;               // guards files itself, not the handles
+    OpenFile *handle(int fd);
+    // look the entry of h up again; -1 if it is gone
+    int reopen(OpenFile &h, dir_entry &e, DirLoc &loc);
+    // block idx of e's chain, walking from h's cursor when it is good
+    int32_t seek_block(OpenFile &h, const dir_entry &e, size_t idx);
+    int write_range(OpenFile &h, const dir_entry &e, uint64_t off, const uint8_t *data,
+                    size_t n, uint64_t old_size);
+    int extend(OpenFile &h, dir_entry &e, uint64_t size, uint64_t zero_to);
+    int write_blocks(const std::vector<BlockWrite> &ios);
 
-    int find_free_block();
+    // Host trees (hostio.cpp). A host file on its way in or out, with the
+    // blocks of its chain; the worker threads get nothing else.
+    struct HostFile;
+    // blocks of the sub-directories of parent called names, made where
+    // missing; -1 for a name taken by a file or that cannot be made
+    std::vector<int> import_dirs(uint32_t parent, const std::vector<std::string> &names);
+    // the files into dir in one transaction; the number that failed
+    int import_files(uint32_t dir, std::vector<HostFile> &files);
+    // worker threads worth starting for jobs that move bytes in all, at
+    // least IO_BATCH blocks each
+    static size_t workers_for(size_t jobs, uint64_t bytes) {
+        return std::min<uint64_t>({jobs, WORKERS, 1 + bytes / ((uint64_t)IO_BATCH * BLOCK_SIZE),
+                                   std::max(1u, std::thread::hardware_concurrency())});
+    }
+
+    // Tree walks (tree.cpp): fn(dir, path, &e) for every entry below top
+    // but "." and "..", where path names dir, after fn(dir, path, nullptr)
+    // for dir itself, top included. A reader walks on up to WORKERS threads
+    // when the disk's views allow it, each holding a directory shared while
+    // listing it, and an idle worker steals directories from a busy one, so
+    // fn must be thread safe. A writer walks in its own thread. -1 if some
+    // directory could not be read.
+    using WalkFn = std::function<void(uint32_t dir, const std::string &path, const dir_entry *e)>;
+    int walk_tree(uint32_t top, const std::string &path, bool reader, const WalkFn &fn);
+    // free the chains of everything below dir and dir's own (writers only)
+    int free_tree(uint32_t dir);
+    // block of the directory at path for a reader, or -1
+    int find_dir(std::string_view path);
 
 public:
-    FS();
+    FS(const DiskOptions &opts = DiskOptions());
     ~FS();
 
-    int format();
-    int create(std::string filepath);
-    int cat(std::string filepath);
-    int ls();
+    // nblocks > 0 first resizes the disk file to that many blocks
+    int format(unsigned nblocks = 0);
+    int create(std::string_view filepath);
+    int cat(std::string_view filepath) {
+        OutputSink out(std::cout);
+        return cat_file(filepath, false, out);
+    }
+    int ls() {
+        OutputSink out(std::cout);
+        return ls(out);
+    }
+    // the same into out, e.g. straight to a file descriptor (sink.h)
+    int cat(std::string_view filepath, OutputSink &out) { return cat_file(filepath, false, out); }
+    int ls(OutputSink &out);
 
-    int cp(std::string sourcepath, std::string destpath);
-    int mv(std::string sourcepath, std::string destpath);
-    int rm(std::string filepath);
-    int append(std::string filepath1, std::string filepath2);
+    int cp(std::string_view sourcepath, std::string_view destpath, bool reflink = false) {
+        return cp_file(sourcepath, destpath, reflink, false);
+    }
+    // cat and cp with many block transfers in flight at once (aio.h)
+    int cat_async(std::string_view filepath) {
+        OutputSink out(std::cout);
+        return cat_file(filepath, true, out);
+    }
+    int cp_async(std::string_view sourcepath, std::string_view destpath) {
+        return cp_file(sourcepath, destpath, false, true);
+    }
+    int mv(std::string_view sourcepath, std::string_view destpath);
+    int rm(std::string_view filepath);
+    int append(std::string_view filepath1, std::string_view filepath2);
 
-    int mkdir(std::string dirpath);
-    int cd(std::string dirpath);
+    int mkdir(std::string_view dirpath);
+    int cd(std::string_view dirpath);
     int pwd();
-    int chmod(std::string accessrights, std::string filepath);
+    int chmod(std::string_view accessrights, std::string_view filepath);
+    // keep a file's data compressed on the disk, or plain again (see
+    // ZGROUP_BLOCKS); inline and empty files are left as they are
+    int compress(std::string_view filepath, bool on);
+
+    // Copy the tree under a host directory into fsdir, which is made if it
+    // is missing, or the tree under fsdir out to a host directory. Files
+    // that exist already are left alone on import and overwritten on
+    // export; symbolic links and special files are skipped. -1 if anything
+    // was not copied.
+    int import_tree(std::string_view hostdir, std::string_view fsdir);
+    int export_tree(std::string_view fsdir, std::string_view hostdir);
+
+    // Whole trees (tree.cpp). rm_tree removes a file, or a directory and
+    // everything below it, in one transaction. cp_tree copies a directory
+    // tree the same way, the file data on worker threads, and a file as cp
+    // does. du prints the bytes, blocks, files and directories below a
+    // directory; find prints the paths below it whose last name matches
+    // pattern (fnmatch(3); every path if it is empty), sorted.
+    int rm_tree(std::string_view path);
+    int cp_tree(std::string_view sourcepath, std::string_view destpath, bool reflink = false);
+    int du(std::string_view dirpath) {
+        OutputSink out(std::cout);
+        return du(dirpath, out);
+    }
+    int find(std::string_view dirpath, std::string_view pattern) {
+        OutputSink out(std::cout);
+        return find(dirpath, pattern, out);
+    }
+    int du(std::string_view dirpath, OutputSink &out);
+    int find(std::string_view dirpath, std::string_view pattern, OutputSink &out);
+
+    // Random access (file.cpp). open() returns a handle >= 0, or -1; the
+    // calls below return -1 for a handle that is not open or lacks the
+    // access. A handle is used by one thread at a time.
+    int open(std::string_view filepath, int flags);
+    int close(int fd);
+    // up to n bytes at off, without moving the position; the count or -1
+    ssize_t pread(int fd, void *buf, size_t n, uint64_t off);
+    // writing past the end fills the gap with zeros
+    ssize_t pwrite(int fd, const void *buf, size_t n, uint64_t off);
+    // at the position, which moves past the bytes transferred
+    ssize_t read(int fd, void *buf, size_t n);
+    ssize_t write(int fd, const void *buf, size_t n);
+    // whence is SEEK_SET, SEEK_CUR or SEEK_END; the new position or -1
+    int64_t lseek(int fd, int64_t off, int whence);
+    // new bytes read as zeros. Growing a file only reserves its new blocks,
+    // flagged unwritten in the FAT, and writes none of them.
+    int truncate(int fd, uint64_t size);
+    // reserve the blocks for bytes [off, off + len) the same way, growing
+    // the file to off + len if it is shorter; never shrinks it
+    int fallocate(int fd, uint64_t off, uint64_t len);
+
+    // flush all cached writes to the disk file
+    int sync();
+    const BlockCache::Stats &cache_stats() const { return disk.cache_stats(); }
+    DentryCache::Stats dcache_stats() const { return dcache.stats(); }
+    DirNamesCache::Stats dnames_stats() const { return dnames.stats(); }
+    // the calling thread works in session s from now on (nullptr: the FS's
+    // own session); each session has its own working directory
+    void attach(Session *s) { attached = s; }
 
-    bool is_directory(uint16_t dir_block);
-    uint16_t get_parent_directory(uint16_t dir_block);
+    bool is_directory(uint32_t dir_block);
+    uint32_t get_parent_directory(uint32_t dir_block);
 };
 
 #endif
\ No newline at end of file
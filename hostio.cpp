@@ -0,0 +1,324 @@
+// hostio.cpp: directory trees copied between the host and the disk
+#include "fs.h"
+#include "workers.h"
+#include <cerrno>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Both directions go one directory at a time, breadth first, and list a
+// directory before any data moves, so every file's size is known up front.
+// Import reserves each file's whole chain from that size (none for files
+// small enough to be inline), lets worker threads stream the host files
+// into their chains or buffers and then adds the entries, one transaction
+// per IMPORT_BATCH bytes of files. Export has the
+// workers read the chains straight into host files while the directory is
+// held shared. Directories, the FAT's writer side and the transaction are
+// only ever used from the calling thread.
+
+struct FS::HostFile {
+    std::string name;            // of the entry
+    std::string path;            // on the host
+    uint64_t size = 0;
+    uint8_t rights = 0;
+    int32_t first = -1;          // chain, -1 if it has none
+    std::vector<uint32_t> blocks{};
+    bool small = false;          // inline, read into data
+    bool packed = false;         // compressed, decoded on the way out
+    std::vector<uint8_t> data{};
+    bool ok = false;
+};
+
+namespace {
+
+namespace fsys = std::filesystem;
+
+// access rights from the owner's permission bits and back
+uint8_t rights_of(fsys::perms p) {
+    using fsys::perms;
+    return ((p & perms::owner_read) != perms::none ? READ : 0) |
+           ((p & perms::owner_write) != perms::none ? WRITE : 0) |
+           ((p & perms::owner_exec) != perms::none ? EXECUTE : 0);
+}
+
+mode_t mode_of(uint8_t rights) {
+    return (rights & READ ? 0444 : 0) | (rights & WRITE ? 0222 : 0) | (rights & EXECUTE ? 0111 : 0);
+}
+
+ssize_t pread_full(int fd, uint8_t *buf, size_t n, uint64_t off) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = ::pread(fd, buf + got, n - got, off + got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        got += r;
+    }
+    return got;
+}
+
+} // namespace
+
+std::vector<int> FS::import_dirs(uint32_t parent, const std::vector<std::string> &names) {
+    DirGuard g(*this);
+    MetaOp op(*this);
+    g.lock(parent);
+    std::vector<int> blks;
+    for (const std::string &name : names) {
+        dir_entry e; DirLoc loc;
+        if (dir_find(parent, name, loc, &e) == 0)
+            blks.push_back(e.type == TYPE_DIR ? (int)e.first_blk : -1);
+        else
+            blks.push_back(dir_create(parent, name));
+    }
+    return blks;
+}
+
+int FS::import_files(uint32_t dir, std::vector<HostFile> &files) {
+    DirGuard g(*this);
+    MetaOp op(*this);
+    g.lock(dir);
+    int failed = 0;
+    for (HostFile &f : files) {
+        DirLoc loc;
+        if (dir_find(dir, f.name, loc) == 0) {
+            std::cout << "Error: " << f.path << " not imported, " << f.name << " exists\n";
+            ++failed;
+            continue;
+        }
+        if (f.size <= INLINE_MAX) {
+            f.small = true;
+            f.data.resize(f.size);
+            continue;
+        }
+        f.first = alloc_chain(std::max<size_t>(1, blocks_for(f.size)));
+        if (f.first < 0) {
+            std::cout << "Error: " << f.path << " not imported, disk full\n";
+            ++failed;
+            continue;
+        }
+        for (int32_t b = f.first; b != FAT_EOF; b = fat[b]) f.blocks.push_back(b);
+    }
+
+    uint64_t bytes = 0;
+    for (const HostFile &f : files) bytes += f.size;
+    parallel_for(files.size(), workers_for(files.size(), bytes), [&](size_t i) {
+        HostFile &f = files[i];
+        if (f.first < 0 && !f.small) return;
+        int fd = ::open(f.path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        if (f.small) {
+            f.ok = pread_full(fd, f.data.data(), f.size, 0) == (ssize_t)f.size;
+            ::close(fd);
+            return;
+        }
+        // IO_BATCH blocks at a time, the last one zero padded
+        std::vector<uint8_t> buf(std::min<size_t>(IO_BATCH, blocks_for(f.size)) * BLOCK_SIZE);
+        BlockWrite ios[IO_BATCH];
+        bool ok = true;
+        for (size_t b = 0; ok && (uint64_t)b * BLOCK_SIZE < f.size; b += IO_BATCH) {
+            uint64_t off = (uint64_t)b * BLOCK_SIZE;
+            size_t n = std::min<size_t>(IO_BATCH, f.blocks.size() - b);
+            size_t want = std::min<uint64_t>(n * BLOCK_SIZE, f.size - off);
+            // a file that shrank since it was listed fails
+            ok = pread_full(fd, buf.data(), want, off) == (ssize_t)want;
+            std::memset(buf.data() + want, 0, n * BLOCK_SIZE - want);
+            for (size_t k = 0; k < n; ++k) ios[k] = {f.blocks[b + k], buf.data() + k * BLOCK_SIZE};
+            ok = ok && disk.writev(ios, n) == 0;
+        }
+        ::close(fd);
+        f.ok = ok;
+    });
+
+    for (HostFile &f : files) {
+        if (f.first < 0 && !f.small) continue;
+        dir_entry e = {};
+        set_entry_name(e, f.name);
+        e.size = f.size;
+        e.first_blk = f.small ? FAT_EOF : f.first;
+        e.type = TYPE_FILE;
+        e.access_rights = f.rights;
+        e.flags = f.small ? ENTRY_INLINE : 0;
+        if (!f.ok) std::cout << "Error: " << f.path << " could not be read\n";
+        if (!f.ok || dir_add(dir, e, nullptr, f.data.data()) != 0) {
+            free_chain(f.first);
+            ++failed;
+        }
+    }
+    return failed;
+}
+
+int FS::import_tree(std::string_view hostdir, std::string_view fsdir) {
+    OpTimer timer(OP_IMPORT);
+    std::error_code ec;
+    if (!fsys::is_directory(fsys::path(hostdir), ec)) {
+        std::cout << "Error: No such host directory: " << hostdir << std::endl;
+        return -1;
+    }
+    int top;
+    {
+        DirGuard g(*this);
+        MetaOp op(*this);
+        uint32_t parent; std::string_view name;
+        if (resolve_path(fsdir, parent, name) != 0) {
+            std::cout << "Error: Directory not found: " << fsdir << std::endl;
+            return -1;
+        }
+        if (name.length() > MAX_NAME_LEN) {
+            std::cout << "Error: Directory name too long (max " << MAX_NAME_LEN << " characters)\n";
+            return -1;
+        }
+        if (name.empty() || name == ".") top = parent;
+        else if (name == "..") top = get_parent_directory(parent);
+        else top = import_dirs(parent, {std::string(name)})[0];
+    }
+    if (top < 0) {
+        std::cout << "Error: Cannot make directory " << fsdir << std::endl;
+        return -1;
+    }
+
+    int failed = 0;
+    std::vector<std::pair<fsys::path, uint32_t>> todo = {{fsys::path(hostdir), top}};
+    for (size_t t = 0; t < todo.size(); ++t) {
+        fsys::path from = todo[t].first;
+        uint32_t dir = todo[t].second;
+        std::vector<HostFile> files;
+        std::vector<std::string> subdirs;
+        std::vector<fsys::path> subpaths;
+        uint64_t batch = 0;
+        for (fsys::directory_iterator it(from, ec), end; !ec && it != end; it.increment(ec)) {
+            std::string name = it->path().filename().string();
+            // symbolic links are skipped, so the walk cannot loop
+            std::error_code fec;
+            fsys::file_status st = it->symlink_status(fec);
+            if (fec || !(fsys::is_regular_file(st) || fsys::is_directory(st))) continue;
+            if (name.length() > MAX_NAME_LEN) {
+                std::cout << "Error: " << it->path().string() << " not imported, name too long\n";
+                ++failed;
+                continue;
+            }
+            if (fsys::is_directory(st)) {
+                subdirs.push_back(name);
+                subpaths.push_back(it->path());
+                continue;
+            }
+            uint64_t size = it->file_size(fec);
+            if (fec || size > UINT32_MAX) {
+                std::cout << "Error: " << it->path().string() << " not imported, too large\n";
+                ++failed;
+                continue;
+            }
+            files.push_back({name, it->path().string(), size, rights_of(st.permissions())});
+            batch += size;
+            if (batch >= IMPORT_BATCH) {
+                failed += import_files(dir, files);
+                files.clear();
+                batch = 0;
+            }
+        }
+        if (ec) {
+            std::cout << "Error: Cannot read host directory " << from.string() << std::endl;
+            ++failed;
+        }
+        if (!files.empty()) failed += import_files(dir, files);
+
+        std::vector<int> blks = subdirs.empty() ? std::vector<int>() : import_dirs(dir, subdirs);
+        for (size_t i = 0; i < blks.size(); ++i) {
+            if (blks[i] < 0) {
+                std::cout << "Error: " << subpaths[i].string() << " not imported, "
+                          << subdirs[i] << " is not a directory\n";
+                ++failed;
+            } else {
+                todo.push_back({subpaths[i], (uint32_t)blks[i]});
+            }
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+int FS::export_tree(std::string_view fsdir, std::string_view hostdir) {
+    OpTimer timer(OP_EXPORT);
+    int top = find_dir(fsdir);
+    if (top < 0) {
+        std::cout << "Error: Directory not found: " << fsdir << std::endl;
+        return -1;
+    }
+
+    int failed = 0;
+    std::vector<std::pair<uint32_t, fsys::path>> todo = {{(uint32_t)top, fsys::path(hostdir)}};
+    for (size_t t = 0; t < todo.size(); ++t) {
+        uint32_t dir = todo[t].first;
+        fsys::path to = todo[t].second;
+        std::error_code ec;
+        fsys::create_directories(to, ec);
+        if (ec) {
+            std::cout << "Error: Cannot make host directory " << to.string() << std::endl;
+            ++failed;
+            continue;
+        }
+        // writers keep off the directory, and so off its files' chains,
+        // until the files are out
+        DirGuard g(*this);
+        g.enter(dir);
+        if (!is_directory(dir)) continue;    // removed since it was listed
+        std::vector<HostFile> files;
+        DirIter it = dir_begin(dir);
+        dir_entry e;
+        DirLoc loc;
+        while (dir_next(it, e, &loc) == 1) {
+            std::string_view name = entry_name(e);
+            if (name == "." || name == "..") continue;
+            fsys::path path = to / std::string(name);
+            if (e.type == TYPE_DIR) {
+                todo.push_back({e.first_blk, path});
+            } else if (!(e.access_rights & READ)) {
+                std::cout << "Error: Permission denied (no read access) on " << name << std::endl;
+                ++failed;
+            } else {
+                files.push_back({std::string(name), path.string(), e.size, e.access_rights, (int32_t)e.first_blk});
+                HostFile &f = files.back();
+                f.small = is_inline(e);
+                f.packed = is_compressed(e);
+                f.data.resize(f.small ? e.size : 0);
+                if (f.small && dir_inline(loc, e, f.data.data()) != 0) {
+                    std::cout << "Error: Cannot read " << name << std::endl;
+                    files.pop_back();
+                    ++failed;
+                }
+            }
+        }
+
+        uint64_t bytes = 0;
+        for (const HostFile &f : files) bytes += f.size;
+        parallel_for(files.size(), workers_for(files.size(), bytes), [&](size_t i) {
+            HostFile &f = files[i];
+            int fd = ::open(f.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode_of(f.rights) | S_IWUSR);
+            if (fd < 0) return;
+            OutputSink out(fd);
+            bool ok = !f.small || f.size == 0 || out.write(f.data.data(), f.size) == 0;
+            if (f.packed)
+                ok = unpack_range(f.first, f.size, 0, f.size, [&out](const uint8_t *p, size_t n) {
+                    return out.write(p, n);
+                }) == 0;
+            uint64_t rem = f.small || f.packed ? 0 : f.size;
+            std::vector<uint8_t> buf(std::min<size_t>(IO_BATCH, blocks_for(rem)) * BLOCK_SIZE);
+            int32_t blk = f.first;
+            while (ok && rem > 0) {
+                int n = read_chain(blk, std::min<size_t>(IO_BATCH, blocks_for(rem)), buf.data());
+                size_t k = n > 0 ? std::min<uint64_t>((uint64_t)n * BLOCK_SIZE, rem) : 0;
+                ok = n > 0 && out.write(buf.data(), k) == 0;
+                rem -= k;
+            }
+            ok = out.flush() == 0 && ok;
+            if (!(f.rights & WRITE)) ::fchmod(fd, mode_of(f.rights));
+            f.ok = ::close(fd) == 0 && ok;
+        });
+        for (HostFile &f : files) {
+            if (!f.ok) {
+                std::cout << "Error: Cannot write " << f.path << std::endl;
+                ++failed;
+            }
+        }
+    }
+    return failed ? -1 : 0;
+}
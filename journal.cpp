@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "journal.h"
+#include "stats.h"
+
+uint32_t
+Journal::checksum(const uint8_t *data, size_t len, uint32_t h)
+{
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+int
+Journal::write_header()
+{
+    uint8_t buf[BLOCK_SIZE] = {0};
+    auto *hdr = reinterpret_cast<journal_header*>(buf);
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->nblocks = nblocks;
+    hdr->seq = seq;
+    BlockWrite io{start, buf};
+    return disk.writev(&io, 1);
+}
+
+// Every group in the log has been installed in the block cache; once the
+// cache is synced to stable storage the home blocks are current and the
+// log can start over.
+// Rewriting the header with the next sequence number is enough to retire
+// the old groups.
+int
+Journal::reset()
+{
+    if (disk.sync() != 0)
+        return -1;
+    head = 0;
+    live.clear();
+    if (write_header() != 0)
+        return -1;
+    free_spill();
+    return 0;
+}
+
+void
+Journal::free_spill()
+{
+    for (unsigned b : spilled)
+        spill_free(b);
+    spilled.clear();
+}
+
+// the blocks have been handed to the disk, so readers find them there
+void
+Journal::clear_group()
+{
+    std::lock_guard<std::mutex> hold(group_lock);
+    group.clear();
+}
+
+bool
+Journal::open(unsigned start)
+{
+    active = false;
+    const uint8_t *buf = disk.view(start);
+    if (!buf)
+        return false;
+    auto *hdr = reinterpret_cast<const journal_header*>(buf);
+    if (hdr->magic != JOURNAL_MAGIC || hdr->nblocks < 3 ||
+        start + hdr->nblocks > disk.get_no_blocks())
+        return false;
+    this->start = start;
+    nblocks = hdr->nblocks;
+    seq = hdr->seq;
+    head = 0;
+    clear_group();
+    live.clear();
+    spilled.clear();
+    active = true;
+    return true;
+}
+
+int
+Journal::create(unsigned start, unsigned nblocks)
+{
+    // keep the sequence numbers rising so nothing left in the old log can
+    // be mistaken for a group of the new one
+    const uint8_t *buf = disk.view(start);
+    if (buf) {
+        auto *hdr = reinterpret_cast<const journal_header*>(buf);
+        if (hdr->magic == JOURNAL_MAGIC && hdr->seq >= seq)
+            seq = hdr->seq + 1;
+    }
+    this->start = start;
+    this->nblocks = nblocks;
+    clear_group();
+    spilled.clear();    // the free map has been rebuilt
+    active = true;
+    return reset();
+}
+
+int
+Journal::replay()
+{
+    if (!active)
+        return 0;
+    int groups = 0;
+    std::vector<uint8_t> desc_buf(BLOCK_SIZE), commit_buf(BLOCK_SIZE), spill_buf(BLOCK_SIZE), images;
+    auto *desc = reinterpret_cast<journal_desc*>(desc_buf.data());
+    auto *commit = reinterpret_cast<journal_commit*>(commit_buf.data());
+    auto *sp = reinterpret_cast<journal_spill*>(spill_buf.data());
+    const size_t max_homes = sizeof(desc->homes) / sizeof(desc->homes[0]);
+    const size_t max_spilled = sizeof(sp->images) / sizeof(sp->images[0]);
+    std::vector<uint32_t> homes;
+    unsigned pos = 0;
+    while (pos + 2 <= capacity()) {
+        if (disk.read(start + 1 + pos, desc_buf.data()) != 0)
+            return -1;
+        if (desc->magic != JDESC_MAGIC || desc->seq != seq ||
+            desc->count == 0 || desc->count > max_homes ||
+            pos + desc->count + 2 > capacity())
+            break;
+        images.resize((size_t)desc->count * BLOCK_SIZE);
+        if (disk.read_range(start + 2 + pos, desc->count, images.data()) != 0 ||
+            disk.read(start + 2 + pos + desc->count, commit_buf.data()) != 0)
+            return -1;
+        if (commit->magic != JCOMMIT_MAGIC || commit->seq != seq ||
+            commit->count < desc->count || commit->count > disk.get_no_blocks())
+            break;  // torn group: the operation never committed
+        homes.assign(desc->homes, desc->homes + desc->count);
+        uint32_t h = checksum(images.data(), images.size());
+        // the spill chain is only followed as far as the commit record
+        // counts; anything unreadable in it is a torn group as well
+        bool torn = false;
+        for (uint32_t at = desc->spill; at != 0 && !torn; at = sp->next) {
+            torn = homes.size() >= commit->count || at >= disk.get_no_blocks() ||
+                   disk.read(at, spill_buf.data()) != 0 ||
+                   sp->magic != JSPILL_MAGIC || sp->seq != seq || sp->count == 0 ||
+                   sp->count > max_spilled || homes.size() + sp->count > commit->count;
+            if (torn)
+                break;
+            h = checksum(spill_buf.data(), BLOCK_SIZE, h);
+            size_t base = images.size();
+            images.resize(base + (size_t)sp->count * BLOCK_SIZE);
+            for (uint32_t i = 0; i < sp->count && !torn; ++i) {
+                uint8_t *img = &images[base + (size_t)i * BLOCK_SIZE];
+                torn = sp->images[i].at >= disk.get_no_blocks() || disk.read(sp->images[i].at, img) != 0;
+                h = checksum(img, BLOCK_SIZE, h);
+                homes.push_back(sp->images[i].home);
+            }
+        }
+        if (torn || homes.size() != commit->count || commit->checksum != h)
+            break;
+        for (size_t i = 0; i < homes.size(); ++i) {
+            if (homes[i] >= disk.get_no_blocks())
+                return -1;
+            if (disk.write(homes[i], &images[i * BLOCK_SIZE]) != 0)
+                return -1;
+        }
+        pos += desc->count + 2;
+        ++seq;
+        ++groups;
+    }
+    if (reset() != 0)
+        return -1;
+    return groups;
+}
+
+void
+Journal::add(unsigned home, const uint8_t *blk)
+{
+    std::lock_guard<std::mutex> hold(group_lock);
+    std::memcpy(group[home].data(), blk, BLOCK_SIZE);
+}
+
+const uint8_t *
+Journal::find(unsigned home) const
+{
+    auto it = group.find(home);
+    return it == group.end() ? nullptr : it->second.data();
+}
+
+bool
+Journal::copy(unsigned home, uint8_t *buf) const
+{
+    std::lock_guard<std::mutex> hold(group_lock);
+    auto it = group.find(home);
+    if (it == group.end())
+        return false;
+    std::memcpy(buf, it->second.data(), BLOCK_SIZE);
+    return true;
+}
+
+// The group goes to the log as one sequential run: descriptor, images,
+// commit record. What does not fit behind an empty log goes to spill
+// blocks, written along with the run and covered by the same commit
+// record, so a group of any size is replayed whole or not at all. Its
+// blocks are handed to the block cache only once all of it is on stable
+// storage, so no home block can reach the disk file ahead of its journal
+// copy.
+int
+Journal::flush()
+{
+    if (group.empty())
+        return 0;
+    size_t n = group.size();
+    if (head + n + 2 > capacity() && reset() != 0)
+        return -1;
+
+    // each spill descriptor is followed by the blocks of its images
+    const size_t per_spill = sizeof(journal_spill::images) / sizeof(journal_spill::images[0]);
+    size_t in_log = std::min<size_t>(n, capacity() - 2);
+    size_t rest = n - in_log;
+    size_t nspill = (rest + per_spill - 1) / per_spill;
+    std::vector<unsigned> blocks;
+    if (rest > 0 && spill_alloc(rest + nspill, blocks) != 0)
+        return -1;
+
+    std::vector<uint8_t> desc_buf(BLOCK_SIZE, 0), commit_buf(BLOCK_SIZE, 0);
+    std::vector<uint8_t> spill_bufs(nspill * BLOCK_SIZE, 0);
+    auto *desc = reinterpret_cast<journal_desc*>(desc_buf.data());
+    auto *commit = reinterpret_cast<journal_commit*>(commit_buf.data());
+    desc->magic = JDESC_MAGIC;
+    desc->count = in_log;
+    desc->seq = seq;
+    desc->spill = nspill ? blocks[0] : 0;
+    commit->magic = JCOMMIT_MAGIC;
+    commit->count = n;
+    commit->seq = seq;
+
+    std::vector<BlockWrite> ios;
+    ios.reserve(n + nspill + 2);
+    unsigned pos = start + 1 + head;
+    ios.push_back({pos++, desc_buf.data()});
+    uint32_t h = FNV_BASIS;
+    auto g = group.cbegin();
+    for (size_t i = 0; i < in_log; ++i, ++g) {
+        desc->homes[i] = g->first;
+        ios.push_back({pos++, g->second.data()});
+        h = checksum(g->second.data(), BLOCK_SIZE, h);
+    }
+    for (size_t k = 0; k < nspill; ++k) {
+        auto *sp = reinterpret_cast<journal_spill*>(&spill_bufs[k * BLOCK_SIZE]);
+        size_t base = k * (per_spill + 1);
+        size_t count = std::min(per_spill, rest - k * per_spill);
+        sp->magic = JSPILL_MAGIC;
+        sp->count = count;
+        sp->seq = seq;
+        sp->next = k + 1 < nspill ? blocks[base + per_spill + 1] : 0;
+        auto first = g;
+        for (size_t i = 0; i < count; ++i, ++g)
+            sp->images[i] = {g->first, blocks[base + 1 + i]};
+        ios.push_back({blocks[base], &spill_bufs[k * BLOCK_SIZE]});
+        h = checksum(&spill_bufs[k * BLOCK_SIZE], BLOCK_SIZE, h);
+        for (size_t i = 0; i < count; ++i, ++first) {
+            ios.push_back({blocks[base + 1 + i], first->second.data()});
+            h = checksum(first->second.data(), BLOCK_SIZE, h);
+        }
+    }
+    commit->checksum = h;
+    ios.push_back({pos++, commit_buf.data()});
+    if (disk.writev(ios.data(), ios.size()) != 0 || disk.barrier() != 0) {
+        for (unsigned x : blocks)
+            spill_free(x);
+        return -1;
+    }
+    stat_add(STAT_JOURNAL_GROUPS);
+    TRACE("journal_group", seq, n);
+
+    spilled.insert(spilled.end(), blocks.begin(), blocks.end());
+    for (auto &b : group) {
+        if (disk.write(b.first, b.second.data()) != 0)
+            return -1;
+        live.insert(b.first);
+    }
+    head += in_log + 2;
+    ++seq;
+    clear_group();
+    return 0;
+}
+
+int
+Journal::checkpoint()
+{
+    if (!active)
+        return 0;
+    if (flush() != 0)
+        return -1;
+    return reset();
+}
@@ -0,0 +1,124 @@
+#include <cstdint>
+#include <map>
+#include <array>
+#include <unordered_set>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include "disk.h"
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#define JOURNAL_MAGIC 0x4C4E524A   // "JRNL", journal header
+#define JDESC_MAGIC   0x4353444A   // "JDSC", start of a group
+#define JCOMMIT_MAGIC 0x4D4D434A   // "JCMM", end of a group
+#define JSPILL_MAGIC  0x4C50534A   // "JSPL", images kept outside the log
+#define FNV_BASIS 2166136261u
+
+// First block of the journal area. seq is the sequence number the first
+// group in the log must carry; older groups left behind are ignored.
+struct journal_header {
+    uint32_t magic;
+    uint32_t nblocks;
+    uint64_t seq;
+};
+
+// Group descriptor, followed by one image block per home block. A group
+// too big for the log keeps the rest of its images in spill blocks
+// outside it, listed by a chain of spill descriptors.
+struct journal_desc {
+    uint32_t magic;
+    uint32_t count;             // images in the log
+    uint64_t seq;
+    uint32_t homes[(BLOCK_SIZE - 20) / sizeof(uint32_t)];
+    uint32_t spill;             // first spill descriptor, 0 if none
+};
+
+// Spill descriptor: the home block of each image and the block it was
+// written to.
+struct journal_spill {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t seq;
+    uint32_t next;              // next spill descriptor, 0 if none
+    uint32_t pad;
+    struct { uint32_t home, at; } images[(BLOCK_SIZE - 24) / 8];
+};
+
+// Commit record; a group only counts once this block is intact.
+struct journal_commit {
+    uint32_t magic;
+    uint32_t count;             // images in the log and spilled
+    uint64_t seq;
+    uint32_t checksum;          // over the images, then each spill
+                                // descriptor and its images
+};
+
+// Write-ahead journal for metadata blocks. Operations add their blocks to
+// a running group; flush() appends the group to the log sequentially and
+// only then installs the blocks at their home locations, so after a crash
+// replay() can redo every group whose commit record made it to the disk.
+// Spill blocks come from the file system: they must be free both now and
+// in what is on the disk, and they are handed back once the log is reset.
+class Journal {
+public:
+    // appends n spill blocks to blocks; -1 if there are not that many
+    using SpillAlloc = std::function<int(size_t n, std::vector<unsigned> &blocks)>;
+    using SpillFree = std::function<void(unsigned)>;
+
+private:
+    Disk &disk;
+    SpillAlloc spill_alloc;
+    SpillFree spill_free;
+    unsigned start = 0;          // header block
+    unsigned nblocks = 0;        // including the header
+    bool active = false;
+    uint64_t seq = 1;            // sequence number of the next group
+    unsigned head = 0;           // log blocks in use after the header
+    std::map<unsigned, BlockBuf> group; // running group
+    mutable std::mutex group_lock;      // readers may copy() while one writer
+                                        // adds to or flushes the group
+    std::unordered_set<unsigned> live; // home blocks with images in the log
+    std::vector<unsigned> spilled;     // spill blocks of the groups in the log
+
+    unsigned capacity() const { return nblocks - 1; }
+    // FNV-1a; chains across calls by passing the previous result as h
+    static uint32_t checksum(const uint8_t *data, size_t len, uint32_t h = FNV_BASIS);
+    int write_header();
+    void clear_group();
+    // make the log empty: home blocks are synced first
+    int reset();
+    void free_spill();
+
+public:
+    Journal(Disk &disk, SpillAlloc alloc, SpillFree release)
+        : disk(disk), spill_alloc(std::move(alloc)), spill_free(std::move(release)) { }
+
+    // looks for a journal header at block start; false if there is none
+    bool open(unsigned start);
+    // lays out an empty journal of nblocks blocks starting at block start
+    int create(unsigned start, unsigned nblocks);
+    bool enabled() const { return active; }
+    // re-applies every committed group and empties the log; returns the
+    // number of groups replayed or -1 on error
+    int replay();
+    // adds one metadata block to the running group
+    void add(unsigned home, const uint8_t *blk);
+    // newest copy of home that has not been installed yet, or nullptr;
+    // only for the thread that adds to the group
+    const uint8_t *find(unsigned home) const;
+    // same as find() for any thread: copies the image into buf
+    bool copy(unsigned home, uint8_t *buf) const;
+    // true while an image of home could still be replayed; such a block
+    // must not be reused for file data
+    bool logged(unsigned home) const { return group.count(home) || live.count(home); }
+    size_t pending() const { return group.size(); }
+    // group commit: log the running group and install its blocks; a group
+    // of any size commits as a whole
+    int flush();
+    // flush, sync the home blocks and empty the log (clean unmount)
+    int checkpoint();
+};
+
+#endif // __JOURNAL_H__
@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cstring>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5   // a block ends in at least this many literals
+#define LZ_MFLIMIT 12        // and its last match starts this far from the end
+#define LZ_HASH_BITS 12
+#define LZ_SKIP 6            // misses in a row before the scan speeds up
+
+namespace {
+
+uint32_t
+load32(const uint8_t *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+unsigned
+hash4(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+void
+put_len(uint8_t *&op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+}
+
+int
+get_len(const uint8_t *&ip, const uint8_t *end, size_t &len)
+{
+    uint8_t b;
+    do {
+        if (ip == end)
+            return -1;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// one sequence: nlit literals, then a match of mlen bytes off back (none
+// if mlen is 0); false if it does not fit before end
+bool
+put_seq(uint8_t *&op, const uint8_t *end, const uint8_t *lit, size_t nlit, size_t off, size_t mlen)
+{
+    size_t need = 1 + nlit + nlit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+    if (need > (size_t)(end - op))
+        return false;
+    size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    *op++ = std::min<size_t>(nlit, 15) << 4 | std::min<size_t>(ml, 15);
+    if (nlit >= 15)
+        put_len(op, nlit - 15);
+    std::memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen) {
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        if (ml >= 15)
+            put_len(op, ml - 15);
+    }
+    return true;
+}
+
+} // namespace
+
+size_t
+lz_compress(const uint8_t *in, size_t n, uint8_t *out)
+{
+    uint8_t *op = out;
+    const uint8_t *oend = out + n;
+    const uint8_t *ip = in, *anchor = in, *iend = in + n;
+    if (n > LZ_MFLIMIT) {
+        // offsets into in; a stale or empty slot fails the compare below
+        uint32_t table[1 << LZ_HASH_BITS] = {};
+        const uint8_t *mflimit = iend - LZ_MFLIMIT;
+        const uint8_t *mlimit = iend - LZ_LAST_LITERALS;
+        unsigned misses = 0;
+        while (ip < mflimit) {
+            uint32_t seq = load32(ip);
+            unsigned h = hash4(seq);
+            const uint8_t *ref = in + table[h];
+            table[h] = ip - in;
+            if (ref >= ip || ip - ref > LZ_WINDOW || load32(ref) != seq) {
+                ip += 1 + (misses++ >> LZ_SKIP);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            const uint8_t *mp = ip + LZ_MIN_MATCH, *rp = ref + LZ_MIN_MATCH;
+            while (mp < mlimit && *mp == *rp) {
+                ++mp;
+                ++rp;
+            }
+            if (!put_seq(op, oend, anchor, ip - anchor, ip - ref, mp - ip))
+                return 0;
+            ip = anchor = mp;
+        }
+    }
+    if (!put_seq(op, oend, anchor, iend - anchor, 0, 0) || op == oend)
+        return 0;
+    return op - out;
+}
+
+int
+lz_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t want)
+{
+    const uint8_t *ip = in, *iend = in + n;
+    uint8_t *op = out, *oend = out + want;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_len(ip, iend, nlit) != 0)
+            return -1;
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+            return -1;
+        std::memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend)
+            break;                       // the last sequence has no match
+        if (iend - ip < 2)
+            return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_len(ip, iend, mlen) != 0)
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - out) || mlen > (size_t)(oend - op))
+            return -1;
+        const uint8_t *ref = op - off;
+        if (off >= mlen) {
+            std::memcpy(op, ref, mlen);
+        } else {
+            // the match overlaps what it writes, repeating its first off bytes
+            for (size_t i = 0; i < mlen; ++i)
+                op[i] = ref[i];
+        }
+        op += mlen;
+    }
+    return op == oend ? 0 : -1;
+}
@@ -0,0 +1,21 @@
+#include <cstddef>
+#include <cstdint>
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+// A block codec in the LZ4 block format: a token of literal and match
+// lengths (4 bits each, extended by bytes of 255), the literals, then a
+// 16-bit little-endian offset back into the output. Compression is one
+// greedy pass with a table of recent 4-byte sequences, so it trades some
+// ratio for speed; matches reach back at most LZ_WINDOW bytes.
+#define LZ_WINDOW 65535
+
+// the compressed size, or 0 if in does not shrink to fewer than n bytes
+// (out needs room for n bytes)
+size_t lz_compress(const uint8_t *in, size_t n, uint8_t *out);
+// decode n bytes of in into exactly want bytes at out; -1 if in is
+// damaged or does not decode to want bytes
+int lz_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t want);
+
+#endif // __LZ_H__
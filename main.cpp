@@ -1,10 +1,14 @@
 #include "shell.h"
 #include "fs.h"
 #include "disk.h"
+#include "batch.h"
 
 int
 main(int argc, char **argv)
 {
+    // with options: run a script or serve a socket (batch.h)
+    if (argc > 1)
+        return batch_main(argc, argv);
     Shell shell;
     shell.run();
     return 0;
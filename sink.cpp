@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "sink.h"
+
+OutputSink::OutputSink(std::ostream &out)
+  : os(&out), own(new char[SINK_BUF]), buf(own.get()), cap(SINK_BUF), to_memory(false)
+{
+}
+
+OutputSink::OutputSink(int fd)
+  : fd(fd), own(new char[SINK_BUF]), buf(own.get()), cap(SINK_BUF), to_memory(false)
+{
+}
+
+OutputSink::OutputSink(char *mem, size_t size)
+  : buf(mem), cap(size), to_memory(true)
+{
+}
+
+// n bytes to the stream or descriptor, looping over short writes
+int
+OutputSink::drain(const char *p, size_t n)
+{
+    if (failed)
+        return -1;
+    if (os) {
+        os->write(p, n);
+        if (!os->good())
+            failed = true;
+        return failed ? -1 : 0;
+    }
+    while (n > 0) {
+        ssize_t k = ::write(fd, p, n);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0) {
+            failed = true;
+            return -1;
+        }
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+int
+OutputSink::flush()
+{
+    if (to_memory || len == 0)
+        return failed ? -1 : 0;
+    int rc = drain(buf, len);
+    len = 0;
+    return rc;
+}
+
+char *
+OutputSink::reserve(size_t n)
+{
+    if (cap - len < n && (to_memory || flush() != 0 || n > cap)) {
+        failed = true;
+        return nullptr;
+    }
+    return buf + len;
+}
+
+int
+OutputSink::write(const void *p, size_t n)
+{
+    if (!to_memory && n >= cap / 2) {
+        if (flush() != 0)
+            return -1;
+        return drain(static_cast<const char*>(p), n);
+    }
+    char *dst = reserve(n);
+    if (!dst)
+        return -1;
+    std::memcpy(dst, p, n);
+    commit(n);
+    return 0;
+}
+
+int
+OutputSink::writev(const iovec *iov, size_t n)
+{
+    if (fd < 0) {
+        for (size_t i = 0; i < n; ++i)
+            if (write(iov[i].iov_base, iov[i].iov_len) != 0)
+                return -1;
+        return 0;
+    }
+    if (flush() != 0)
+        return -1;
+    // a short writev() ends anywhere, so the rest is resubmitted from there
+    std::vector<iovec> left(iov, iov + n);
+    iovec *v = left.data();
+    size_t count = n;
+    while (count > 0) {
+        ssize_t k = ::writev(fd, v, std::min<size_t>(count, IOV_MAX));
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0) {
+            failed = true;
+            return -1;
+        }
+        while (count > 0 && (size_t)k >= v->iov_len) {
+            k -= v->iov_len;
+            ++v;
+            --count;
+        }
+        if (count > 0) {
+            v->iov_base = static_cast<char*>(v->iov_base) + k;
+            v->iov_len -= k;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+#include <string_view>
+
+#ifndef __SINK_H__
+#define __SINK_H__
+
+#define SINK_BUF 65536      // staging buffer of stream and fd sinks
+
+struct iovec;
+
+// Where cat and ls put their output. Small pieces are gathered in a
+// staging buffer and handed on SINK_BUF bytes at a time; pieces of half
+// the buffer or more skip it. A sink writes to a std::ostream, to a file
+// descriptor (with write / writev, bypassing iostreams altogether), or
+// into a buffer of the caller's, which then holds everything written.
+class OutputSink {
+    std::ostream *os = nullptr;
+    int fd = -1;
+    std::unique_ptr<char[]> own;
+    char *buf;
+    size_t cap;
+    size_t len = 0;                  // bytes in buf
+    bool to_memory;
+    bool failed = false;
+
+    int drain(const char *p, size_t n);
+
+public:
+    explicit OutputSink(std::ostream &out);
+    explicit OutputSink(int fd);
+    // output goes to mem; what does not fit is dropped and the sink fails
+    OutputSink(char *mem, size_t size);
+    ~OutputSink() { flush(); }
+    OutputSink(const OutputSink &) = delete;
+    OutputSink &operator=(const OutputSink &) = delete;
+
+    // room for n more bytes, to be filled in and then passed to commit();
+    // nullptr if there is none. n must not exceed SINK_BUF.
+    char *reserve(size_t n);
+    void commit(size_t n) { len += n; }
+    int write(const void *p, size_t n);
+    int write(std::string_view s) { return write(s.data(), s.size()); }
+    // n pieces in order; an fd sink passes them to writev() as they are
+    int writev(const iovec *iov, size_t n);
+    // hands on whatever is staged (a memory sink keeps it)
+    int flush();
+    // bytes held by a memory sink
+    size_t size() const { return to_memory ? len : 0; }
+    bool ok() const { return !failed; }
+};
+
+#endif // __SINK_H__
@@ -0,0 +1,120 @@
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include "stats.h"
+
+#ifdef FS_TRACE
+std::atomic<TraceFn> trace_hook{nullptr};
+#endif
+
+namespace {
+
+struct Registry {
+    std::mutex lock;
+    std::vector<StatShard*> live;
+    uint64_t retired[STAT_SLOTS] = {};   // shards of threads that have exited
+    uint64_t base[STAT_SLOTS] = {};      // totals at the last stats_reset()
+};
+
+// a function-local static, so that it exists before the first shard
+Registry &registry()
+{
+    static Registry r;
+    return r;
+}
+
+void
+totals(Registry &r, uint64_t *out)
+{
+    std::copy(r.retired, r.retired + STAT_SLOTS, out);
+    for (StatShard *s : r.live)
+        for (unsigned i = 0; i < STAT_SLOTS; ++i)
+            out[i] += s->v[i].load(std::memory_order_relaxed);
+}
+
+const char *const counter_names[STAT_COUNTERS] = {
+    "blocks_read", "blocks_written", "cache_hits", "cache_misses",
+    "fat_lookups", "fat_loads", "journal_groups",
+};
+
+const char *const op_names[STAT_OPS] = {
+    "format", "create", "cat", "ls", "cp", "mv", "rm", "append",
+    "mkdir", "cd", "pwd", "chmod", "open", "pread", "pwrite",
+    "truncate", "fallocate", "sync", "import", "export", "du", "find",
+    "compress",
+};
+
+} // namespace
+
+StatShard::StatShard()
+{
+    Registry &r = registry();
+    std::lock_guard<std::mutex> hold(r.lock);
+    r.live.push_back(this);
+}
+
+StatShard::~StatShard()
+{
+    Registry &r = registry();
+    std::lock_guard<std::mutex> hold(r.lock);
+    for (unsigned i = 0; i < STAT_SLOTS; ++i)
+        r.retired[i] += v[i].load(std::memory_order_relaxed);
+    r.live.erase(std::find(r.live.begin(), r.live.end(), this));
+}
+
+StatsSnapshot
+stats_snapshot()
+{
+    Registry &r = registry();
+    uint64_t t[STAT_SLOTS];
+    {
+        std::lock_guard<std::mutex> hold(r.lock);
+        totals(r, t);
+        for (unsigned i = 0; i < STAT_SLOTS; ++i)
+            t[i] -= r.base[i];
+    }
+    StatsSnapshot s;
+    std::copy(t, t + STAT_COUNTERS, s.counters);
+    std::copy(t + STAT_COUNTERS, t + STAT_COUNTERS + STAT_OPS, s.calls);
+    std::copy(t + STAT_COUNTERS + STAT_OPS, t + STAT_SLOTS, s.ns);
+    return s;
+}
+
+// only the baseline moves, so no thread's shard is written here
+void
+stats_reset()
+{
+    Registry &r = registry();
+    std::lock_guard<std::mutex> hold(r.lock);
+    totals(r, r.base);
+}
+
+const char *
+stat_name(StatCounter c)
+{
+    return counter_names[c];
+}
+
+const char *
+op_name(StatOp op)
+{
+    return op_names[op];
+}
+
+void
+stats_print(std::ostream &out, const StatsSnapshot &s)
+{
+    for (unsigned c = 0; c < STAT_COUNTERS; ++c)
+        if (s.counters[c])
+            out << std::left << std::setw(16) << counter_names[c] << s.counters[c] << "\n";
+    for (unsigned op = 0; op < STAT_OPS; ++op) {
+        if (!s.calls[op])
+            continue;
+        out << std::left << std::setw(16) << op_names[op] << s.calls[op] << " calls, "
+            << std::fixed << std::setprecision(1) << s.ns[op] / 1e3 << " us, "
+            << s.ns[op] / 1e3 / s.calls[op] << " us/call\n";
+        out.unsetf(std::ios::fixed);
+    }
+}
@@ -0,0 +1,91 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+// Process-wide counters. Each thread adds to a shard of its own with
+// relaxed loads and stores, so counting costs no atomic read-modify-write
+// and threads never contend; a snapshot sums the shards, and a thread's
+// counts are kept when it exits.
+enum StatCounter {
+    STAT_BLOCKS_READ,        // blocks moved from / to the disk file
+    STAT_BLOCKS_WRITTEN,
+    STAT_CACHE_HITS,         // block cache lookups
+    STAT_CACHE_MISSES,
+    STAT_FAT_LOOKUPS,        // FAT entries read, one per link followed
+    STAT_FAT_LOADS,          // FAT pages read from the disk
+    STAT_JOURNAL_GROUPS,     // journal groups written
+    STAT_COUNTERS
+};
+
+// FS operations counted and timed by OpTimer
+enum StatOp {
+    OP_FORMAT, OP_CREATE, OP_CAT, OP_LS, OP_CP, OP_MV, OP_RM, OP_APPEND,
+    OP_MKDIR, OP_CD, OP_PWD, OP_CHMOD, OP_OPEN, OP_PREAD, OP_PWRITE,
+    OP_TRUNCATE, OP_FALLOCATE, OP_SYNC, OP_IMPORT, OP_EXPORT, OP_DU, OP_FIND,
+    OP_COMPRESS,
+    STAT_OPS
+};
+
+#define STAT_SLOTS ((unsigned)STAT_COUNTERS + 2 * STAT_OPS)   // counters, calls, ns
+
+struct StatsSnapshot {
+    uint64_t counters[STAT_COUNTERS] = {};
+    uint64_t calls[STAT_OPS] = {};
+    uint64_t ns[STAT_OPS] = {};      // time in the operation, nested ones included
+};
+
+struct StatShard {
+    std::atomic<uint64_t> v[STAT_SLOTS] = {};
+    StatShard();
+    ~StatShard();
+    void add(unsigned slot, uint64_t n) {
+        v[slot].store(v[slot].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+inline thread_local StatShard stat_shard;
+
+inline void stat_add(StatCounter c, uint64_t n = 1) { stat_shard.add(c, n); }
+
+// counts since the last stats_reset()
+StatsSnapshot stats_snapshot();
+void stats_reset();
+const char *stat_name(StatCounter c);
+const char *op_name(StatOp op);
+// the non-zero counters and operations, one per line
+void stats_print(std::ostream &out, const StatsSnapshot &s);
+
+// Trace events for a hook to pick up, e.g. to log block traffic per
+// operation. Only built with make TRACE=1 (FS_TRACE); otherwise TRACE()
+// expands to nothing and its arguments are not evaluated.
+#ifdef FS_TRACE
+using TraceFn = void (*)(const char *event, uint64_t a, uint64_t b);
+extern std::atomic<TraceFn> trace_hook;
+#define TRACE(event, a, b) \
+    do { if (TraceFn fn_ = trace_hook.load(std::memory_order_relaxed)) fn_(event, a, b); } while (0)
+#else
+#define TRACE(event, a, b) ((void)0)
+#endif
+
+// counts a call of op and the time until the end of the scope
+class OpTimer {
+    StatOp op;
+    std::chrono::steady_clock::time_point start;
+public:
+    explicit OpTimer(StatOp op) : op(op), start(std::chrono::steady_clock::now()) {
+        TRACE("op_begin", op, 0);
+    }
+    ~OpTimer() {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        stat_shard.add((unsigned)STAT_COUNTERS + op, 1);
+        stat_shard.add((unsigned)STAT_COUNTERS + STAT_OPS + op, ns);
+        TRACE("op_end", op, ns);
+    }
+};
+
+#endif // __STATS_H__
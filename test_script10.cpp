@@ -0,0 +1,176 @@
+/******************************************************************************
+ *             File : test_script10.cpp
+ *
+ * Test program for sparse files: truncate, pwrite and fallocate leave
+ * unwritten blocks that read as zeros, append fills a reserved tail block,
+ * and cp -r copies sparse files on its worker threads. Each part is checked
+ * again on a second mount of the disk.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+#define RESERVED (BLOCK_SIZE + 1000)   // the last block is reserved, not written
+#define DATA_BYTES 5000                // too large to be kept inline
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+static std::string
+contents(FS &fs, const std::string &path)
+{
+    static std::vector<char> mem(4 << 20);
+    OutputSink out(mem.data(), mem.size());
+    if (fs.cat(path, out) != 0)
+        return "(cat failed)";
+    return std::string(mem.data(), out.size());
+}
+
+// bytes and blocks columns of du; the blocks include the directory's own
+static std::string
+usage(FS &fs, const std::string &dir)
+{
+    char mem[256];
+    OutputSink out(mem, sizeof(mem));
+    if (fs.du(dir, out) != 0)
+        return "(du failed)";
+    std::istringstream rows(std::string(mem, out.size()));
+    std::string header, path, bytes, blocks;
+    std::getline(rows, header);
+    rows >> path >> bytes >> blocks;
+    return bytes + " bytes, " + blocks + " blocks";
+}
+
+// n bytes at off, or what went wrong
+static std::string
+read_at(FS &fs, const std::string &path, size_t n, uint64_t off)
+{
+    std::string buf(n, '\0');
+    int fd = fs.open(path, OPEN_READ);
+    ssize_t got = fd < 0 ? -1 : fs.pread(fd, buf.data(), n, off);
+    fs.close(fd);
+    if (got < 0)
+        return "(pread failed)";
+    buf.resize(got);
+    return buf;
+}
+
+static std::string
+zeros(size_t n)
+{
+    return std::string(n, '\0');
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+    int fd;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Sparse files ..." << std::endl;
+    PRINTDIV2;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+
+    std::cout << "truncate(sparse, 1 MiB), pwrite 3 bytes at 600000, fallocate(0, 2 MiB), fallocate(0, 10)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "2097152 bytes, 513 blocks" << std::endl;
+    std::cout << "at 500000: zeros" << std::endl;
+    std::cout << "at 599999: 0 mid 0" << std::endl;
+    std::cout << "at 1048576: zeros" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mkdir("sp");
+    fd = filesystem.open("sp/sparse", OPEN_WRITE | OPEN_CREATE);
+    filesystem.truncate(fd, 1 << 20);
+    filesystem.pwrite(fd, "mid", 3, 600000);
+    filesystem.fallocate(fd, 0, 2 << 20);
+    filesystem.fallocate(fd, 0, 10);
+    filesystem.close(fd);
+    std::cout << usage(filesystem, "sp") << std::endl;
+    auto show_sparse = [](FS &fs, const std::string &path) {
+        std::cout << "at 500000: " << (read_at(fs, path, 4096, 500000) == zeros(4096) ? "zeros" : "data") << std::endl;
+        std::string mid = read_at(fs, path, 5, 599999);
+        std::cout << "at 599999: " << (mid == std::string("\0mid\0", 5) ? "0 mid 0" : "differs") << std::endl;
+        std::cout << "at 1048576: " << (read_at(fs, path, 65536, 1 << 20) == zeros(65536) ? "zeros" : "data") << std::endl;
+    };
+    show_sparse(filesystem, "sp/sparse");
+    std::cout << "-----" << std::endl;
+
+    std::string data(DATA_BYTES, '\0');
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = 'a' + i % 26;
+    std::string reserved = zeros(RESERVED) + data;
+    std::cout << "truncate(sp/res, " << RESERVED << "), append a file of " << DATA_BYTES << " bytes to it..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "res: equal" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    fd = filesystem.open("data", OPEN_WRITE | OPEN_CREATE);
+    filesystem.write(fd, data.data(), data.size());
+    filesystem.close(fd);
+    fd = filesystem.open("sp/res", OPEN_WRITE | OPEN_CREATE);
+    filesystem.truncate(fd, RESERVED);
+    filesystem.close(fd);
+    // the data goes into the reserved block, which must read as written
+    filesystem.append("data", "sp/res");
+    std::cout << "res: " << (contents(filesystem, "sp/res") == reserved ? "equal" : "differs") << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "cp -r sp sp2..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Directory copied successfully" << std::endl;
+    std::cout << "sp2: same usage" << std::endl;
+    std::cout << "at 500000: zeros" << std::endl;
+    std::cout << "at 599999: 0 mid 0" << std::endl;
+    std::cout << "at 1048576: zeros" << std::endl;
+    std::cout << "res: equal" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cp_tree("sp", "sp2");
+    std::cout << "sp2: " << (usage(filesystem, "sp2") == usage(filesystem, "sp") ? "same usage" : "usage differs") << std::endl;
+    show_sparse(filesystem, "sp2/sparse");
+    std::cout << "res: " << (contents(filesystem, "sp2/res") == reserved ? "equal" : "differs") << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "sync and mount again..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    for (int i = 0; i < 2; ++i) {
+        std::cout << "at 500000: zeros" << std::endl;
+        std::cout << "at 599999: 0 mid 0" << std::endl;
+        std::cout << "at 1048576: zeros" << std::endl;
+        std::cout << "res: equal" << std::endl;
+    }
+    std::cout << "Actual output:" << std::endl;
+    filesystem.sync();
+    {
+        FS mounted;
+        for (std::string dir : {"sp", "sp2"}) {
+            show_sparse(mounted, dir + "/sparse");
+            std::cout << "res: " << (contents(mounted, dir + "/res") == reserved ? "equal" : "differs") << std::endl;
+        }
+    }
+    std::cout << "-----" << std::endl;
+}
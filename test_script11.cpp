@@ -0,0 +1,207 @@
+/******************************************************************************
+ *             File : test_script11.cpp
+ *
+ * Test program for the whole-tree operations: cp -r, du, find and rm -r of
+ * a nested tree whose directories span several blocks. The free block
+ * count comes from the superblock, which an unmount brings up to date.
+ *****************************************************************************/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+#define TOP_FILES 80      // more than one directory block holds
+#define SUB_DIRS 3
+#define SUB_FILES 70
+#define PATTERN "f0[0-3]*"
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+static std::string
+contents(FS &fs, const std::string &path)
+{
+    static std::vector<char> mem(1 << 20);
+    OutputSink out(mem.data(), mem.size());
+    if (fs.cat(path, out) != 0)
+        return "(cat failed)";
+    return std::string(mem.data(), out.size());
+}
+
+// the columns of du after the path: size, blocks, files, dirs
+static std::vector<std::string>
+usage(FS &fs, const std::string &dir)
+{
+    char mem[256];
+    OutputSink out(mem, sizeof(mem));
+    if (fs.du(dir, out) != 0)
+        return {"(du failed)"};
+    std::istringstream rows(std::string(mem, out.size()));
+    std::string header, path, col;
+    std::getline(rows, header);
+    rows >> path;
+    std::vector<std::string> cols;
+    while (rows >> col)
+        cols.push_back(col);
+    return cols;
+}
+
+static std::vector<std::string>
+found(FS &fs, const std::string &dir, const std::string &pattern)
+{
+    static std::vector<char> mem(1 << 16);
+    OutputSink out(mem.data(), mem.size());
+    if (fs.find(dir, pattern, out) != 0)
+        return {"(find failed)"};
+    std::istringstream rows(std::string(mem.data(), out.size()));
+    std::vector<std::string> paths;
+    for (std::string p; std::getline(rows, p); )
+        paths.push_back(p);
+    return paths;
+}
+
+// as the last unmount left it
+static uint32_t
+free_blocks()
+{
+    superblock sb = {};
+    std::ifstream f(DISKNAME, std::ios::binary);
+    f.seekg((std::streamoff)SUPER_BLOCK * BLOCK_SIZE);
+    f.read(reinterpret_cast<char*>(&sb), sizeof(sb));
+    return sb.clean ? sb.free_blocks : 0;
+}
+
+// empty, inline and multi-block files, by the file's number
+static std::string
+file_data(int i)
+{
+    std::string s;
+    size_t n = (size_t)i * 997 % 9000;
+    while (s.size() < n)
+        s += "data of file " + std::to_string(i) + "\n";
+    s.resize(n);
+    return s;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Whole trees ..." << std::endl;
+    PRINTDIV2;
+
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+    filesystem.sync();
+    { FS mounted; }
+    uint32_t free_before = free_blocks();
+
+    // t holds TOP_FILES files and SUB_DIRS directories of SUB_FILES files,
+    // the first of them with a directory e of a few files below it
+    std::vector<std::pair<std::string, std::string>> files;   // path, data
+    int next = 0;
+    auto add = [&](const std::string &dir, int n) {
+        for (int k = 0; k < n; ++k, ++next) {
+            char name[16];
+            std::snprintf(name, sizeof(name), "f%03d", next);
+            files.push_back({dir + "/" + name, file_data(next)});
+        }
+    };
+    std::vector<std::string> dirs = {"t"};
+    add("t", TOP_FILES);
+    for (int d = 0; d < SUB_DIRS; ++d) {
+        dirs.push_back("t/d" + std::to_string(d));
+        add(dirs.back(), SUB_FILES);
+    }
+    dirs.push_back("t/d0/e");
+    add("t/d0/e", 5);
+    uint64_t bytes = 0;
+    for (auto &f : files)
+        bytes += f.second.size();
+    std::vector<std::string> want;
+    for (auto &f : files) {
+        std::string name = f.first.substr(f.first.rfind('/') + 1);
+        if (fnmatch(PATTERN, name.c_str(), 0) == 0)
+            want.push_back("u" + f.first.substr(1));
+    }
+    std::sort(want.begin(), want.end());
+
+    std::cout << "make t with " << files.size() << " files in " << dirs.size() << " directories, cp -r t u, "
+              << "du and find of both, rm -r both, unmount..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Directory copied successfully" << std::endl;
+    std::cout << "u: " << files.size() << " files, 0 differ" << std::endl;
+    std::cout << "du t: " << bytes << " bytes, " << files.size() << " files, " << dirs.size() - 1 << " dirs" << std::endl;
+    std::cout << "du u: same as t" << std::endl;
+    std::cout << "find u " << PATTERN << ": " << want.size() << " paths, as expected" << std::endl;
+    std::cout << "find t: " << files.size() + dirs.size() - 1 << " paths" << std::endl;
+    std::cout << "rm -r t u: 0 0" << std::endl;
+    std::cout << "free blocks: as before" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    {
+        FS mounted;
+        for (auto &d : dirs)
+            mounted.mkdir(d);
+        for (auto &f : files) {
+            int fd = mounted.open(f.first, OPEN_WRITE | OPEN_CREATE);
+            if (fd < 0 || mounted.write(fd, f.second.data(), f.second.size()) != (ssize_t)f.second.size())
+                std::cout << "Error: writing " << f.first << " failed" << std::endl;
+            mounted.close(fd);
+        }
+        mounted.cp_tree("t", "u");
+        int differ = 0;
+        for (auto &f : files)
+            differ += contents(mounted, "u" + f.first.substr(1)) != f.second;
+        std::cout << "u: " << files.size() << " files, " << differ << " differ" << std::endl;
+        std::vector<std::string> t = usage(mounted, "t"), u = usage(mounted, "u");
+        if (t.size() == 4)
+            std::cout << "du t: " << t[0] << " bytes, " << t[2] << " files, " << t[3] << " dirs" << std::endl;
+        else
+            std::cout << "du t: " << t[0] << std::endl;
+        std::cout << "du u: " << (u == t ? "same as t" : "differs from t") << std::endl;
+        std::vector<std::string> hits = found(mounted, "u", PATTERN);
+        std::cout << "find u " << PATTERN << ": " << hits.size() << " paths, "
+                  << (hits == want ? "as expected" : "not as expected") << std::endl;
+        std::cout << "find t: " << found(mounted, "t", "").size() << " paths" << std::endl;
+        int rc_t = mounted.rm_tree("t");
+        int rc_u = mounted.rm_tree("u");
+        std::cout << "rm -r t u: " << rc_t << " " << rc_u << std::endl;
+    }
+    uint32_t free_after = free_blocks();
+    if (free_after == free_before)
+        std::cout << "free blocks: as before" << std::endl;
+    else
+        std::cout << "free blocks: " << free_before << " before, " << free_after << " after" << std::endl;
+    std::cout << "-----" << std::endl;
+
+    // the mounts above changed the disk behind filesystem's back
+    filesystem.format();
+}
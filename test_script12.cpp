@@ -0,0 +1,210 @@
+/******************************************************************************
+ *             File : test_script12.cpp
+ *
+ * Test program for batch mode: the syncs a script's commands share, with
+ * one before each command that only reads and one every group of changes,
+ * create taking its data lines from the script, and quit stopping the
+ * socket server.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <future>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+#include "batch.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+#define SOCKET_PATH "batch_test.sock"
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+struct BatchRun {
+    int failed;
+    uint64_t syncs;
+    std::string out;
+};
+
+// runs script on fs with the output kept, counting the syncs
+static BatchRun
+batch(FS &fs, const std::string &script, size_t group)
+{
+    BatchOptions opts;
+    opts.group = group;
+    std::istringstream in(script);
+    std::ostringstream out;
+    std::streambuf *old = std::cout.rdbuf(out.rdbuf());
+    stats_reset();
+    int failed = run_batch(fs, in, opts);
+    uint64_t syncs = stats_snapshot().calls[OP_SYNC];
+    std::cout.rdbuf(old);
+    return {failed, syncs, out.str()};
+}
+
+static int
+connect_to(const char *path)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// sends script as one connection and returns what comes back
+static std::string
+send_batch(const char *path, const std::string &script)
+{
+    int fd = -1;
+    // the server may not be listening yet
+    for (int tries = 0; tries < 100 && (fd = connect_to(path)) < 0; ++tries)
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    if (fd < 0)
+        return "(cannot connect)";
+    if (::write(fd, script.data(), script.size()) != (ssize_t)script.size())
+        return "(cannot send)";
+    shutdown(fd, SHUT_WR);
+    std::string reply;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+        reply.append(buf, n);
+    ::close(fd);
+    return reply;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Batch mode ..." << std::endl;
+    PRINTDIV2;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+
+    std::cout << "scripts of changes and reads, counting the syncs..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "ls, pwd: 0 syncs" << std::endl;
+    std::cout << "mkdir a, mkdir b, ls, mkdir c, ls: 2 syncs" << std::endl;
+    std::cout << "mkdir x, mkdir y, mkdir z: 1 syncs" << std::endl;
+    std::cout << "7 x mkdir, group 3: 3 syncs" << std::endl;
+    std::cout << "7 x mkdir, group 1: 7 syncs" << std::endl;
+    std::cout << "mkdir of a taken name: 1 failed" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    auto count = [&](const std::string &label, const std::string &script, size_t group) {
+        BatchRun r = batch(filesystem, script, group);
+        std::cout << label << ": " << r.syncs << " syncs" << std::endl;
+    };
+    auto mkdirs = [](const std::string &prefix, int n) {
+        std::string s;
+        for (int i = 0; i < n; ++i)
+            s += "mkdir " + prefix + std::to_string(i) + "\n";
+        return s;
+    };
+    count("ls, pwd", "ls\npwd\n", BATCH_GROUP);
+    // a read sees the changes before it on the disk
+    count("mkdir a, mkdir b, ls, mkdir c, ls", "mkdir a\nmkdir b\nls\nmkdir c\nls\n", BATCH_GROUP);
+    count("mkdir x, mkdir y, mkdir z", "mkdir x\nmkdir y\nmkdir z\n", BATCH_GROUP);
+    count("7 x mkdir, group 3", mkdirs("g", 7), 3);
+    count("7 x mkdir, group 1", mkdirs("h", 7), 1);
+    std::cout << "mkdir of a taken name: " << batch(filesystem, "mkdir a\n", BATCH_GROUP).failed
+              << " failed" << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "create f with two data lines from the script, then cat f..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0 failed" << std::endl;
+    std::cout << "f: line one|line two|" << std::endl;
+    std::cout << "cat f: in the output" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    // a data line run as a command would fail
+    BatchRun r = batch(filesystem, "create f\nline one\nline two\n\ncat f\n", BATCH_GROUP);
+    std::cout << r.failed << " failed" << std::endl;
+    std::string data;
+    {
+        std::ostringstream out;
+        std::streambuf *old = std::cout.rdbuf(out.rdbuf());
+        filesystem.cat("f");
+        std::cout.rdbuf(old);
+        data = out.str();
+    }
+    for (char &c : data)
+        if (c == '\n') c = '|';
+    std::cout << "f: " << data << std::endl;
+    std::cout << "cat f: " << (r.out.find("line one\nline two\n") != std::string::npos ? "in the output" : "missing")
+              << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "serve on " << SOCKET_PATH << ": mkdir s and ls, then quit..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "first connection: s listed" << std::endl;
+    std::cout << "second connection: quit" << std::endl;
+    std::cout << "server: stopped, 0" << std::endl;
+    std::cout << "connect after quit: refused" << std::endl;
+    std::cout << "s: a directory, after_quit: missing" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::promise<int> served;
+    std::future<int> server_rc = served.get_future();
+    std::thread server([&] { served.set_value(serve_batch(filesystem, SOCKET_PATH, BatchOptions())); });
+    std::string reply = send_batch(SOCKET_PATH, "mkdir s\nls\n");
+    std::string listed = reply.find("\ns\tdir\t") != std::string::npos ? "s listed" : "s missing";
+    std::string quit = send_batch(SOCKET_PATH, "quit\nmkdir after_quit\n");
+    std::cout << "first connection: " << listed << std::endl;
+    std::cout << "second connection: " << (quit.find("(cannot") == std::string::npos ? "quit" : quit) << std::endl;
+    if (server_rc.wait_for(std::chrono::seconds(10)) == std::future_status::ready) {
+        std::cout << "server: stopped, " << server_rc.get() << std::endl;
+        server.join();
+    } else {
+        // blocked in accept; nothing can stop it from here
+        std::cout << "server: still running" << std::endl;
+        server.detach();
+    }
+    int fd = connect_to(SOCKET_PATH);
+    std::cout << "connect after quit: " << (fd < 0 ? "refused" : "accepted") << std::endl;
+    if (fd >= 0)
+        ::close(fd);
+    // commands after quit are not run
+    auto listing = [&] {
+        std::ostringstream out;
+        std::streambuf *old = std::cout.rdbuf(out.rdbuf());
+        filesystem.ls();
+        std::cout.rdbuf(old);
+        return out.str();
+    };
+    std::string root = listing();
+    std::cout << "s: " << (root.find("\ns\tdir\t") != std::string::npos ? "a directory" : "missing")
+              << ", after_quit: " << (root.find("after_quit") == std::string::npos ? "missing" : "made") << std::endl;
+    std::cout << "-----" << std::endl;
+}
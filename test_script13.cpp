@@ -0,0 +1,162 @@
+/******************************************************************************
+ *             File : test_script13.cpp
+ *
+ * Test program for import and export of host directory trees: a tree of
+ * files around the inline size limit and nested directories is imported,
+ * read back from the disk, exported to a second host directory and
+ * compared byte for byte with the one it came from.
+ *****************************************************************************/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <filesystem>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+namespace fsys = std::filesystem;
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+static std::string
+contents(FS &fs, const std::string &path)
+{
+    static std::vector<char> mem(1 << 20);
+    OutputSink out(mem.data(), mem.size());
+    if (fs.cat(path, out) != 0)
+        return "(cat failed)";
+    return std::string(mem.data(), out.size());
+}
+
+static std::string
+pattern(size_t n, int seed)
+{
+    std::string s(n, '\0');
+    for (size_t i = 0; i < n; ++i)
+        s[i] = (char)(i * 31 + seed);
+    return s;
+}
+
+// every file and directory below root by relative path, "/" for a directory
+static std::map<std::string, std::string>
+host_tree(const fsys::path &root)
+{
+    std::map<std::string, std::string> tree;
+    for (auto &e : fsys::recursive_directory_iterator(root)) {
+        std::string rel = fsys::relative(e.path(), root).string();
+        if (e.is_directory()) {
+            tree[rel] = "/";
+        } else {
+            std::ifstream f(e.path(), std::ios::binary);
+            tree[rel] = std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        }
+    }
+    return tree;
+}
+
+static fsys::path
+temp_dir()
+{
+    char name[] = "/tmp/fs_test13_XXXXXX";
+    if (!mkdtemp(name))
+        return {};
+    return name;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Import and export ..." << std::endl;
+    PRINTDIV2;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+
+    fsys::path src = temp_dir(), dst = temp_dir();
+    std::map<std::string, std::string> files = {
+        {"empty", ""},
+        {"inline_max", pattern(INLINE_MAX, 1)},
+        {"inline_max_1", pattern(INLINE_MAX + 1, 2)},
+        {"blocks", pattern(3 * BLOCK_SIZE + 5, 3)},
+        {"sub/one", pattern(100, 4)},
+        {"sub/deeper/inline_max_1", pattern(INLINE_MAX + 1, 5)},
+        {"sub/deeper/empty", ""},
+    };
+    fsys::create_directories(src / "sub/deeper");
+    fsys::create_directories(src / "sub/nothing");
+    for (auto &f : files) {
+        std::ofstream out(src / f.first, std::ios::binary);
+        out.write(f.second.data(), f.second.size());
+    }
+    std::map<std::string, std::string> want = host_tree(src);
+
+    std::cout << "import a host tree of " << files.size() << " files (0, " << INLINE_MAX << " and "
+              << INLINE_MAX + 1 << " bytes among them) into imp, cat each file..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "import: 0" << std::endl;
+    std::cout << "cat: " << files.size() << " equal" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "import: " << filesystem.import_tree(src.string(), "imp") << std::endl;
+    int equal = 0;
+    for (auto &f : files) {
+        if (contents(filesystem, "imp/" + f.first) == f.second)
+            ++equal;
+        else
+            std::cout << "imp/" << f.first << " differs" << std::endl;
+    }
+    std::cout << "cat: " << equal << " equal" << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "sync, mount again, export imp to a second host directory..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "export: 0" << std::endl;
+    std::cout << "tree: " << want.size() << " paths, the same bytes" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.sync();
+    {
+        FS mounted;
+        std::cout << "export: " << mounted.export_tree("imp", dst.string()) << std::endl;
+    }
+    std::map<std::string, std::string> got = host_tree(dst);
+    std::cout << "tree: " << got.size() << " paths, " << (got == want ? "the same bytes" : "differs") << std::endl;
+    for (auto &w : want) {
+        auto g = got.find(w.first);
+        if (g == got.end())
+            std::cout << w.first << " missing" << std::endl;
+        else if (g->second != w.second)
+            std::cout << w.first << " differs" << std::endl;
+    }
+    std::cout << "-----" << std::endl;
+
+    fsys::remove_all(src);
+    fsys::remove_all(dst);
+    // the mount above changed the disk behind filesystem's back
+    filesystem.format();
+}
@@ -0,0 +1,134 @@
+/******************************************************************************
+ *             File : test_script14.cpp
+ *
+ * Test program for inline files: files of up to INLINE_MAX bytes are kept
+ * in their directory block and take no block of their own, an append that
+ * outgrows the limit moves the file out, and a directory block whose free
+ * slots are scattered still takes an inline file. Each part is checked
+ * again on a second mount of the disk.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// create() reads the file from stdin
+static void
+create_from(FS &fs, const std::string &path, const std::string &text)
+{
+    std::istringstream in(text + "\n");
+    std::streambuf *old = std::cin.rdbuf(in.rdbuf());
+    fs.create(path);
+    std::cin.rdbuf(old);
+}
+
+static std::string
+contents(FS &fs, const std::string &path)
+{
+    static std::vector<char> mem(1 << 20);
+    OutputSink out(mem.data(), mem.size());
+    if (fs.cat(path, out) != 0)
+        return "(cat failed)";
+    return std::string(mem.data(), out.size());
+}
+
+// bytes and blocks columns of du; the blocks include the directory's own
+static std::string
+usage(FS &fs, const std::string &dir)
+{
+    char mem[256];
+    OutputSink out(mem, sizeof(mem));
+    if (fs.du(dir, out) != 0)
+        return "(du failed)";
+    std::istringstream rows(std::string(mem, out.size()));
+    std::string header, path, bytes, blocks;
+    std::getline(rows, header);
+    rows >> path >> bytes >> blocks;
+    return bytes + " bytes, " + blocks + " blocks";
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+    int fd;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Inline files ..." << std::endl;
+    PRINTDIV2;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+
+    std::string fill(INLINE_MAX - 1, 'i');
+    std::cout << "create small of " << INLINE_MAX << " bytes and tail of 2, append(tail, small)..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << INLINE_MAX << " bytes, 1 blocks" << std::endl;
+    std::cout << INLINE_MAX + 2 << " bytes, 2 blocks" << std::endl;
+    std::cout << "small: equal" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mkdir("inl");
+    create_from(filesystem, "inl/small", fill);
+    std::cout << usage(filesystem, "inl") << std::endl;
+    create_from(filesystem, "tail", "t");
+    filesystem.append("tail", "inl/small");
+    std::cout << usage(filesystem, "inl") << std::endl;
+    std::cout << "small: " << (contents(filesystem, "inl/small") == fill + "\nt\n" ? "equal" : "differs") << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "fill frag with empty files, rm every other one, create one of " << INLINE_MAX << " bytes..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << INLINE_MAX << " bytes, 1 blocks" << std::endl;
+    std::cout << "full: equal" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mkdir("frag");
+    for (unsigned i = 0; i < DIR_SLOTS - 2; ++i) {
+        fd = filesystem.open("frag/e" + std::to_string(i), OPEN_WRITE | OPEN_CREATE);
+        filesystem.close(fd);
+    }
+    for (unsigned i = 0; i < DIR_SLOTS - 2; i += 2)
+        filesystem.rm("frag/e" + std::to_string(i));
+    // the free slots are scattered; the directory stays a single block
+    create_from(filesystem, "frag/full", fill);
+    std::cout << usage(filesystem, "frag") << std::endl;
+    std::cout << "full: " << (contents(filesystem, "frag/full") == fill + "\n" ? "equal" : "differs") << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "sync and mount again..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "small: equal" << std::endl;
+    std::cout << "full: equal" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.sync();
+    {
+        FS mounted;
+        std::cout << "small: " << (contents(mounted, "inl/small") == fill + "\nt\n" ? "equal" : "differs") << std::endl;
+        std::cout << "full: " << (contents(mounted, "frag/full") == fill + "\n" ? "equal" : "differs") << std::endl;
+    }
+    std::cout << "-----" << std::endl;
+}
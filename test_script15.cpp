@@ -0,0 +1,149 @@
+/******************************************************************************
+ *             File : test_script15.cpp
+ *
+ * Test program for compressed files: compressible text takes fewer blocks
+ * once compressed, random data is kept as it is, both read back whole and
+ * at an offset (also on a second mount), and compress -d restores the
+ * plain layout.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+#define TEXT_BYTES 200000 // compressible, more than one compressed group
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+static std::string
+contents(FS &fs, const std::string &path)
+{
+    static std::vector<char> mem(1 << 20);
+    OutputSink out(mem.data(), mem.size());
+    if (fs.cat(path, out) != 0)
+        return "(cat failed)";
+    return std::string(mem.data(), out.size());
+}
+
+// bytes and blocks columns of du; the blocks include the directory's own
+static std::string
+usage(FS &fs, const std::string &dir)
+{
+    char mem[256];
+    OutputSink out(mem, sizeof(mem));
+    if (fs.du(dir, out) != 0)
+        return "(du failed)";
+    std::istringstream rows(std::string(mem, out.size()));
+    std::string header, path, bytes, blocks;
+    std::getline(rows, header);
+    rows >> path >> bytes >> blocks;
+    return bytes + " bytes, " + blocks + " blocks";
+}
+
+// n bytes at off, or what went wrong
+static std::string
+read_at(FS &fs, const std::string &path, size_t n, uint64_t off)
+{
+    std::string buf(n, '\0');
+    int fd = fs.open(path, OPEN_READ);
+    ssize_t got = fd < 0 ? -1 : fs.pread(fd, buf.data(), n, off);
+    fs.close(fd);
+    if (got < 0)
+        return "(pread failed)";
+    buf.resize(got);
+    return buf;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+    int fd;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Compressed files ..." << std::endl;
+    PRINTDIV2;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+
+    std::string text;
+    for (int i = 0; text.size() < TEXT_BYTES; ++i)
+        text += "line " + std::to_string(i % 500) + " of some compressible text\n";
+    text.resize(TEXT_BYTES);
+    std::string noise(TEXT_BYTES, '\0');
+    std::srand(1);
+    for (char &c : noise)
+        c = std::rand();
+    std::cout << "text and noise of " << TEXT_BYTES << " bytes each, compress both..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "text: fewer blocks, equal, pread equal" << std::endl;
+    std::cout << "noise: equal, pread equal" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mkdir("z");
+    for (auto *f : {&text, &noise}) {
+        std::string path = f == &text ? "z/text" : "z/noise";
+        fd = filesystem.open(path, OPEN_WRITE | OPEN_CREATE);
+        filesystem.write(fd, f->data(), f->size());
+        filesystem.close(fd);
+    }
+    std::string plain = usage(filesystem, "z");
+    filesystem.compress("z/text", true);
+    filesystem.compress("z/noise", true);
+    auto show_compressed = [&](FS &fs, bool blocks) {
+        std::cout << "text: " << (blocks ? (usage(fs, "z") != plain ? "fewer blocks, " : "same blocks, ") : "")
+                  << (contents(fs, "z/text") == text ? "equal" : "differs") << ", pread "
+                  << (read_at(fs, "z/text", 1000, 150000) == text.substr(150000, 1000) ? "equal" : "differs") << std::endl;
+        std::cout << "noise: " << (contents(fs, "z/noise") == noise ? "equal" : "differs") << ", pread "
+                  << (read_at(fs, "z/noise", 1000, 70000) == noise.substr(70000, 1000) ? "equal" : "differs") << std::endl;
+    };
+    show_compressed(filesystem, true);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "sync and mount again..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "text: equal, pread equal" << std::endl;
+    std::cout << "noise: equal, pread equal" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.sync();
+    {
+        FS mounted;
+        show_compressed(mounted, false);
+    }
+    std::cout << "-----" << std::endl;
+
+    std::cout << "compress -d text, then it reads the same..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << plain << std::endl;
+    std::cout << "text: equal" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.compress("z/text", false);
+    filesystem.compress("z/noise", false);
+    std::cout << usage(filesystem, "z") << std::endl;
+    std::cout << "text: " << (contents(filesystem, "z/text") == text ? "equal" : "differs") << std::endl;
+    std::cout << "-----" << std::endl;
+}
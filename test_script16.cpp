@@ -0,0 +1,108 @@
+/******************************************************************************
+ *             File : test_script16.cpp
+ *
+ * Test program for reflinked copies: cp --reflink shares the source's
+ * blocks, and a later change to either file, by append or by pwrite, gives
+ * it blocks of its own and leaves the other as it was. Checked again on a
+ * second mount of the disk.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// create() reads the file from stdin
+static void
+create_from(FS &fs, const std::string &path, const std::string &text)
+{
+    std::istringstream in(text + "\n");
+    std::streambuf *old = std::cin.rdbuf(in.rdbuf());
+    fs.create(path);
+    std::cin.rdbuf(old);
+}
+
+static std::string
+contents(FS &fs, const std::string &path)
+{
+    static std::vector<char> mem(1 << 20);
+    OutputSink out(mem.data(), mem.size());
+    if (fs.cat(path, out) != 0)
+        return "(cat failed)";
+    return std::string(mem.data(), out.size());
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+    int fd;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Reflinked copies ..." << std::endl;
+    PRINTDIV2;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+
+    std::cout << "cp --reflink a b, append(tail, b), pwrite into a..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "File copied successfully" << std::endl;
+    std::cout << "a: AAAAxxxxxxxx" << std::endl;
+    std::cout << "b: xxxxxxxxxxxx" << std::endl;
+    std::cout << "t" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mkdir("r");
+    create_from(filesystem, "tail", "t");
+    fd = filesystem.open("r/a", OPEN_WRITE | OPEN_CREATE);
+    filesystem.write(fd, "xxxxxxxxxxxx\n", 13);
+    filesystem.close(fd);
+    filesystem.cp("r/a", "r/b", true);
+    filesystem.append("tail", "r/b");
+    fd = filesystem.open("r/a", OPEN_WRITE);
+    filesystem.pwrite(fd, "AAAA", 4, 0);
+    filesystem.close(fd);
+    auto show_reflink = [](FS &fs) {
+        std::cout << "a: " << contents(fs, "r/a");
+        std::cout << "b: " << contents(fs, "r/b");
+    };
+    show_reflink(filesystem);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "sync and mount again..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "a: AAAAxxxxxxxx" << std::endl;
+    std::cout << "b: xxxxxxxxxxxx" << std::endl;
+    std::cout << "t" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.sync();
+    {
+        FS mounted;
+        show_reflink(mounted);
+    }
+    std::cout << "-----" << std::endl;
+}
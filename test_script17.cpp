@@ -0,0 +1,102 @@
+/******************************************************************************
+ *             File : test_script17.cpp
+ *
+ * Test program for file handles at their edges: pwrite past the end of an
+ * empty file, truncate down and up again, and ranges whose end does not
+ * fit in 64 bits. Checked again on a second mount of the disk.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// n bytes at off, or what went wrong
+static std::string
+read_at(FS &fs, const std::string &path, size_t n, uint64_t off)
+{
+    std::string buf(n, '\0');
+    int fd = fs.open(path, OPEN_READ);
+    ssize_t got = fd < 0 ? -1 : fs.pread(fd, buf.data(), n, off);
+    fs.close(fd);
+    if (got < 0)
+        return "(pread failed)";
+    buf.resize(got);
+    return buf;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+    int fd;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "File handles ..." << std::endl;
+    PRINTDIV2;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+
+    std::cout << "pwrite 2 bytes at 10 of an empty file, truncate to 11, to 20, write past 4 GiB..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "12: 0 0 0 0 0 0 0 0 0 0 a b" << std::endl;
+    std::cout << "11: 0 0 0 0 0 0 0 0 0 0 a" << std::endl;
+    std::cout << "20: 0 0 0 0 0 0 0 0 0 0 a 0 0 0 0 0 0 0 0 0" << std::endl;
+    std::cout << "pwrite, fallocate with off + n wrapping around: -1 -1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    auto show = [](const std::string &s) {
+        std::cout << s.size() << ":";
+        for (char c : s)
+            std::cout << " " << (c ? std::string(1, c) : "0");
+        std::cout << std::endl;
+    };
+    fd = filesystem.open("rw", OPEN_READ | OPEN_WRITE | OPEN_CREATE);
+    filesystem.pwrite(fd, "ab", 2, 10);
+    show(read_at(filesystem, "rw", 100, 0));
+    filesystem.truncate(fd, 11);
+    show(read_at(filesystem, "rw", 100, 0));
+    filesystem.truncate(fd, 20);
+    show(read_at(filesystem, "rw", 100, 0));
+    std::cout << "pwrite, fallocate with off + n wrapping around: "
+              << filesystem.pwrite(fd, "ab", 2, UINT64_MAX - 1) << " "
+              << filesystem.fallocate(fd, UINT64_MAX - 1, 2) << std::endl;
+    filesystem.close(fd);
+    std::cout << "-----" << std::endl;
+
+    std::cout << "sync and mount again..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "20: 0 0 0 0 0 0 0 0 0 0 a 0 0 0 0 0 0 0 0 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.sync();
+    {
+        FS mounted;
+        show(read_at(mounted, "rw", 100, 0));
+    }
+    std::cout << "-----" << std::endl;
+}
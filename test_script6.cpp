@@ -0,0 +1,161 @@
+/******************************************************************************
+ *             File : test_script6.cpp
+ *
+ * Test program for background read-ahead: a large file is read
+ * sequentially, so blocks are prefetched into the block cache, while
+ * directory lookups read their blocks through views of the same cache.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+#define BIG_BYTES (3 << 20)   // more than the block cache holds
+#define NFILES 120            // enough for an htree directory
+#define CHUNK 32768
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+static uint8_t
+pattern(size_t i)
+{
+    return (uint8_t)(i * 7 + i / 4096);
+}
+
+static std::string
+small_name(int i)
+{
+    return "d/file" + std::to_string(i);
+}
+
+static std::string
+small_data(int i)
+{
+    return "contents of file " + std::to_string(i) + "\n";
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Read-ahead ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Formatting, making d with " << NFILES << " files and a file big of "
+              << BIG_BYTES << " bytes..." << std::endl;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+    filesystem.mkdir("d");
+    for (int i = 0; i < NFILES; ++i) {
+        std::string s = small_data(i);
+        int fd = filesystem.open(small_name(i), OPEN_WRITE | OPEN_CREATE);
+        if (fd < 0 || filesystem.write(fd, s.data(), s.size()) != (ssize_t)s.size())
+            std::cout << "Error: writing " << small_name(i) << " failed" << std::endl;
+        filesystem.close(fd);
+    }
+    std::vector<uint8_t> big(BIG_BYTES);
+    for (size_t i = 0; i < big.size(); ++i)
+        big[i] = pattern(i);
+    int fd = filesystem.open("big", OPEN_WRITE | OPEN_CREATE);
+    if (fd < 0 || filesystem.write(fd, big.data(), big.size()) != (ssize_t)big.size())
+        std::cout << "Error: writing big failed" << std::endl;
+    filesystem.close(fd);
+    filesystem.sync();
+
+    // every lookup goes through the directory blocks, which live in the
+    // block cache next to the blocks being read ahead
+    int bad_lookups = 0;
+    int next = 0;
+    auto lookup = [&](int count) {
+        char buf[64];
+        for (int k = 0; k < count; ++k, next = (next + 37) % NFILES) {
+            std::string want = small_data(next);
+            int f = filesystem.open(small_name(next), OPEN_READ);
+            ssize_t got = f < 0 ? -1 : filesystem.pread(f, buf, sizeof(buf), 0);
+            if (got != (ssize_t)want.size() || std::memcmp(buf, want.data(), got) != 0)
+                ++bad_lookups;
+            filesystem.close(f);
+        }
+    };
+
+    std::cout << "pread(big) in " << CHUNK << " byte pieces, looking up files in d between them..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "big: " << BIG_BYTES << " bytes read, 0 differ" << std::endl;
+    std::cout << "lookups: 0 failed" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    size_t total = 0, differ = 0;
+    std::vector<uint8_t> chunk(CHUNK);
+    for (int round = 0; round < 2; ++round) {
+        fd = filesystem.open("big", OPEN_READ);
+        for (uint64_t off = 0; ; off += CHUNK) {
+            ssize_t got = filesystem.pread(fd, chunk.data(), CHUNK, off);
+            if (got <= 0)
+                break;
+            for (ssize_t i = 0; i < got; ++i)
+                differ += chunk[i] != pattern(off + i);
+            if (round == 0)
+                total += got;
+            lookup(3);
+        }
+        filesystem.close(fd);
+    }
+    std::cout << "big: " << total << " bytes read, " << differ << " differ" << std::endl;
+    std::cout << "lookups: " << bad_lookups << " failed" << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "cat(big) into memory, then ls of d and lookups, four times..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "cat: 4 of 4 complete and equal" << std::endl;
+    std::cout << "ls: 4 of 4 list " << NFILES << " files" << std::endl;
+    std::cout << "lookups: 0 failed" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    bad_lookups = 0;
+    int cat_ok = 0, ls_ok = 0;
+    std::vector<char> out(BIG_BYTES), listing(NFILES * LS_ROW_MAX + 256);
+    for (int round = 0; round < 4; ++round) {
+        OutputSink sink(out.data(), out.size());
+        if (filesystem.cat("big", sink) == 0 && sink.size() == big.size() &&
+            std::memcmp(out.data(), big.data(), big.size()) == 0)
+            ++cat_ok;
+        filesystem.cd("d");
+        OutputSink ls_sink(listing.data(), listing.size());
+        filesystem.ls(ls_sink);
+        std::string text(listing.data(), ls_sink.size());
+        size_t lines = 0;
+        for (size_t p = 0; (p = text.find("\tfile\t", p)) != std::string::npos; ++p)
+            ++lines;
+        ls_ok += lines == NFILES;
+        filesystem.cd("..");
+        lookup(NFILES);
+    }
+    std::cout << "cat: " << cat_ok << " of 4 complete and equal" << std::endl;
+    std::cout << "ls: " << ls_ok << " of 4 list " << NFILES << " files" << std::endl;
+    std::cout << "lookups: " << bad_lookups << " failed" << std::endl;
+    std::cout << "-----" << std::endl;
+}
@@ -0,0 +1,316 @@
+/******************************************************************************
+ *             File : test_script7.cpp
+ *
+ * Test program for the metadata journal. A crash is simulated on the disk
+ * file itself: every home block named in the log gets its contents from
+ * an image of the disk taken before the operation, as if the log had
+ * reached the disk and none of the home blocks had. A second FS mounted
+ * on that image has to replay the operation, or drop it when its commit
+ * record is torn. A group too big for the log keeps part of its images in
+ * spill blocks; it has to be replayed or dropped as a whole as well.
+ *****************************************************************************/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+#define HUGE_DISK 160000      // blocks; its FAT has more pages than the log holds
+#define HUGE_FILE 150000
+#define NDIRS 150             // cp -r of as many directories stages more
+                              // blocks than the log holds
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+static std::vector<char>
+read_image()
+{
+    std::ifstream f(DISKNAME, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+static void
+write_image(const std::vector<char> &img)
+{
+    std::fstream f(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
+    f.write(img.data(), img.size());
+}
+
+// after, with the home blocks of the groups in its log as in before
+static std::vector<char>
+crash_image(const std::vector<char> &before, const std::vector<char> &after)
+{
+    std::vector<char> img = after;
+    journal_header hdr;
+    std::memcpy(&hdr, after.data() + (size_t)JOURNAL_START * BLOCK_SIZE, sizeof(hdr));
+    std::vector<char> blk(BLOCK_SIZE);
+    for (unsigned b = JOURNAL_START + 1; b < JOURNAL_START + JOURNAL_BLOCKS; ++b) {
+        std::memcpy(blk.data(), after.data() + (size_t)b * BLOCK_SIZE, BLOCK_SIZE);
+        auto *desc = reinterpret_cast<journal_desc *>(blk.data());
+        if (desc->magic != JDESC_MAGIC || desc->seq < hdr.seq)
+            continue;
+        for (uint32_t i = 0; i < desc->count; ++i) {
+            size_t at = (size_t)desc->homes[i] * BLOCK_SIZE;
+            std::memcpy(img.data() + at, before.data() + at, BLOCK_SIZE);
+        }
+        journal_spill sp;
+        for (uint32_t next = desc->spill; next != 0; next = sp.next) {
+            std::memcpy(&sp, after.data() + (size_t)next * BLOCK_SIZE, sizeof(sp));
+            if (sp.magic != JSPILL_MAGIC)
+                break;
+            for (uint32_t i = 0; i < sp.count; ++i) {
+                size_t at = (size_t)sp.images[i].home * BLOCK_SIZE;
+                std::memcpy(img.data() + at, before.data() + at, BLOCK_SIZE);
+            }
+        }
+    }
+    return img;
+}
+
+// first spill descriptor of the newest group in the log, or 0
+static uint32_t
+first_spill(const std::vector<char> &img)
+{
+    uint32_t spill = 0;
+    uint64_t seq = 0;
+    std::vector<char> blk(BLOCK_SIZE);
+    for (unsigned b = JOURNAL_START + 1; b < JOURNAL_START + JOURNAL_BLOCKS; ++b) {
+        std::memcpy(blk.data(), img.data() + (size_t)b * BLOCK_SIZE, BLOCK_SIZE);
+        auto *desc = reinterpret_cast<journal_desc *>(blk.data());
+        if (desc->magic == JDESC_MAGIC && desc->seq >= seq) {
+            spill = desc->spill;
+            seq = desc->seq;
+        }
+    }
+    return spill;
+}
+
+// create() reads the file from stdin
+static void
+create_from(FS &fs, const std::string &path, const std::string &text)
+{
+    std::istringstream in(text + "\n");
+    std::streambuf *old = std::cin.rdbuf(in.rdbuf());
+    fs.create(path);
+    std::cin.rdbuf(old);
+}
+
+// zero the commit record of the newest group in the log
+static bool
+tear_last_group(std::vector<char> &img)
+{
+    char *last = nullptr;
+    uint64_t seq = 0;
+    for (unsigned b = JOURNAL_START + 1; b < JOURNAL_START + JOURNAL_BLOCKS; ++b) {
+        char *p = img.data() + (size_t)b * BLOCK_SIZE;
+        journal_commit c;
+        std::memcpy(&c, p, sizeof(c));
+        if (c.magic == JCOMMIT_MAGIC && (!last || c.seq > seq)) {
+            last = p;
+            seq = c.seq;
+        }
+    }
+    if (last)
+        std::memset(last, 0, BLOCK_SIZE);
+    return last != nullptr;
+}
+
+// subdirectories of dir
+static int
+count_dirs(FS &fs, const std::string &dir)
+{
+    static std::vector<char> mem(1 << 16);
+    if (fs.cd(dir) != 0)
+        return -1;
+    OutputSink out(mem.data(), mem.size());
+    fs.ls(out);
+    fs.cd("/");
+    std::istringstream rows(std::string(mem.data(), out.size()));
+    int n = 0;
+    for (std::string row; std::getline(rows, row); )
+        n += row.find("\tdir\t") != std::string::npos && row.rfind(".\t", 0) != 0 && row.rfind("..\t", 0) != 0;
+    return n;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Journal ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Formatting, mkdir d1, sync..." << std::endl;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+    filesystem.mkdir("d1");
+    filesystem.sync();
+    std::vector<char> before = read_image();
+
+    // metadata only: the file is small enough to live in its directory
+    // block, so all of it is in the log
+    std::cout << "mkdir d2, create d1/note with 10 bytes, mv d1/note d2, sync..." << std::endl;
+    filesystem.mkdir("d2");
+    create_from(filesystem, "d1/note", "journaled");
+    filesystem.mv("d1/note", "d2");
+    filesystem.sync();
+    std::vector<char> after = read_image();
+
+    std::cout << "crash before the home blocks are written, then mount..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "d1\tdir\trwx\t-" << std::endl;
+    std::cout << "d2\tdir\trwx\t-" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << ".\tdir\trwx\t-" << std::endl;
+    std::cout << "..\tdir\trwx\t-" << std::endl;
+    std::cout << "note\tfile\trw-\t10" << std::endl;
+    std::cout << "journaled" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    write_image(crash_image(before, after));
+    {
+        FS mounted;
+        mounted.ls();
+        mounted.cd("d2");
+        mounted.ls();
+        mounted.cat("note");
+    }
+    std::cout << "-----" << std::endl;
+
+    std::cout << "the same with the commit record of the last group torn..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "d1\tdir\trwx\t-" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << ".\tdir\trwx\t-" << std::endl;
+    std::cout << "..\tdir\trwx\t-" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::vector<char> torn = crash_image(before, after);
+    if (!tear_last_group(torn))
+        std::cout << "Error: no group in the log" << std::endl;
+    write_image(torn);
+    {
+        FS mounted;
+        mounted.ls();
+        mounted.cd("d1");
+        mounted.ls();
+    }
+    std::cout << "-----" << std::endl;
+
+    std::cout << "the replayed image mounts again unchanged..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "d1\tdir\trwx\t-" << std::endl;
+    std::cout << "d2\tdir\trwx\t-" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    write_image(crash_image(before, after));
+    {
+        FS mounted;
+    }
+    {
+        FS mounted;
+        mounted.ls();
+    }
+    std::cout << "-----" << std::endl;
+
+    std::cout << "Formatting, mkdir t with " << NDIRS << " directories in it, sync, cp -r t u, sync..." << std::endl;
+    filesystem.format();
+    filesystem.mkdir("t");
+    for (int i = 0; i < NDIRS; ++i)
+        filesystem.mkdir("t/d" + std::to_string(i));
+    filesystem.sync();
+    std::vector<char> before_cp = read_image();
+    filesystem.cp_tree("t", "u");
+    filesystem.sync();
+    std::vector<char> after_cp = read_image();
+
+    std::cout << "crash before the home blocks are written, then mount..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "spilled: yes" << std::endl;
+    std::cout << "/: 2 dirs, t: " << NDIRS << " dirs, u: " << NDIRS << " dirs" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "spilled: " << (first_spill(after_cp) ? "yes" : "no") << std::endl;
+    write_image(crash_image(before_cp, after_cp));
+    {
+        FS mounted;
+        std::cout << "/: " << count_dirs(mounted, "/") << " dirs, t: " << count_dirs(mounted, "t")
+                  << " dirs, u: " << count_dirs(mounted, "u") << " dirs" << std::endl;
+    }
+    std::cout << "-----" << std::endl;
+
+    std::cout << "the same with the commit record torn, and with one spilled image torn..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "/: 1 dirs, t: " << NDIRS << " dirs" << std::endl;
+    std::cout << "/: 1 dirs, t: " << NDIRS << " dirs" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    torn = crash_image(before_cp, after_cp);
+    if (!tear_last_group(torn))
+        std::cout << "Error: no group in the log" << std::endl;
+    std::vector<char> torn_spill = crash_image(before_cp, after_cp);
+    {
+        journal_spill sp;
+        std::memcpy(&sp, torn_spill.data() + (size_t)first_spill(after_cp) * BLOCK_SIZE, sizeof(sp));
+        std::memset(torn_spill.data() + (size_t)sp.images[0].at * BLOCK_SIZE, 0, BLOCK_SIZE);
+    }
+    for (auto *img : {&torn, &torn_spill}) {
+        write_image(*img);
+        FS mounted;
+        std::cout << "/: " << count_dirs(mounted, "/") << " dirs, t: " << count_dirs(mounted, "t")
+                  << " dirs" << std::endl;
+    }
+    std::cout << "-----" << std::endl;
+    // back to what filesystem has cached
+    write_image(after_cp);
+
+    std::cout << "format(" << HUGE_DISK << "), fallocate a file of " << HUGE_FILE
+              << " blocks in one group larger than the log, mount..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "fallocate: 0" << std::endl;
+    std::cout << "name\t type\t accessrights\t size" << std::endl;
+    std::cout << "huge\tfile\trw-\t" << (uint64_t)HUGE_FILE * BLOCK_SIZE << std::endl;
+    std::cout << "read back: 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.format(HUGE_DISK);
+    int fd = filesystem.open("huge", OPEN_WRITE | OPEN_CREATE);
+    std::cout << "fallocate: " << filesystem.fallocate(fd, 0, (uint64_t)HUGE_FILE * BLOCK_SIZE) << std::endl;
+    filesystem.pwrite(fd, "end", 3, (uint64_t)HUGE_FILE * BLOCK_SIZE - 3);
+    filesystem.close(fd);
+    filesystem.sync();
+    {
+        FS mounted;
+        mounted.ls();
+        char buf[3];
+        fd = mounted.open("huge", OPEN_READ);
+        ssize_t got = mounted.pread(fd, buf, 3, (uint64_t)HUGE_FILE * BLOCK_SIZE - 3);
+        std::cout << "read back: " << (got == 3 && std::memcmp(buf, "end", 3) == 0 ? 0 : -1) << std::endl;
+        mounted.close(fd);
+    }
+    std::cout << "-----" << std::endl;
+    // leave a disk of the usual size behind
+    filesystem.format(DISK_BLOCKS);
+}
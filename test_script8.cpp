@@ -0,0 +1,179 @@
+/******************************************************************************
+ *             File : test_script8.cpp
+ *
+ * Test program for directories: hashed (htree) directories that span many
+ * blocks, mv within and between them, and cp into a directory that has
+ * the name taken. Checked again on a second mount of the disk.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+#define NFILES 100        // far more than one directory block holds
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// create() reads the file from stdin
+static void
+create_from(FS &fs, const std::string &path, const std::string &text)
+{
+    std::istringstream in(text + "\n");
+    std::streambuf *old = std::cin.rdbuf(in.rdbuf());
+    fs.create(path);
+    std::cin.rdbuf(old);
+}
+
+static std::string
+contents(FS &fs, const std::string &path)
+{
+    static std::vector<char> mem(1 << 20);
+    OutputSink out(mem.data(), mem.size());
+    if (fs.cat(path, out) != 0)
+        return "(cat failed)";
+    return std::string(mem.data(), out.size());
+}
+
+static int
+count_files(FS &fs, const std::string &dir)
+{
+    static std::vector<char> mem(1 << 16);
+    fs.cd(dir);
+    OutputSink out(mem.data(), mem.size());
+    fs.ls(out);
+    fs.cd("/");
+    std::string text(mem.data(), out.size());
+    int n = 0;
+    for (size_t p = 0; (p = text.find("\tfile\t", p)) != std::string::npos; ++p)
+        ++n;
+    return n;
+}
+
+static std::string
+name_of(int i)
+{
+    char name[16];
+    std::snprintf(name, sizeof(name), "big/n%03d", i);
+    return name;
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Directories ..." << std::endl;
+    PRINTDIV2;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+
+    std::cout << "mkdir big, create " << NFILES << " files in it, rm every other one..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "before rm: " << NFILES << " files, 0 wrong" << std::endl;
+    std::cout << "after rm: " << NFILES / 2 << " files, 0 wrong, 0 removed found" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mkdir("big");
+    for (int i = 0; i < NFILES; ++i)
+        create_from(filesystem, name_of(i), name_of(i));
+    int wrong = 0;
+    for (int i = 0; i < NFILES; ++i)
+        wrong += contents(filesystem, name_of(i)) != name_of(i) + "\n";
+    std::cout << "before rm: " << count_files(filesystem, "big") << " files, " << wrong << " wrong" << std::endl;
+    for (int i = 0; i < NFILES; i += 2)
+        filesystem.rm(name_of(i));
+    wrong = 0;
+    int found = 0;
+    for (int i = 1; i < NFILES; i += 2)
+        wrong += contents(filesystem, name_of(i)) != name_of(i) + "\n";
+    std::cout.setstate(std::ios::failbit);   // the misses report errors
+    for (int i = 0; i < NFILES; i += 2)
+        found += contents(filesystem, name_of(i)) != "(cat failed)";
+    std::cout.clear();
+    std::cout << "after rm: " << count_files(filesystem, "big") << " files, " << wrong << " wrong, "
+              << found << " removed found" << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "mkdir mvd, create a and b, mv a mvd/b, mv b mvd/b, mv b mvd, mv b big/n001, mv b big/n000..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "File renamed successfully" << std::endl;
+    std::cout << "mv a mvd/b: 0" << std::endl;
+    std::cout << "mv b mvd/b: -1" << std::endl;
+    std::cout << "mv b mvd: -1" << std::endl;
+    std::cout << "mv b big/n001: -1" << std::endl;
+    std::cout << "File renamed successfully" << std::endl;
+    std::cout << "mv b big/n000: 0" << std::endl;
+    std::cout << "/: 0 files, mvd: 1 files, big: " << NFILES / 2 + 1 << " files" << std::endl;
+    std::cout << "mvd/b: a" << std::endl;
+    std::cout << "big/n000: b" << std::endl;
+    std::cout << "big/n001: " << name_of(1) << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mkdir("mvd");
+    create_from(filesystem, "a", "a");
+    create_from(filesystem, "b", "b");
+    auto mv = [&](const std::string &from, const std::string &to) {
+        int rc = filesystem.mv(from, to);
+        std::cout << "mv " << from << " " << to << ": " << rc << std::endl;
+    };
+    mv("a", "mvd/b");
+    mv("b", "mvd/b");
+    mv("b", "mvd");
+    mv("b", name_of(1));
+    mv("b", name_of(0));
+    std::cout << "/: " << count_files(filesystem, "/") << " files, mvd: " << count_files(filesystem, "mvd")
+              << " files, big: " << count_files(filesystem, "big") << " files" << std::endl;
+    std::cout << "mvd/b: " << contents(filesystem, "mvd/b");
+    std::cout << "big/n000: " << contents(filesystem, name_of(0));
+    std::cout << "big/n001: " << contents(filesystem, name_of(1));
+    std::cout << "-----" << std::endl;
+
+    std::cout << "create c, cp c mvd twice..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "File copied successfully" << std::endl;
+    std::cout << "cp c mvd: 0" << std::endl;
+    std::cout << "cp c mvd: -1" << std::endl;
+    std::cout << "mvd: 2 files" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    create_from(filesystem, "c", "c");
+    for (int i = 0; i < 2; ++i) {
+        int rc = filesystem.cp("c", "mvd");
+        std::cout << "cp c mvd: " << rc << std::endl;
+    }
+    std::cout << "mvd: " << count_files(filesystem, "mvd") << " files" << std::endl;
+    std::cout << "-----" << std::endl;
+
+    std::cout << "sync and mount again..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "big: " << NFILES / 2 + 1 << " files" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.sync();
+    {
+        FS mounted;
+        std::cout << "big: " << count_files(mounted, "big") << " files" << std::endl;
+    }
+    std::cout << "-----" << std::endl;
+}
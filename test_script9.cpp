@@ -0,0 +1,177 @@
+/******************************************************************************
+ *             File : test_script9.cpp
+ *
+ * Test program for asynchronous block I/O: cat and cp of files spread over
+ * several extents, run with many transfers in flight through the
+ * thread-pool engine (fstream backend) and through io_uring (file
+ * descriptor backend, where the kernel has it), compared with the
+ * synchronous path. Each block moved is counted once in the stats.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+#include "aio.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+#define BIG_BYTES (1000000 + 123)        // last block partial
+#define PIECES 16                        // big is written in as many extents
+#define SPARSE_BYTES (300 << 10)
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+static std::string
+contents(FS &fs, const std::string &path)
+{
+    static std::vector<char> mem(2 << 20);
+    OutputSink out(mem.data(), mem.size());
+    if (fs.cat(path, out) != 0)
+        return "(cat failed)";
+    return std::string(mem.data(), out.size());
+}
+
+// what fn writes to std::cout
+static std::string
+captured(const std::function<void()> &fn)
+{
+    std::ostringstream s;
+    std::streambuf *old = std::cout.rdbuf(s.rdbuf());
+    fn();
+    std::cout.rdbuf(old);
+    return s.str();
+}
+
+static void
+write_file(FS &fs, const std::string &path, const std::string &data)
+{
+    int fd = fs.open(path, OPEN_WRITE | OPEN_CREATE);
+    if (fd < 0 || fs.write(fd, data.data(), data.size()) != (ssize_t)data.size())
+        std::cout << "Error: writing " << path << " failed" << std::endl;
+    fs.close(fd);
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Asynchronous I/O ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Formatting, writing big of " << BIG_BYTES << " bytes in " << PIECES
+              << " pieces with a small file after each, and sparse of " << SPARSE_BYTES << " bytes, sync..." << std::endl;
+    ret_val = filesystem.format();
+    if (ret_val)
+        std::cout << "Error: format failed, error code " << ret_val << std::endl;
+    std::string big(BIG_BYTES, '\0');
+    for (size_t i = 0; i < big.size(); ++i)
+        big[i] = (char)(i * 13 + i / BLOCK_SIZE);
+    // each small file takes the blocks behind the piece before it, so the
+    // next piece starts a new extent
+    int fd = filesystem.open("big", OPEN_WRITE | OPEN_CREATE);
+    size_t piece = (BIG_BYTES / PIECES + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    for (size_t off = 0, i = 0; off < big.size(); off += piece, ++i) {
+        size_t n = std::min(piece, big.size() - off);
+        if (filesystem.write(fd, big.data() + off, n) != (ssize_t)n)
+            std::cout << "Error: writing big failed" << std::endl;
+        write_file(filesystem, "s" + std::to_string(i), std::string(BLOCK_SIZE, 's'));
+    }
+    filesystem.close(fd);
+    std::string sparse(SPARSE_BYTES, '\0');
+    std::memcpy(&sparse[SPARSE_BYTES / 2], "middle", 6);
+    fd = filesystem.open("sparse", OPEN_WRITE | OPEN_CREATE);
+    filesystem.truncate(fd, SPARSE_BYTES);
+    filesystem.pwrite(fd, "middle", 6, SPARSE_BYTES / 2);
+    filesystem.close(fd);
+    filesystem.sync();
+
+    struct Engine {
+        const char *name;
+        DiskBackend backend;
+    };
+    for (Engine e : {Engine{"pool", DISK_FSTREAM}, Engine{"io_uring", DISK_FD}}) {
+        DiskOptions opts;
+        opts.backend = e.backend;
+        if (e.backend == DISK_FD) {
+            Disk probe(opts);
+            AioQueue q(probe);
+            if (!q.uring())
+                std::cout << "(no io_uring here: the file descriptor backend uses the pool as well)" << std::endl;
+        }
+        FS mounted(opts);
+        std::cout << "mount with the " << e.name << " engine, cat and cat_async of big and sparse, "
+                  << "cp_async of both..." << std::endl;
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "big: cat equal, cat_async equal" << std::endl;
+        std::cout << "File copied successfully" << std::endl;
+        std::cout << "big copy: equal" << std::endl;
+        std::cout << "sparse: cat equal, cat_async equal" << std::endl;
+        std::cout << "File copied successfully" << std::endl;
+        std::cout << "sparse copy: equal" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        // the first lookup reads the root directory and the FAT page
+        contents(mounted, "s0");
+        for (const std::string *want : {&big, &sparse}) {
+            std::string name = want == &big ? "big" : "sparse";
+            std::string copy = name + "_" + e.name;
+            std::string sync_out = contents(mounted, name);
+            std::string async_out = captured([&] { mounted.cat_async(name); });
+            std::cout << name << ": cat " << (sync_out == *want ? "equal" : "differs")
+                      << ", cat_async " << (async_out == sync_out ? "equal" : "differs") << std::endl;
+            mounted.cp_async(name, copy);
+            std::cout << name << " copy: " << (contents(mounted, copy) == *want ? "equal" : "differs") << std::endl;
+            mounted.rm(copy);
+        }
+        std::cout << "-----" << std::endl;
+
+        size_t nblocks = (BIG_BYTES + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        std::cout << "cold cache, stats of cat_async and cp_async of big..." << std::endl;
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "File copied successfully" << std::endl;
+        std::cout << "cat_async: " << nblocks << " read, 0 written" << std::endl;
+        std::cout << "cp_async: " << nblocks << " read, " << nblocks << " written" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        {
+            FS cold(opts);
+            contents(cold, "s0");
+            stats_reset();
+            captured([&] { cold.cat_async("big"); });
+            StatsSnapshot cat = stats_snapshot();
+            stats_reset();
+            cold.cp_async("big", "big_copy");
+            StatsSnapshot cp = stats_snapshot();
+            cold.rm("big_copy");
+            std::cout << "cat_async: " << cat.counters[STAT_BLOCKS_READ] << " read, "
+                      << cat.counters[STAT_BLOCKS_WRITTEN] << " written" << std::endl;
+            std::cout << "cp_async: " << cp.counters[STAT_BLOCKS_READ] << " read, "
+                      << cp.counters[STAT_BLOCKS_WRITTEN] << " written" << std::endl;
+        }
+        std::cout << "-----" << std::endl;
+    }
+    // the mounts above changed the disk behind filesystem's back
+    filesystem.format();
+}
@@ -0,0 +1,326 @@
+// tree.cpp: operations on whole directory trees (rm -r, cp -r, du, find)
+#include "fs.h"
+#include "workers.h"
+#include <condition_variable>
+#include <deque>
+#include <fnmatch.h>
+
+namespace {
+
+// directories one worker of a walk has found and not listed yet; the
+// worker takes the newest, a thief the oldest, which is nearest the top
+// and so likely the most work
+struct WalkQueue {
+    std::mutex lock;
+    std::deque<std::pair<uint32_t, std::string>> dirs;
+};
+
+std::string join(const std::string &dir, std::string_view name) {
+    std::string p = dir;
+    if (p.empty() || p.back() != '/') p += '/';
+    p += name;
+    return p;
+}
+
+} // namespace
+
+int FS::walk_tree(uint32_t top, const std::string &path, bool reader, const WalkFn &fn) {
+    size_t threads = 1;
+    if (reader && disk.concurrent_views())
+        threads = std::min<size_t>(WORKERS, std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<WalkQueue> queues(threads);
+    std::atomic<size_t> pending{0};      // directories queued or being listed
+    std::atomic<size_t> queued{0};       // directories queued
+    std::atomic<bool> failed{false};
+    // a worker with nothing to take sleeps until a directory is queued or
+    // the walk is over; both are announced under idle_lock, so no wakeup
+    // falls between a sleeper's check and its wait
+    std::mutex idle_lock;
+    std::condition_variable idle_cv;
+    auto wake = [&](bool all) {
+        std::lock_guard<std::mutex> hold(idle_lock);
+        if (all) idle_cv.notify_all();
+        else idle_cv.notify_one();
+    };
+
+    auto list = [&](unsigned me, DirGuard &g, uint32_t dir, const std::string &dpath) {
+        if (reader) {
+            g.enter(dir);
+            if (!is_directory(dir)) return;    // removed since it was found
+        }
+        fn(dir, dpath, nullptr);
+        DirIter it = dir_begin(dir);
+        dir_entry e;
+        int rc;
+        while ((rc = dir_next(it, e)) > 0) {
+            std::string_view name = entry_name(e);
+            if (is_dot(name)) continue;
+            fn(dir, dpath, &e);
+            if (e.type == TYPE_DIR) {
+                ++pending;
+                {
+                    std::lock_guard<std::mutex> hold(queues[me].lock);
+                    queues[me].dirs.emplace_back(e.first_blk, join(dpath, name));
+                }
+                ++queued;
+                if (threads > 1) wake(false);
+            }
+        }
+        if (rc < 0) failed = true;
+    };
+    auto work = [&](unsigned me) {
+        DirGuard g(*this);
+        while (pending > 0) {
+            std::pair<uint32_t, std::string> item;
+            bool got = false;
+            for (size_t k = 0; k < threads && !got; ++k) {
+                WalkQueue &q = queues[(me + k) % threads];
+                std::lock_guard<std::mutex> hold(q.lock);
+                if (q.dirs.empty()) continue;
+                if (k == 0) {
+                    item = std::move(q.dirs.back());
+                    q.dirs.pop_back();
+                } else {
+                    item = std::move(q.dirs.front());
+                    q.dirs.pop_front();
+                }
+                --queued;
+                got = true;
+            }
+            if (!got) {
+                std::unique_lock<std::mutex> hold(idle_lock);
+                idle_cv.wait(hold, [&] { return pending == 0 || queued > 0; });
+                continue;
+            }
+            list(me, g, item.first, item.second);
+            g.release();
+            if (--pending == 0) wake(true);
+        }
+    };
+
+    // the top directory shows whether there is anything to share out
+    {
+        DirGuard g(*this);
+        list(0, g, top, path);
+    }
+    if (pending > 0) {
+        std::vector<std::thread> thieves;
+        for (unsigned t = 1; t < threads; ++t) thieves.emplace_back(work, t);
+        work(0);
+        for (std::thread &t : thieves) t.join();
+    }
+    return failed ? -1 : 0;
+}
+
+// File chains go as the walk finds them, directory chains once it is done
+// with them. A directory that cannot be read leaks what is below it.
+int FS::free_tree(uint32_t top) {
+    std::vector<uint32_t> dirs;
+    int rc = walk_tree(top, "", false, [&](uint32_t dir, const std::string &, const dir_entry *e) {
+        if (!e) dirs.push_back(dir);
+        else if (e->type != TYPE_DIR && release_ref(e->first_blk)) free_chain(e->first_blk);
+    });
+    for (uint32_t d : dirs) {
+        dcache.invalidate_dir(d);
+        free_chain(d);
+    }
+    return rc;
+}
+
+int FS::find_dir(std::string_view path) {
+    DirGuard g(*this);
+    uint32_t parent; std::string_view name;
+    if (resolve_path(path, parent, name, &g) != 0) return -1;
+    // the root has no "." and ".." entries
+    if (name.empty() || name == ".") return parent;
+    if (name == "..") return get_parent_directory(parent);
+    dir_entry e; DirLoc loc;
+    if (dir_find(parent, name, loc, &e) != 0 || e.type != TYPE_DIR) return -1;
+    return e.first_blk;
+}
+
+int FS::rm_tree(std::string_view path) {
+    OpTimer timer(OP_RM);
+    DirGuard g(*this);
+    MetaOp op(*this);
+    uint32_t dirblk; std::string_view name;
+    if (resolve_path(path, dirblk, name) != 0 || name.empty() || is_dot(name)) return -1;
+    dir_entry ent; DirLoc loc;
+    if (dir_find(dirblk, name, loc, &ent) != 0) return -1;
+    if (ent.type != TYPE_DIR) {
+        g.lock(dirblk);
+        if (release_ref(ent.first_blk)) free_chain(ent.first_blk);
+        return dir_remove(dirblk, loc);
+    }
+    // readers may be anywhere in the tree
+    g.lock_all();
+    int rc = free_tree(ent.first_blk);
+    if (dir_remove(dirblk, loc) != 0) rc = -1;
+    return rc;
+}
+
+// The destination tree is laid out in full first, directories, entries and
+// a chain for every file, and the workers then only copy data from chain
+// to chain. Whatever fails takes the whole new tree back out.
+int FS::cp_tree(std::string_view sourcepath, std::string_view destpath, bool reflink) {
+    DirGuard g(*this);
+    MetaOp op(*this);
+    uint32_t sdir; std::string_view sname;
+    if (resolve_path(sourcepath, sdir, sname) != 0 || sname.empty()) return -1;
+    dir_entry src; DirLoc sloc;
+    if (dir_find(sdir, sname, sloc, &src) != 0) return -1;
+    if (src.type != TYPE_DIR) return cp_file(sourcepath, destpath, reflink, false);
+    OpTimer timer(OP_CP);
+
+    // into destpath if that is a directory, else as destpath
+    uint32_t ddir; std::string_view dname;
+    if (resolve_path(destpath, ddir, dname) != 0) return -1;
+    dir_entry de; DirLoc dloc;
+    if (dname.empty() || is_dot(dname)) {
+        if (dname == "..") ddir = get_parent_directory(ddir);
+        dname = sname;
+    } else if (dir_find(ddir, dname, dloc, &de) == 0) {
+        if (de.type != TYPE_DIR) return -1;
+        ddir = de.first_blk;
+        dname = sname;
+    }
+    if (dname.length() > MAX_NAME_LEN) {
+        std::cout << "Error: Destination name too long (max " << MAX_NAME_LEN << " characters)\n";
+        return -1;
+    }
+    if (is_dot(dname) || dir_find(ddir, dname, dloc) == 0) return -1;
+    for (uint32_t d = ddir;; d = get_parent_directory(d)) {
+        if (d == src.first_blk) {
+            std::cout << "Error: Cannot copy " << sourcepath << " into itself\n";
+            return -1;
+        }
+        if (d == ROOT_BLOCK) break;
+    }
+    g.lock(ddir);
+    int top = dir_create(ddir, dname);
+    if (top < 0) return -1;
+
+    struct Copy {
+        int32_t src, dst;
+        size_t size;
+    };
+    std::vector<Copy> copies;
+    uint64_t bytes = 0;
+    std::unordered_map<uint32_t, uint32_t> to = {{src.first_blk, (uint32_t)top}};
+    bool ok = true;
+    int rc = walk_tree(src.first_blk, "", false, [&](uint32_t dir, const std::string &, const dir_entry *e) {
+        if (!ok || !e) return;
+        uint32_t parent = to[dir];
+        if (e->type == TYPE_DIR) {
+            int nb = dir_create(parent, entry_name(*e));
+            if (nb < 0) ok = false;
+            else to[e->first_blk] = nb;
+            return;
+        }
+        dir_entry ne = *e;
+        if (is_inline(*e)) {
+            uint8_t data[INLINE_MAX];
+            DirLoc loc;
+            if (dir_find(dir, entry_name(*e), loc) != 0 || dir_inline(loc, *e, data) != 0 ||
+                dir_add(parent, ne, nullptr, data) != 0)
+                ok = false;
+            return;
+        }
+        bool shared = reflink && add_ref(e->first_blk) == 0;
+        if (!shared) {
+            int first = alloc_chain(std::max<size_t>(1, blocks_for(chain_bytes(*e))));
+            if (first < 0) {
+                ok = false;
+                return;
+            }
+            ne.first_blk = first;
+        }
+        if (dir_add(parent, ne) != 0) {
+            if (shared) release_ref(ne.first_blk);
+            else free_chain(ne.first_blk);
+            ok = false;
+        } else if (!shared) {
+            copies.push_back({(int32_t)e->first_blk, (int32_t)ne.first_blk, chain_bytes(*e)});
+            bytes += chain_bytes(*e);
+        }
+    });
+    if (rc != 0) ok = false;
+    if (ok) {
+        std::atomic<bool> copied{true};
+        parallel_for(copies.size(), workers_for(copies.size(), bytes), [&](size_t i) {
+            if (copy_chain(copies[i].src, copies[i].size, copies[i].dst, 0) != 0) copied = false;
+        });
+        ok = copied;
+    }
+    if (!ok) {
+        free_tree(top);
+        if (dir_find(ddir, dname, dloc) == 0) dir_remove(ddir, dloc);
+        return -1;
+    }
+    std::cout << "Directory copied successfully\n";
+    return 0;
+}
+
+// Reflinked chains count once per file that uses them, inline files not
+// at all; a directory's blocks, its index and leaves included, are counted
+// while it is held.
+int FS::du(std::string_view dirpath, OutputSink &out) {
+    OpTimer timer(OP_DU);
+    int top = find_dir(dirpath);
+    if (top < 0) {
+        std::cout << "Error: Directory not found: " << dirpath << std::endl;
+        return -1;
+    }
+    // the root is block 0, which reads as FAT_FREE
+    auto chain_blocks = [this](int32_t b) {
+        uint64_t n = 1;
+        while ((b = fat[b]) != FAT_EOF && b != FAT_FREE) ++n;
+        return n;
+    };
+    std::atomic<uint64_t> bytes{0}, blocks{0}, files{0}, dirs{0};
+    int rc = walk_tree(top, std::string(dirpath), true, [&](uint32_t dir, const std::string &, const dir_entry *e) {
+        if (!e) {
+            blocks.fetch_add(chain_blocks(dir), std::memory_order_relaxed);
+        } else if (e->type == TYPE_DIR) {
+            dirs.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            files.fetch_add(1, std::memory_order_relaxed);
+            bytes.fetch_add(e->size, std::memory_order_relaxed);
+            if (is_compressed(*e))
+                blocks.fetch_add(e->zblocks, std::memory_order_relaxed);
+            else if (!is_inline(*e))
+                blocks.fetch_add(std::max<size_t>(1, blocks_for(e->size)), std::memory_order_relaxed);
+        }
+    });
+    std::string row = "path\t size\t blocks\t files\t dirs\n";
+    row += std::string(dirpath) + "\t" + std::to_string(bytes) + "\t" + std::to_string(blocks) +
+           "\t" + std::to_string(files) + "\t" + std::to_string(dirs) + "\n";
+    if (out.write(row) != 0 || out.flush() != 0) return -1;
+    return rc;
+}
+
+int FS::find(std::string_view dirpath, std::string_view pattern, OutputSink &out) {
+    OpTimer timer(OP_FIND);
+    int top = find_dir(dirpath);
+    if (top < 0) {
+        std::cout << "Error: Directory not found: " << dirpath << std::endl;
+        return -1;
+    }
+    std::string pat(pattern);
+    std::mutex lock;
+    std::vector<std::string> hits;
+    int rc = walk_tree(top, std::string(dirpath), true, [&](uint32_t, const std::string &path, const dir_entry *e) {
+        if (!e) return;
+        std::string name(entry_name(*e));
+        if (!pat.empty() && fnmatch(pat.c_str(), name.c_str(), 0) != 0) return;
+        std::string hit = join(path, name);
+        std::lock_guard<std::mutex> hold(lock);
+        hits.push_back(std::move(hit));
+    });
+    std::sort(hits.begin(), hits.end());
+    for (const std::string &h : hits) {
+        if (out.write(h) != 0 || out.write("\n", 1) != 0) return -1;
+    }
+    if (out.flush() != 0) return -1;
+    return rc;
+}
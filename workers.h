@@ -0,0 +1,29 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+// fn(i) for each i in [0, n) on up to threads threads, the calling one
+// among them; each thread takes the next i when it is done with the last
+template <class Fn>
+void parallel_for(size_t n, size_t threads, Fn fn)
+{
+    threads = std::min(n, threads);
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i; (i = next++) < n; )
+            fn(i);
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; ++t)
+        workers.emplace_back(work);
+    work();
+    for (std::thread &t : workers)
+        t.join();
+}
+
+#endif // __WORKERS_H__